@@ -25,6 +25,15 @@
 #endif
 #endif
 
+/* How long to wait for the master to answer MSG_HELLO or MSG_STATUS, in
+** milliseconds. Masters that don't know about them never answer. */
+#define HELLO_TIMEOUT 200
+
+/* The most output that is kept waiting for the terminal. Once the queue is
+** this full, the socket is left alone, so that the rest waits in the master
+** (which applies its queue policy to it). */
+#define OUTPUT_QUEUE (16 * BUFSIZE)
+
 /*
 ** The current terminal settings. After coming back from a suspend, we
 ** restore this.
@@ -32,6 +41,17 @@
 static struct termios cur_term;
 /* 1 if the window size changed */
 static int win_changed;
+/* Output from the session that the terminal has not taken yet, and the
+** descriptor it is written to. */
+static unsigned char out_queue[OUTPUT_QUEUE];
+static size_t out_start, out_len;
+static int out_fd = 1;
+/* The output ring, when the output is read from there instead of the
+** socket, and the eventfd the master wakes us up with. */
+static struct ring *ring;
+static int ring_wake_fd = -1;
+
+static int ring_request(int s);
 
 /* Restores the original terminal settings. */
 static void
@@ -45,30 +65,21 @@ restore_term(void)
 }
 
 /* Connects to a unix domain socket */
-static int
+int
 connect_socket(char *name)
 {
 	int s;
-	struct sockaddr_un sockun;
-
-	if (strlen(name) > sizeof(sockun.sun_path) - 1)
-	{
-		errno = ENAMETOOLONG;
-		return -1;
-	}
 
 	s = socket(PF_UNIX, SOCK_STREAM, 0);
 	if (s < 0)
 		return -1;
-	sockun.sun_family = AF_UNIX;
-	strcpy(sockun.sun_path, name);
-	if (connect(s, (struct sockaddr *)&sockun, sizeof(sockun)) < 0)
+	if (socket_at(s, name, 0) < 0)
 	{
 		close(s);
 
 		/* ECONNREFUSED is also returned for regular files, so make
 		** sure we are trying to connect to a socket. */
-		if (errno == ECONNREFUSED)
+		if (errno == ECONNREFUSED && !SOCKET_ABSTRACT(name))
 		{
 			struct stat st;
 
@@ -82,6 +93,16 @@ connect_socket(char *name)
 	return s;
 }
 
+/* Connects to the socket given on the command line, or to the relay it
+** names. Output from a relay may be compressed if compress is set. */
+static int
+open_socket(int compress)
+{
+	if (relay_address(sockname))
+		return relay_connect(sockname, compress);
+	return connect_socket(sockname);
+}
+
 /* Signal */
 static RETSIGTYPE
 die(int sig)
@@ -102,6 +123,52 @@ win_change(ATTRIBUTE_UNUSED int sig)
 	win_changed = 1;
 }
 
+/* Gets a descriptor that writes to the terminal without blocking, so that a
+** slow terminal can't keep us from reading the keyboard. The terminal is
+** opened again rather than putting stdout into non-blocking mode, since
+** stdout is shared with the shell that started us, which wouldn't expect
+** it. If that can't be done, stdout is used as it is. */
+static void
+open_output(void)
+{
+	char *name = isatty(1) ? ttyname(1) : NULL;
+	int fd;
+
+	if (!name)
+		return;
+	fd = open(name, O_WRONLY|O_NOCTTY|O_NONBLOCK);
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	out_fd = fd;
+}
+
+/* Writes as much of the queued output as the terminal takes right now. */
+static void
+flush_output(void)
+{
+	while (out_len > 0)
+	{
+		ssize_t ret = write(out_fd, out_queue + out_start, out_len);
+
+		if (ret > 0)
+		{
+			out_start += ret;
+			out_len -= ret;
+		}
+		else if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		else
+		{
+			printf(EOS "\r\n[write failed]\r\n");
+			exit(1);
+		}
+	}
+	out_start = 0;
+}
+
 /* Handles input from the keyboard. */
 static void
 process_kbd(int s, struct packet *pkt)
@@ -119,7 +186,10 @@ process_kbd(int s, struct packet *pkt)
 		kill(getpid(), SIGTSTP);
 		tcsetattr(0, TCSADRAIN, &cur_term);
 
-		/* Tell the master that we are returning. */
+		/* Tell the master that we are returning. What it put into the
+		** ring in the meantime is of no use anymore. */
+		if (ring)
+			ring_restart(ring);
 		pkt->type = MSG_ATTACH;
 		write_packet_or_fail(s, pkt);
 
@@ -144,43 +214,52 @@ process_kbd(int s, struct packet *pkt)
 	write_packet_or_fail(s, pkt);
 }
 
+/* Ask the master for a redraw. */
+static void
+send_redraw(int s, struct packet *pkt)
+{
+	pkt->type = MSG_REDRAW;
+	pkt->len = redraw_method;
+	ioctl(0, TIOCGWINSZ, &pkt->u.ws);
+	write_packet_or_fail(s, pkt);
+}
+
+/* Move output from the ring into the queue, as much as there is room for.
+** If we fell so far behind that some of it was lost, the screen is redrawn
+** to make up for it. */
+static void
+read_ring(int s)
+{
+	struct packet pkt;
+	size_t len;
+	int lost;
+
+	/* Make room at the end of the queue. */
+	if (out_start + out_len > OUTPUT_QUEUE - BUFSIZE)
+	{
+		memmove(out_queue, out_queue + out_start, out_len);
+		out_start = 0;
+	}
+	len = ring_get(ring, out_queue + out_start + out_len,
+		       OUTPUT_QUEUE - out_start - out_len, &lost);
+	out_len += len;
+	if (lost)
+	{
+		memset(&pkt, 0, sizeof(struct packet));
+		send_redraw(s, &pkt);
+	}
+}
+
 int
 attach_main(int noerror)
 {
 	struct packet pkt;
-	unsigned char buf[BUFSIZE];
-	fd_set readfds;
+	fd_set readfds, writefds;
 	int s;
 
 	/* Attempt to open the socket. Don't display an error if noerror is
 	** set. */
-	s = connect_socket(sockname);
-	if (s < 0 && errno == ENAMETOOLONG)
-	{
-		char *slash = strrchr(sockname, '/');
-
-		/* Try to shorten the socket's path name by using chdir. */
-		if (slash)
-		{
-			int dirfd = open(".", O_RDONLY);
-
-			if (dirfd >= 0)
-			{
-				*slash = '\0';
-				if (chdir(sockname) >= 0)
-				{
-					s = connect_socket(slash + 1);
-					if (s >= 0 && fchdir(dirfd) < 0)
-					{
-						close(s);
-						s = -1;
-					}
-				}
-				*slash = '/';
-				close(dirfd);
-			}
-		}
-	}
+	s = open_socket(1);
 	if (s < 0)
 	{
 		if (!noerror)
@@ -219,6 +298,14 @@ attach_main(int noerror)
 
 	/* Clear the screen. This assumes VT100. */
 	write_buf_or_fail(1, "\33[H\33[J", 6);
+	open_output();
+
+	/* Read the output from the ring if we can. */
+	if (use_ring && !relay_address(sockname) && ring_request(s) < 0)
+	{
+		printf(EOS "\r\n[ring request failed]\r\n");
+		exit(1);
+	}
 
 	/* Tell the master that we want to attach. */
 	memset(&pkt, 0, sizeof(struct packet));
@@ -226,47 +313,43 @@ attach_main(int noerror)
 	write_packet_or_fail(s, &pkt);
 
 	/* We would like a redraw, too. */
-	pkt.type = MSG_REDRAW;
-	pkt.len = redraw_method;
-	ioctl(0, TIOCGWINSZ, &pkt.u.ws);
-	write_packet_or_fail(s, &pkt);
+	send_redraw(s, &pkt);
 
 	/* Wait for things to happen */
 	while (1)
 	{
-		int n;
+		struct timeval tv = {0, 0};
+		int n, max = s > out_fd ? s : out_fd;
+		int room = (out_len <= OUTPUT_QUEUE - BUFSIZE);
+		int busy = room && relay_pending();
 
 		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
 		FD_SET(0, &readfds);
-		FD_SET(s, &readfds);
-		n = select(s + 1, &readfds, NULL, NULL, NULL);
+		if (room)
+			FD_SET(s, &readfds);
+		if (out_len > 0)
+			FD_SET(out_fd, &writefds);
+		/* Only sleep on the ring once it has been read dry. */
+		if (ring)
+		{
+			FD_SET(ring_wake_fd, &readfds);
+			if (ring_wake_fd > max)
+				max = ring_wake_fd;
+			if (room && !ring_sleep(ring))
+				busy = 1;
+		}
+		/* Don't wait if the relay has output left over. */
+		n = select(max + 1, &readfds, &writefds, NULL,
+			   busy ? &tv : NULL);
 		if (n < 0 && errno != EINTR && errno != EAGAIN)
 		{
 			printf(EOS "\r\n[select failed]\r\n");
 			exit(1);
 		}
 
-		/* Pty activity */
-		if (n > 0 && FD_ISSET(s, &readfds))
-		{
-			ssize_t len = read(s, buf, sizeof(buf));
-
-			if (len == 0)
-			{
-				printf(EOS "\r\n[EOF - dtach terminating]"
-				       "\r\n");
-				exit(0);
-			}
-			else if (len < 0)
-			{
-				printf(EOS "\r\n[read returned an error]\r\n");
-				exit(1);
-			}
-			/* Send the data to the terminal. */
-			write_buf_or_fail(1, buf, len);
-			n--;
-		}
-		/* stdin activity */
+		/* stdin activity. The keyboard goes first, so that the detach
+		** character works however much output is waiting. */
 		if (n > 0 && FD_ISSET(0, &readfds))
 		{
 			ssize_t len;
@@ -280,7 +363,6 @@ attach_main(int noerror)
 
 			pkt.len = len;
 			process_kbd(s, &pkt);
-			n--;
 		}
 
 		/* Window size changed? */
@@ -292,44 +374,264 @@ attach_main(int noerror)
 			ioctl(0, TIOCGWINSZ, &pkt.u.ws);
 			write_packet_or_fail(s, &pkt);
 		}
+
+		/* The terminal has room for more. */
+		if (n > 0 && FD_ISSET(out_fd, &writefds))
+			flush_output();
+
+		/* Ring activity */
+		if (ring)
+		{
+			if (n > 0 && FD_ISSET(ring_wake_fd, &readfds))
+				ring_clear(ring_wake_fd);
+			if (room && ring_pending(ring))
+			{
+				read_ring(s);
+				flush_output();
+			}
+		}
+
+		/* Pty activity */
+		if ((n > 0 && FD_ISSET(s, &readfds)) ||
+		    (room && relay_pending()))
+		{
+			ssize_t len;
+
+			/* Make room at the end of the queue. */
+			if (out_start + out_len > OUTPUT_QUEUE - BUFSIZE)
+			{
+				memmove(out_queue, out_queue + out_start,
+					out_len);
+				out_start = 0;
+			}
+			len = relay_read(s, out_queue + out_start + out_len,
+					 OUTPUT_QUEUE - out_start - out_len);
+			if (len == 0)
+			{
+				/* Show whatever the ring still holds. */
+				while (ring && ring_pending(ring))
+				{
+					write_buf_or_fail(1,
+							  out_queue + out_start,
+							  out_len);
+					out_start = out_len = 0;
+					read_ring(s);
+				}
+				write_buf_or_fail(1, out_queue + out_start,
+						  out_len);
+				printf(EOS "\r\n[EOF - dtach terminating]"
+				       "\r\n");
+				exit(0);
+			}
+			else if (len < 0)
+			{
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				printf(EOS "\r\n[read returned an error]\r\n");
+				exit(1);
+			}
+			/* Send the data to the terminal. */
+			out_len += len;
+			flush_output();
+		}
 	}
 	return 0;
 }
 
-int
-push_main()
+/* Write buf to fd handling partial writes. Returns -1 on failure. */
+static int
+write_all(int fd, const void *buf, size_t count)
+{
+	while (count != 0)
+	{
+		ssize_t ret = write(fd, buf, count);
+
+		if (ret >= 0)
+		{
+			buf = (const char *)buf + ret;
+			count -= ret;
+		}
+		else if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/* Wait for the master to answer a question. Returns 1 once there is an
+** answer, 0 if there was none in time, and -1 on failure. */
+static int
+wait_reply(int s)
 {
+	struct timeval tv;
+	fd_set readfds;
+	int n;
+
+	do
+	{
+		FD_ZERO(&readfds);
+		FD_SET(s, &readfds);
+		tv.tv_sec = 0;
+		tv.tv_usec = HELLO_TIMEOUT * 1000;
+		n = select(s + 1, &readfds, NULL, NULL, &tv);
+	} while (n < 0 && errno == EINTR);
+	return n;
+}
+
+/* Wait for the master to answer a question with a packet. Old masters
+** silently ignore questions they don't know about, so don't wait forever.
+** Returns 1 if pkt holds the answer, 0 if there was none, and -1 on
+** failure. */
+static int
+read_reply(int s, struct packet *pkt)
+{
+	ssize_t len;
+	int n;
+
+	n = wait_reply(s);
+	if (n <= 0)
+		return n;
+
+	len = read(s, pkt, sizeof(struct packet));
+	if (len < 0)
+		return -1;
+	else if (len == 0)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+	return len == sizeof(struct packet);
+}
+
+/* Ask the master for the output ring, and map it if we get it. Old masters
+** and masters that are out of reader slots leave us with the socket.
+** Returns -1 on failure. */
+static int
+ring_request(int s)
+{
+	union
+	{
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
 	struct packet pkt;
-	int s;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int n, fds[2] = {-1, -1};
+	ssize_t len;
 
-	/* Attempt to open the socket. */
-	s = connect_socket(sockname);
-	if (s < 0 && errno == ENAMETOOLONG)
+	memset(&pkt, 0, sizeof(struct packet));
+	pkt.type = MSG_RING;
+	if (write_all(s, &pkt, sizeof(struct packet)) < 0)
+		return -1;
+	n = wait_reply(s);
+	if (n <= 0)
+		return n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &pkt;
+	iov.iov_len = sizeof(struct packet);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	len = recvmsg(s, &msg, 0);
+	if (len <= 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
 	{
-		char *slash = strrchr(sockname, '/');
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	}
+
+	if (len == sizeof(struct packet) && pkt.type == MSG_RING &&
+	    pkt.len > 0 && fds[1] >= 0)
+		ring = ring_open(fds[0], pkt.len - 1);
+	if (!ring)
+	{
+		if (fds[0] >= 0)
+			close(fds[0]);
+		if (fds[1] >= 0)
+			close(fds[1]);
+		return 0;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	ring_wake_fd = fds[1];
+	return 1;
+}
 
-		/* Try to shorten the socket's path name by using chdir. */
-		if (slash)
+/* Ask the master whether it understands framed messages, and switch over to
+** them if it does. Returns 1 if framing is in use, 0 if the master only
+** understands plain packets, and -1 on failure. */
+static int
+negotiate_frames(int s)
+{
+	struct packet pkt;
+	int n;
+
+	memset(&pkt, 0, sizeof(struct packet));
+	pkt.type = MSG_HELLO;
+	pkt.len = PROTOCOL_FRAMED;
+	if (write_all(s, &pkt, sizeof(struct packet)) < 0)
+		return -1;
+	n = read_reply(s, &pkt);
+	if (n <= 0)
+		return n;
+	if (pkt.type != MSG_HELLO || pkt.len != PROTOCOL_FRAMED)
+		return 0;
+
+	pkt.type = MSG_FRAMED;
+	if (write_all(s, &pkt, sizeof(struct packet)) < 0)
+		return -1;
+	return 1;
+}
+
+/* Push the contents of standard input to the socket using framed messages,
+** which carry a lot more than a packet at a time. */
+static int
+push_frames(int s)
+{
+	unsigned char buf[sizeof(struct frame) + MAX_FRAME];
+	struct frame *f = (struct frame *)buf;
+
+	f->type = MSG_PUSH;
+	for (;;)
+	{
+		ssize_t len;
+
+		len = read(0, buf + sizeof(struct frame), MAX_FRAME);
+		if (len == 0)
+			return 0;
+		else if (len < 0)
 		{
-			int dirfd = open(".", O_RDONLY);
+			if (errno == EINTR)
+				continue;
+			printf("%s: %s: %s\n", progname, sockname,
+			       strerror(errno));
+			return 1;
+		}
 
-			if (dirfd >= 0)
-			{
-				*slash = '\0';
-				if (chdir(sockname) >= 0)
-				{
-					s = connect_socket(slash + 1);
-					if (s >= 0 && fchdir(dirfd) < 0)
-					{
-						close(s);
-						s = -1;
-					}
-				}
-				*slash = '/';
-				close(dirfd);
-			}
+		FRAME_SET_LEN(f, len);
+		if (write_all(s, buf, sizeof(struct frame) + len) < 0)
+		{
+			printf("%s: %s: %s\n", progname, sockname,
+			       strerror(errno));
+			return 1;
 		}
 	}
+}
+
+int
+push_main()
+{
+	struct packet pkt;
+	int s, framed;
+
+	/* Attempt to open the socket. */
+	s = open_socket(0);
 	if (s < 0)
 	{
 		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
@@ -339,6 +641,16 @@ push_main()
 	/* Set some signals. */
 	signal(SIGPIPE, SIG_IGN);
 
+	/* Use framed messages if the master understands them. */
+	framed = negotiate_frames(s);
+	if (framed < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 1;
+	}
+	else if (framed)
+		return push_frames(s);
+
 	/* Push the contents of standard input to the socket. */
 	pkt.type = MSG_PUSH;
 	for (;;)
@@ -370,3 +682,372 @@ push_main()
 		}
 	}
 }
+
+int
+stats_main()
+{
+	static const char eof[] = "# EOF\n";
+	char buf[BUFSIZE], tail[sizeof(eof) - 1];
+	size_t ntail = 0;
+	struct packet pkt;
+	int s;
+
+	/* Attempt to open the socket. */
+	s = open_socket(0);
+	if (s < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 1;
+	}
+
+	/* Set some signals. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Ask for the stats, and copy them out until the end marker. */
+	memset(&pkt, 0, sizeof(struct packet));
+	pkt.type = MSG_STATS;
+	if (write(s, &pkt, sizeof(struct packet)) != sizeof(struct packet))
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 1;
+	}
+	for (;;)
+	{
+		ssize_t len = read(s, buf, sizeof(buf));
+		size_t keep;
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+		{
+			printf("%s: %s: %s\n", progname, sockname,
+			       strerror(errno));
+			return 1;
+		}
+		if (len == 0)
+			return 1;
+		write_buf_or_fail(1, buf, len);
+
+		/* Remember the last few bytes, to spot the marker. */
+		if ((size_t)len >= sizeof(tail))
+		{
+			memcpy(tail, buf + len - sizeof(tail), sizeof(tail));
+			ntail = sizeof(tail);
+		}
+		else
+		{
+			keep = ntail + len > sizeof(tail) ?
+				sizeof(tail) - len : ntail;
+			memmove(tail, tail + ntail - keep, keep);
+			memcpy(tail + keep, buf, len);
+			ntail = keep + len;
+		}
+		if (ntail == sizeof(tail) && memcmp(tail, eof, ntail) == 0)
+			return 0;
+	}
+}
+
+/* Exit with 0 if a client is attached to the session, or 1 if not. Masters
+** that predate MSG_STATUS are asked the old way, by looking for the user
+** execute bit on the socket. */
+int
+status_main()
+{
+	struct packet pkt;
+	struct stat st;
+	int s, n;
+
+	/* Attempt to open the socket. */
+	s = open_socket(0);
+	if (s < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+
+	/* Set some signals. */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&pkt, 0, sizeof(struct packet));
+	pkt.type = MSG_STATUS;
+	if (write_all(s, &pkt, sizeof(struct packet)) < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+	n = read_reply(s, &pkt);
+	if (n < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+	else if (n > 0 && pkt.type == MSG_STATUS)
+		return pkt.len > 0 ? 0 : 1;
+
+	if (relay_address(sockname) || SOCKET_ABSTRACT(sockname) ||
+	    stat(sockname, &st) < 0)
+	{
+		printf("%s: %s: The master did not answer.\n", progname,
+		       sockname);
+		return 2;
+	}
+	return (st.st_mode & S_IXUSR) ? 0 : 1;
+}
+
+/* Wait for pattern to turn up in the output of the session, for up to
+** timeout microseconds if it isn't 0. Returns 0 once it has, 1 if the time
+** ran out first, and 2 if the session couldn't be waited on. */
+int
+wait_main(const char *pattern, unsigned long timeout)
+{
+	unsigned char buf[sizeof(struct frame) + MATCH_MAX];
+	struct frame *f = (struct frame *)buf;
+	size_t len = strlen(pattern);
+	unsigned long long end = ev_now() + timeout;
+	struct packet pkt;
+	int s, framed;
+
+	/* Attempt to open the socket. */
+	s = open_socket(0);
+	if (s < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+
+	/* Set some signals. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The pattern is too long for a packet. */
+	framed = negotiate_frames(s);
+	if (framed < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+	else if (!framed)
+	{
+		printf("%s: %s: The master can't wait for output.\n",
+		       progname, sockname);
+		return 2;
+	}
+
+	f->type = MSG_WAIT;
+	FRAME_SET_LEN(f, len);
+	memcpy(buf + sizeof(struct frame), pattern, len);
+	if (write_all(s, buf, sizeof(struct frame) + len) < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+
+	for (;;)
+	{
+		unsigned long long now = ev_now();
+		struct timeval tv;
+		fd_set readfds;
+		int n;
+
+		if (timeout && now >= end)
+			return 1;
+		tv.tv_sec = (end - now) / 1000000;
+		tv.tv_usec = (end - now) % 1000000;
+		FD_ZERO(&readfds);
+		FD_SET(s, &readfds);
+		n = select(s + 1, &readfds, NULL, NULL, timeout ? &tv : NULL);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		else if (n == 0)
+			return 1;
+		else if (n < 0)
+		{
+			printf("%s: %s: %s\n", progname, sockname,
+			       strerror(errno));
+			return 2;
+		}
+
+		if (read_all(s, &pkt, sizeof(struct packet)) < 0)
+		{
+			printf("%s: %s: The session ended.\n", progname,
+			       sockname);
+			return 2;
+		}
+		if (pkt.type == MSG_WAIT && pkt.len)
+			return 0;
+		else if (pkt.type == MSG_WAIT)
+		{
+			printf("%s: %s: The master couldn't take the "
+			       "pattern.\n", progname, sockname);
+			return 2;
+		}
+	}
+}
+
+/* Send standard input to the session, and copy the output it causes to
+** standard output until pattern turns up, or the output has been quiet for
+** quiet microseconds, or for up to timeout microseconds if it isn't 0.
+** Returns 0 if the wait ended the way it was meant to, 1 if the time ran out
+** or the output went quiet before the pattern turned up, and 2 if the
+** session couldn't be reached. */
+int
+expect_main(const char *pattern, unsigned long timeout, unsigned long quiet)
+{
+	unsigned char in[sizeof(struct frame) + BUFSIZE];
+	unsigned char out[sizeof(struct frame) + MAX_FRAME];
+	struct frame *f = (struct frame *)in;
+	size_t len = strlen(pattern), in_len = 0, out_len = 0;
+	unsigned long long end = ev_now() + timeout;
+	int s, framed, eof = 0;
+
+	/* Attempt to open the socket. */
+	s = open_socket(0);
+	if (s < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+
+	/* Set some signals. */
+	signal(SIGPIPE, SIG_IGN);
+
+	framed = negotiate_frames(s);
+	if (framed < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+	else if (!framed)
+	{
+		printf("%s: %s: The master can't wait for output.\n",
+		       progname, sockname);
+		return 2;
+	}
+
+	/* Say what to wait for before any of the input is sent, so that none
+	** of the output it causes is missed. */
+	quiet = (quiet + 999) / 1000;
+	f->type = MSG_EXPECT;
+	FRAME_SET_LEN(f, 4 + len);
+	in[sizeof(struct frame)] = (quiet >> 24) & 0xff;
+	in[sizeof(struct frame) + 1] = (quiet >> 16) & 0xff;
+	in[sizeof(struct frame) + 2] = (quiet >> 8) & 0xff;
+	in[sizeof(struct frame) + 3] = quiet & 0xff;
+	memcpy(in + sizeof(struct frame) + 4, pattern, len);
+	if (write_all(s, in, sizeof(struct frame) + 4 + len) < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 2;
+	}
+
+	/* Send the input while collecting the output, so that neither side
+	** waits for the other. */
+	for (;;)
+	{
+		unsigned long long now = ev_now();
+		struct timeval tv;
+		fd_set readfds, writefds;
+		ssize_t n;
+		int max = s;
+
+		if (timeout && now >= end)
+			return 1;
+		tv.tv_sec = (end - now) / 1000000;
+		tv.tv_usec = (end - now) % 1000000;
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_SET(s, &readfds);
+		if (in_len > 0)
+			FD_SET(s, &writefds);
+		else if (!eof)
+			FD_SET(0, &readfds);
+		n = select(max + 1, &readfds, &writefds, NULL,
+			   timeout ? &tv : NULL);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		else if (n == 0)
+			return 1;
+		else if (n < 0)
+		{
+			printf("%s: %s: %s\n", progname, sockname,
+			       strerror(errno));
+			return 2;
+		}
+
+		/* Standard input. */
+		if (FD_ISSET(0, &readfds))
+		{
+			n = read(0, in + sizeof(struct frame), BUFSIZE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			else if (n <= 0)
+				eof = 1;
+			else
+			{
+				f->type = MSG_PUSH;
+				FRAME_SET_LEN(f, n);
+				in_len = sizeof(struct frame) + n;
+			}
+		}
+		if (FD_ISSET(s, &writefds))
+		{
+			if (write_all(s, in, in_len) < 0)
+			{
+				printf("%s: %s: %s\n", progname, sockname,
+				       strerror(errno));
+				return 2;
+			}
+			in_len = 0;
+		}
+
+		/* Output, and how the wait ended. */
+		if (!FD_ISSET(s, &readfds))
+			continue;
+		n = read(s, out + out_len, sizeof(out) - out_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+		{
+			printf("%s: %s: The session ended.\n", progname,
+			       sockname);
+			return 2;
+		}
+		out_len += n;
+		while (out_len >= sizeof(struct frame))
+		{
+			struct frame *o = (struct frame *)out;
+			size_t flen = FRAME_LEN(o);
+			struct packet pkt;
+
+			if (flen > MAX_FRAME)
+			{
+				printf("%s: %s: The master sent garbage.\n",
+				       progname, sockname);
+				return 2;
+			}
+			if (out_len < sizeof(struct frame) + flen)
+				break;
+			if (o->type == MSG_PUSH)
+				write_buf_or_fail(1, out + sizeof(struct frame),
+						  flen);
+			else if (o->type == MSG_WAIT &&
+				 flen == sizeof(struct packet))
+			{
+				memcpy(&pkt, out + sizeof(struct frame),
+				       sizeof(struct packet));
+				if (pkt.len == 0)
+				{
+					printf("%s: %s: The master couldn't "
+					       "take the pattern.\n", progname,
+					       sockname);
+					return 2;
+				}
+				return (pkt.len == EXPECT_FOUND ||
+					(pkt.len == EXPECT_QUIET && !len)) ?
+					0 : 1;
+			}
+			out_len -= sizeof(struct frame) + flen;
+			memmove(out, out + sizeof(struct frame) + flen,
+				out_len);
+		}
+	}
+}
@@ -0,0 +1,1217 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "../dtach.h"
+#include <poll.h>
+
+/*
+** Benchmarks for dtach, run by `make bench'.
+**
+** Throughput
+**
+** The throughput benchmark starts a session with dtach -N, running this
+** program as an output generator, and attaches a number of headless
+** clients that read the output as fast as they can. Once every client is
+** attached, the generator is told to start, and the run ends when every
+** client has received all of the output. Each run prints one line of JSON,
+** so that the results can be kept and compared across releases.
+**
+** The master's CPU time and its read and write system calls are taken from
+** /proc, so they are only reported on Linux. Those miss the calls the event
+** loop makes to wait for events, and the writes that io_uring does without
+** a system call of their own, so the master's stats are asked for those,
+** along with the name of the event loop backend in use. The sum of the
+** three is the number of I/O operations, which can be compared across
+** backends.
+**
+** Latency
+**
+** The latency benchmark measures how long a keystroke takes to come back as
+** an echo, going from an attaching client through the master and the pty to
+** the program and back again. dtach -a is run on a pty of our own, as if a
+** user were typing into it. The program echoes every byte it is sent, while
+** another process writes a flood of output to the same pty at a given rate,
+** like a build running in the same session. A keystroke is sent only after
+** the previous one has come back, and the latency percentiles are printed as
+** a line of JSON, for a run with no flood and a run with one.
+**
+** Startup
+**
+** The startup benchmark measures how long dtach -n takes to create a
+** session, from running it until it returns, which is once the program of
+** the session is running. Sessions are created one after the other, with a
+** short pause in between like a job launcher would leave, running a
+** program that exits right away, first each with a master of its own, then
+** in a host daemon, and then in a host daemon that keeps sessions warm. The
+** percentiles of each are printed as a line of JSON.
+*/
+
+#define MB	1000000.0
+
+/* The output patterns of the generator. */
+static const char *patterns[] = {"rate", "burst", "small", "large", NULL};
+
+/* The number of clients attached in each run. */
+static const int default_clients[] = {0, 1, 8, 64};
+
+char *progname;
+
+/* Returns the current time in seconds. */
+static double
+now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / MB;
+	}
+}
+
+/* Write all of buf, or exit. */
+static void
+write_all(int fd, const void *buf, size_t count)
+{
+	while (count != 0)
+	{
+		ssize_t ret = write(fd, buf, count);
+
+		if (ret >= 0)
+		{
+			buf = (const char *)buf + ret;
+			count -= ret;
+		}
+		else if (errno != EINTR)
+			exit(1);
+	}
+}
+
+/* Parse a size such as 64m. Returns 0 if it isn't one. */
+static unsigned long long
+parse_size(const char *s)
+{
+	unsigned long long n;
+	char *end;
+
+	n = strtoull(s, &end, 10);
+	if (end == s)
+		return 0;
+	if (*end == 'k' || *end == 'K')
+		n *= 1024, ++end;
+	else if (*end == 'm' || *end == 'M')
+		n *= 1024 * 1024, ++end;
+	else if (*end == 'g' || *end == 'G')
+		n *= 1024 * 1024 * 1024, ++end;
+	if (*end)
+		return 0;
+	return n;
+}
+
+static void
+usage(void)
+{
+	printf("Usage: %s [-s <size>] [-r <rate>] [-p <pattern,...>] "
+	       "[-c <clients,...>]\n"
+	       "\t\t<dtach>\n"
+	       "  -s <size>\tOutput generated per run, defaults to 64m.\n"
+	       "  -r <rate>\tBytes per second of the rate pattern, defaults "
+	       "to 32m.\n"
+	       "  -p <list>\tPatterns to run, out of rate, burst, small and "
+	       "large.\n"
+	       "  -c <list>\tNumbers of clients to attach, defaults to "
+	       "0,1,8,64.\n"
+	       "       %s latency [-n <count>] [-f <rate>] <dtach>\n"
+	       "  -n <count>\tKeystrokes sent per run, defaults to 2000.\n"
+	       "  -f <rate>\tBytes per second of the flood, defaults to "
+	       "32m.\n"
+	       "       %s startup [-n <count>] [-i <ms>] [-k <count>] "
+	       "<dtach>\n"
+	       "  -n <count>\tSessions created per run, defaults to 500.\n"
+	       "  -i <ms>\tPause between sessions, defaults to 10.\n"
+	       "  -k <count>\tWarm sessions kept by the host daemon, "
+	       "defaults to 4.\n", progname, progname, progname);
+	exit(1);
+}
+
+/* Generator */
+
+/* Put the terminal of the generator in raw mode, so that the output goes
+** through unchanged and the start and stop signals aren't echoed. */
+static void
+gen_raw(void)
+{
+	struct termios t;
+
+	if (tcgetattr(0, &t) < 0)
+		return;
+	t.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL|IXON);
+	t.c_oflag &= ~(OPOST);
+	t.c_lflag &= ~(ECHO|ECHONL|ICANON|ISIG|IEXTEN);
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	tcsetattr(0, TCSANOW, &t);
+}
+
+/* Write out size bytes in the given pattern:
+**   rate   64k writes, paced to rate bytes per second.
+**   burst  bursts of 256k in 4k writes, with 5ms of quiet in between.
+**   small  64 byte writes, as fast as possible.
+**   large  64k writes, as fast as possible. */
+static void
+gen_output(const char *pattern, unsigned long long size,
+	   unsigned long long rate)
+{
+	static char buf[65536];
+	unsigned long long done = 0;
+	size_t piece = sizeof(buf);
+	double start = now();
+	size_t i;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+	if (strcmp(pattern, "small") == 0)
+		piece = 64;
+	else if (strcmp(pattern, "burst") == 0)
+		piece = 4096;
+
+	while (done < size)
+	{
+		size_t len = size - done < piece ? size - done : piece;
+
+		write_all(1, buf, len);
+		done += len;
+
+		if (strcmp(pattern, "rate") == 0)
+		{
+			double ahead = done / (double)rate - (now() - start);
+
+			if (ahead > 0)
+				usleep(ahead * MB);
+		}
+		else if (strcmp(pattern, "burst") == 0 &&
+			 done % (256 * 1024) == 0)
+			usleep(5000);
+	}
+}
+
+/* Wait for the signal from the harness, which is any byte. */
+static void
+gen_wait(void)
+{
+	char c;
+
+	while (read(0, &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+static int
+gen_main(int argc, char **argv)
+{
+	FILE *fp;
+
+	if (argc != 4)
+		usage();
+	gen_raw();
+	fp = fopen(argv[3], "w");
+	if (!fp)
+		return 1;
+	fprintf(fp, "ready\n");
+	fflush(fp);
+	gen_wait();
+	gen_output(argv[0], parse_size(argv[1]), parse_size(argv[2]));
+	fprintf(fp, "done\n");
+	fclose(fp);
+	gen_wait();
+	return 0;
+}
+
+/* Echo every byte the harness sends, while another process floods the
+** terminal at rate bytes per second (if rate is not 0). The harness ends it
+** with ^D. */
+static int
+echo_main(int argc, char **argv)
+{
+	unsigned long long rate;
+	pid_t flood = -1;
+	FILE *fp;
+
+	if (argc != 2)
+		usage();
+	rate = parse_size(argv[0]);
+	gen_raw();
+	if (rate > 0)
+	{
+		flood = fork();
+		if (flood == 0)
+		{
+			gen_output("rate", (unsigned long long)-1, rate);
+			_exit(0);
+		}
+	}
+	fp = fopen(argv[1], "w");
+	if (!fp)
+		return 1;
+	fprintf(fp, "ready\n");
+	fclose(fp);
+
+	for (;;)
+	{
+		char buf[256];
+		ssize_t n = read(0, buf, sizeof(buf));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || memchr(buf, '\004', n))
+			break;
+		write_all(1, buf, n);
+	}
+	if (flood > 0)
+		kill(flood, SIGTERM);
+	return 0;
+}
+
+/* Harness */
+
+/* What the master has used so far. */
+struct usage
+{
+	double cpu;
+	long long rw_syscalls;
+	long long loop_syscalls;
+	long long async_writes;
+	char backend[16];
+};
+
+/* Read the CPU time and the number of read and write system calls of a
+** process from /proc, leaving -1 for what is not available. */
+static void
+proc_usage(pid_t pid, struct usage *u)
+{
+	char path[64], line[1024], *p;
+	unsigned long utime, stime;
+	long long syscr = -1, syscw = -1;
+	FILE *fp;
+
+	u->cpu = -1;
+	u->rw_syscalls = -1;
+
+	sprintf(path, "/proc/%d/stat", (int)pid);
+	fp = fopen(path, "r");
+	if (fp)
+	{
+		/* utime and stime are the 12th and 13th fields after the
+		** command name, which may contain spaces. */
+		if (fgets(line, sizeof(line), fp) &&
+		    (p = strrchr(line, ')')) != NULL &&
+		    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+			   "%*u %lu %lu", &utime, &stime) == 2)
+			u->cpu = (double)(utime + stime) /
+				sysconf(_SC_CLK_TCK);
+		fclose(fp);
+	}
+
+	sprintf(path, "/proc/%d/io", (int)pid);
+	fp = fopen(path, "r");
+	if (fp)
+	{
+		while (fgets(line, sizeof(line), fp))
+		{
+			sscanf(line, "syscr: %lld", &syscr);
+			sscanf(line, "syscw: %lld", &syscw);
+		}
+		if (syscr >= 0 && syscw >= 0)
+			u->rw_syscalls = syscr + syscw;
+		fclose(fp);
+	}
+}
+
+/* Connect to the session. */
+static int
+connect_session(const char *name)
+{
+	struct sockaddr_un sockun;
+	int s;
+
+	s = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (s < 0)
+		return -1;
+	memset(&sockun, 0, sizeof(sockun));
+	sockun.sun_family = AF_UNIX;
+	strncpy(sockun.sun_path, name, sizeof(sockun.sun_path) - 1);
+	if (connect(s, (struct sockaddr *)&sockun, sizeof(sockun)) < 0)
+	{
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* Send a packet with up to one byte of data. */
+static void
+send_packet(int s, int type, int c)
+{
+	struct packet pkt;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.type = type;
+	if (c >= 0)
+	{
+		pkt.len = 1;
+		pkt.u.buf[0] = c;
+	}
+	write_all(s, &pkt, sizeof(pkt));
+}
+
+/* Ask the master for its stats. Returns them, or NULL on failure. */
+static const char *
+read_stats(int s)
+{
+	static char buf[65536];
+	size_t len = 0;
+
+	send_packet(s, MSG_STATS, -1);
+	while (len < sizeof(buf) - 1)
+	{
+		ssize_t n = read(s, buf + len, sizeof(buf) - 1 - len);
+
+		if (n <= 0)
+			return NULL;
+		len += n;
+		buf[len] = '\0';
+		if (len >= 6 && strcmp(buf + len - 6, "# EOF\n") == 0)
+			return buf;
+	}
+	return NULL;
+}
+
+/* Find the value of a stat, or -1 if it is not there. The name includes
+** the labels, if there are any. */
+static long long
+stat_value(const char *stats, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = stats;
+
+	while (p)
+	{
+		if (strncmp(p, name, len) == 0 && p[len] == ' ')
+			return atoll(p + len + 1);
+		p = strchr(p, '\n');
+		if (p)
+			p++;
+	}
+	return -1;
+}
+
+/* Ask the master how many clients are attached, using the stats. */
+static int
+count_attached(int s)
+{
+	const char *stats = read_stats(s);
+
+	return stats ? stat_value(stats, "dtach_attached_clients") : -1;
+}
+
+/* Read what the event loop of the master has done from its stats, leaving
+** -1 for what is not available. */
+static void
+session_usage(int s, struct usage *u)
+{
+	static const char key[] = "\ndtach_event_backend{backend=\"";
+	const char *stats = read_stats(s), *p;
+	size_t len;
+
+	u->loop_syscalls = -1;
+	u->async_writes = -1;
+	u->backend[0] = '\0';
+	if (!stats)
+		return;
+	u->loop_syscalls = stat_value(stats, "dtach_loop_syscalls_total");
+	u->async_writes = stat_value(stats, "dtach_async_writes_total");
+	p = strstr(stats, key);
+	if (p)
+	{
+		p += sizeof(key) - 1;
+		len = strcspn(p, "\"");
+		if (len < sizeof(u->backend))
+		{
+			memcpy(u->backend, p, len);
+			u->backend[len] = '\0';
+		}
+	}
+}
+
+/* Print a count per MB between two readings, or null if either of them is
+** missing. */
+static void
+print_per_mb(const char *name, long long before, long long after,
+	     unsigned long long size)
+{
+	if (before >= 0 && after >= 0)
+		printf(", \"%s\": %.2f", name, (after - before) / (size / MB));
+	else
+		printf(", \"%s\": null", name);
+}
+
+/* Wait for a line from the generator, giving up if the master dies. */
+static int
+wait_line(int fd, pid_t master, const char *want)
+{
+	char buf[64];
+	size_t len = 0;
+
+	for (;;)
+	{
+		struct pollfd pfd;
+		ssize_t n;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0)
+		{
+			n = read(fd, buf + len, sizeof(buf) - 1 - len);
+			if (n > 0)
+			{
+				len += n;
+				buf[len] = '\0';
+				if (strstr(buf, want))
+					return 0;
+			}
+		}
+		if (waitpid(master, NULL, WNOHANG) != 0)
+			return -1;
+	}
+}
+
+/* Start a session running this program with the given arguments, and wait
+** for it to say that it is ready. Returns the pid of the master. */
+static pid_t
+start_session(const char *dtach, const char *self, const char *sock,
+	      const char *fifo, int rfd, char **args)
+{
+	pid_t master = fork();
+
+	if (master < 0)
+		return -1;
+	if (master == 0)
+	{
+		char *argv[16];
+		int i = 0;
+
+		argv[i++] = (char *)dtach;
+		argv[i++] = "-N";
+		argv[i++] = (char *)sock;
+		argv[i++] = (char *)self;
+		while (*args && i < 14)
+			argv[i++] = *args++;
+		argv[i++] = (char *)fifo;
+		argv[i] = NULL;
+		execv(dtach, argv);
+		_exit(127);
+	}
+	if (wait_line(rfd, master, "ready") < 0)
+	{
+		printf("%s: %s did not start\n", progname, dtach);
+		return -1;
+	}
+	return master;
+}
+
+/* Run one pattern with a number of clients attached, and print the
+** results. */
+static int
+run(const char *dtach, const char *self, const char *pattern, int nclients,
+    unsigned long long size, unsigned long long rate)
+{
+	char dir[] = "/tmp/dtach-bench.XXXXXX";
+	char sock[64], fifo[64], sizestr[32], ratestr[32], *args[5];
+	struct pollfd *pfd;
+	unsigned long long *got;
+	struct usage before, after;
+	int ctl, rfd, i, done = 0, left = nclients, ret = 1;
+	double start, elapsed;
+	pid_t master;
+
+	if (!mkdtemp(dir))
+		return 1;
+	sprintf(sock, "%s/sock", dir);
+	sprintf(fifo, "%s/fifo", dir);
+	sprintf(sizestr, "%llu", size);
+	sprintf(ratestr, "%llu", rate);
+	if (mkfifo(fifo, 0600) < 0)
+		goto out_dir;
+	rfd = open(fifo, O_RDONLY|O_NONBLOCK);
+	if (rfd < 0)
+		goto out_fifo;
+
+	pfd = calloc(nclients + 1, sizeof(struct pollfd));
+	got = calloc(nclients + 1, sizeof(unsigned long long));
+	if (!pfd || !got)
+		goto out_rfd;
+
+	/* Start the session, and wait for the generator to be ready. */
+	args[0] = "gen";
+	args[1] = (char *)pattern;
+	args[2] = sizestr;
+	args[3] = ratestr;
+	args[4] = NULL;
+	master = start_session(dtach, self, sock, fifo, rfd, args);
+	if (master < 0)
+		goto out_rfd;
+
+	/* Attach the clients, and wait until the master has seen them
+	** all. */
+	ctl = connect_session(sock);
+	if (ctl < 0)
+		goto out_master;
+	for (i = 0; i < nclients; ++i)
+	{
+		pfd[i].fd = connect_session(sock);
+		pfd[i].events = POLLIN;
+		if (pfd[i].fd < 0)
+			goto out_clients;
+		send_packet(pfd[i].fd, MSG_ATTACH, -1);
+		fcntl(pfd[i].fd, F_SETFL, O_NONBLOCK);
+	}
+	while (count_attached(ctl) != nclients)
+		usleep(10000);
+
+	session_usage(ctl, &before);
+	proc_usage(master, &before);
+	start = now();
+	send_packet(ctl, MSG_PUSH, '\n');
+
+	/* Read the output until every client has all of it. */
+	pfd[nclients].fd = rfd;
+	pfd[nclients].events = POLLIN;
+	while (!done || left > 0)
+	{
+		static char buf[65536];
+
+		if (poll(pfd, nclients + 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			goto out_clients;
+		}
+		for (i = 0; i < nclients; ++i)
+		{
+			ssize_t n;
+
+			if (!pfd[i].revents)
+				continue;
+			n = read(pfd[i].fd, buf, sizeof(buf));
+			if (n == 0 || (n < 0 && errno != EAGAIN &&
+				       errno != EINTR))
+			{
+				printf("%s: client %d lost its connection\n",
+				       progname, i);
+				goto out_clients;
+			}
+			if (n < 0)
+				continue;
+			got[i] += n;
+			if (got[i] >= size && got[i] - n < size)
+				left--;
+		}
+		if (pfd[nclients].revents)
+		{
+			ssize_t n = read(rfd, buf, sizeof(buf) - 1);
+
+			if (n > 0)
+			{
+				buf[n] = '\0';
+				if (strstr(buf, "done"))
+					done = 1;
+			}
+		}
+	}
+	elapsed = now() - start;
+	proc_usage(master, &after);
+	session_usage(ctl, &after);
+
+	printf("{\"benchmark\": \"throughput\", \"pattern\": \"%s\", "
+	       "\"clients\": %d, \"bytes\": %llu, \"seconds\": %.6f, "
+	       "\"mb_per_s\": %.2f", pattern, nclients, size, elapsed,
+	       size / MB / elapsed);
+	if (after.backend[0])
+		printf(", \"backend\": \"%s\"", after.backend);
+	else
+		printf(", \"backend\": null");
+	if (before.cpu >= 0 && after.cpu >= 0)
+		printf(", \"master_cpu_s_per_gb\": %.4f",
+		       (after.cpu - before.cpu) / (size / 1e9));
+	else
+		printf(", \"master_cpu_s_per_gb\": null");
+	print_per_mb("rw_syscalls_per_mb", before.rw_syscalls,
+		     after.rw_syscalls, size);
+	print_per_mb("loop_syscalls_per_mb", before.loop_syscalls,
+		     after.loop_syscalls, size);
+	print_per_mb("async_writes_per_mb", before.async_writes,
+		     after.async_writes, size);
+	if (before.rw_syscalls >= 0 && before.loop_syscalls >= 0 &&
+	    before.async_writes >= 0 && after.rw_syscalls >= 0 &&
+	    after.loop_syscalls >= 0 && after.async_writes >= 0)
+		print_per_mb("io_ops_per_mb",
+			     before.rw_syscalls + before.loop_syscalls +
+			     before.async_writes,
+			     after.rw_syscalls + after.loop_syscalls +
+			     after.async_writes, size);
+	else
+		printf(", \"io_ops_per_mb\": null");
+	printf("}\n");
+	fflush(stdout);
+	ret = 0;
+
+out_clients:
+	for (i = 0; i < nclients; ++i)
+	{
+		if (pfd[i].fd > 0)
+			close(pfd[i].fd);
+	}
+	/* Let the generator exit, which ends the session. */
+	send_packet(ctl, MSG_PUSH, '\n');
+	close(ctl);
+out_master:
+	if (ret != 0)
+		kill(master, SIGTERM);
+	waitpid(master, NULL, 0);
+out_rfd:
+	free(pfd);
+	free(got);
+	close(rfd);
+out_fifo:
+	unlink(fifo);
+out_dir:
+	unlink(sock);
+	rmdir(dir);
+	return ret;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Returns the q quantile of n sorted samples, by nearest rank. */
+static double
+quantile(const double *v, int n, double q)
+{
+	int i = (int)(q * n + 0.999999) - 1;
+
+	if (i < 0)
+		i = 0;
+	if (i >= n)
+		i = n - 1;
+	return v[i];
+}
+
+#ifdef HAVE_FORKPTY
+/* Read the output of the attached client until c shows up (or just until
+** the deadline, if c is -1). Returns the time c showed up, or -1. */
+static double
+read_until(int fd, int c, double deadline)
+{
+	for (;;)
+	{
+		char buf[65536];
+		struct pollfd pfd;
+		double left = deadline - now();
+		ssize_t n;
+
+		if (left <= 0)
+			return -1;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, left * 1000 + 1) <= 0)
+			continue;
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n <= 0)
+			return -1;
+		if (c >= 0 && memchr(buf, c, n))
+			return now();
+	}
+}
+
+/* Type count keystrokes into an attached client, with the program flooding
+** the session at rate bytes per second, and print the latencies. */
+static int
+run_latency(const char *dtach, const char *self, int count,
+	    unsigned long long rate)
+{
+	char dir[] = "/tmp/dtach-bench.XXXXXX";
+	char sock[64], fifo[64], ratestr[32], *args[3];
+	double *lat;
+	int ctl = -1, rfd, fd = -1, i, n = 0, lost = 0, ret = 1;
+	pid_t master, client = -1;
+
+	if (!mkdtemp(dir))
+		return 1;
+	sprintf(sock, "%s/sock", dir);
+	sprintf(fifo, "%s/fifo", dir);
+	sprintf(ratestr, "%llu", rate);
+	if (mkfifo(fifo, 0600) < 0)
+		goto out_dir;
+	rfd = open(fifo, O_RDONLY|O_NONBLOCK);
+	if (rfd < 0)
+		goto out_fifo;
+	lat = malloc(count * sizeof(double));
+	if (!lat)
+		goto out_rfd;
+
+	args[0] = "echo";
+	args[1] = ratestr;
+	args[2] = NULL;
+	master = start_session(dtach, self, sock, fifo, rfd, args);
+	if (master < 0)
+		goto out_rfd;
+
+	/* Attach to the session from a terminal of our own. */
+	client = forkpty(&fd, NULL, NULL, NULL);
+	if (client < 0)
+		goto out_client;
+	if (client == 0)
+	{
+		execl(dtach, dtach, "-a", sock, "-E", "-r", "none",
+		      (char *)NULL);
+		_exit(127);
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	ctl = connect_session(sock);
+	if (ctl < 0)
+		goto out_client;
+	while (count_attached(ctl) != 1)
+	{
+		if (waitpid(client, NULL, WNOHANG) != 0)
+		{
+			client = -1;
+			goto out_client;
+		}
+		read_until(fd, -1, now() + 0.01);
+	}
+
+	/* Type away. A few keystrokes go first to warm things up, and there
+	** is a short pause after each one, like there is between the
+	** keystrokes of a fast typist. */
+	for (i = -10; i < count; ++i)
+	{
+		char c = 'A' + (i + 10) % 26;
+		double start = now(), seen;
+
+		write_all(fd, &c, 1);
+		seen = read_until(fd, c, start + 1);
+		if (i >= 0)
+		{
+			if (seen < 0)
+				lost++;
+			else
+				lat[n++] = (seen - start) * MB;
+		}
+		read_until(fd, -1, now() + 0.002);
+	}
+
+	qsort(lat, n, sizeof(double), compare_double);
+	printf("{\"benchmark\": \"latency\", \"flood_bytes_per_s\": %llu, "
+	       "\"samples\": %d, \"lost\": %d", rate, n, lost);
+	if (n > 0)
+		printf(", \"p50_us\": %.1f, \"p99_us\": %.1f, "
+		       "\"p999_us\": %.1f, \"max_us\": %.1f",
+		       quantile(lat, n, 0.5), quantile(lat, n, 0.99),
+		       quantile(lat, n, 0.999), lat[n - 1]);
+	printf("}\n");
+	fflush(stdout);
+	ret = 0;
+
+out_client:
+	/* Tell the program to exit, which ends the session and the
+	** client. */
+	if (ctl >= 0)
+	{
+		send_packet(ctl, MSG_PUSH, '\004');
+		close(ctl);
+	}
+	else
+		kill(master, SIGTERM);
+	if (client > 0)
+	{
+		while (waitpid(client, NULL, WNOHANG) == 0)
+			read_until(fd, -1, now() + 0.01);
+	}
+	if (fd >= 0)
+		close(fd);
+	waitpid(master, NULL, 0);
+out_rfd:
+	free(lat);
+	close(rfd);
+out_fifo:
+	unlink(fifo);
+out_dir:
+	unlink(sock);
+	rmdir(dir);
+	return ret;
+}
+#endif
+
+/* Run dtach with the given arguments, with nothing for a terminal, and wait
+** for it. Returns its exit status, or -1. */
+static int
+run_dtach(const char *dtach, char **argv)
+{
+	pid_t pid = fork();
+	int status;
+
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+	{
+		int fd = open("/dev/null", O_RDWR);
+
+		dup2(fd, 0);
+		dup2(fd, 1);
+		execv(dtach, argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+/* Find the pid of the host daemon at host, by creating a session in it
+** whose program writes down the pid of its parent. Returns -1 if that
+** doesn't work out. */
+static pid_t
+host_pid(const char *dtach, const char *self, const char *dir,
+	 const char *host)
+{
+	char sock[64], path[64], buf[32];
+	char *argv[] = {(char *)dtach, "-n", sock, "-H", (char *)host,
+			(char *)self, "ppid", path, NULL};
+	double deadline = now() + 5;
+	pid_t pid = -1;
+	int fd;
+
+	sprintf(sock, "%s/ppid", dir);
+	sprintf(path, "%s/pid", dir);
+	if (run_dtach(dtach, argv) != 0)
+		return -1;
+	while (pid < 0 && now() < deadline)
+	{
+		ssize_t n;
+
+		fd = open(path, O_RDONLY);
+		if (fd >= 0)
+		{
+			n = read(fd, buf, sizeof(buf) - 1);
+			if (n > 0 && buf[n - 1] == '\n')
+			{
+				buf[n] = '\0';
+				pid = atoi(buf);
+			}
+			close(fd);
+		}
+		if (pid < 0)
+			usleep(1000);
+	}
+	unlink(path);
+	unlink(sock);
+	return pid;
+}
+
+/* Create count sessions one after the other, gap microseconds apart, in the
+** host daemon at host if it is not NULL, and print how long dtach -n took
+** for each. */
+static int
+run_startup(const char *dtach, const char *self, const char *dir,
+	    const char *name, const char *host, int count, int gap)
+{
+	char sock[64], *argv[8];
+	double *lat;
+	int i, n = 0, failed = 0;
+
+	lat = malloc(count * sizeof(double));
+	if (!lat)
+		return 1;
+	for (i = 0; i < count; ++i)
+	{
+		double start;
+		int j = 0;
+
+		sprintf(sock, "%s/s%d", dir, i);
+		argv[j++] = (char *)dtach;
+		argv[j++] = "-n";
+		argv[j++] = sock;
+		if (host)
+		{
+			argv[j++] = "-H";
+			argv[j++] = (char *)host;
+		}
+		argv[j++] = (char *)self;
+		argv[j++] = "nop";
+		argv[j] = NULL;
+
+		start = now();
+		if (run_dtach(dtach, argv) != 0)
+			failed++;
+		else
+			lat[n++] = (now() - start) * MB;
+		unlink(sock);
+		usleep(gap);
+	}
+
+	qsort(lat, n, sizeof(double), compare_double);
+	printf("{\"benchmark\": \"startup\", \"mode\": \"%s\", "
+	       "\"samples\": %d, \"failed\": %d", name, n, failed);
+	if (n > 0)
+		printf(", \"p50_us\": %.1f, \"p99_us\": %.1f, "
+		       "\"max_us\": %.1f", quantile(lat, n, 0.5),
+		       quantile(lat, n, 0.99), lat[n - 1]);
+	printf("}\n");
+	fflush(stdout);
+	free(lat);
+	return n > 0 ? 0 : 1;
+}
+
+/* Start a host daemon keeping nwarm sessions warm, create count sessions in
+** it, and shut it down. */
+static int
+run_startup_host(const char *dtach, const char *self, const char *dir,
+		 int count, int gap, int nwarm)
+{
+	char host[64], warmstr[16];
+	char *argv[] = {(char *)dtach, "-D", host, "-k", warmstr, NULL};
+	pid_t pid;
+	int ret;
+
+	sprintf(host, "%s/host", dir);
+	sprintf(warmstr, "%d", nwarm);
+	if (run_dtach(dtach, argv) != 0)
+	{
+		printf("%s: %s -D did not start\n", progname, dtach);
+		return 1;
+	}
+	pid = host_pid(dtach, self, dir, host);
+	if (pid < 0)
+	{
+		printf("%s: %s -D did not create a session\n", progname,
+		       dtach);
+		unlink(host);
+		return 1;
+	}
+	/* Give the pool a moment to fill. */
+	usleep(100000);
+	ret = run_startup(dtach, self, dir, nwarm > 0 ? "warm" : "host",
+			  host, count, gap);
+	kill(pid, SIGTERM);
+	while (kill(pid, 0) == 0)
+		usleep(1000);
+	unlink(host);
+	return ret;
+}
+
+static int
+startup_main(int argc, char **argv)
+{
+	char dir[] = "/tmp/dtach-bench.XXXXXX";
+	int count = 500, gap = 10000, nwarm = 4, ret = 0;
+	char *self;
+
+	while (argc > 1 && argv[0][0] == '-' && argv[0][1] && !argv[0][2])
+	{
+		switch (argv[0][1])
+		{
+		case 'n':
+			count = atoi(argv[1]);
+			break;
+		case 'i':
+			gap = atoi(argv[1]) * 1000;
+			break;
+		case 'k':
+			nwarm = atoi(argv[1]);
+			break;
+		default:
+			usage();
+		}
+		argv += 2; argc -= 2;
+	}
+	if (argc != 1 || argv[0][0] == '-' || count <= 0 || gap < 0 ||
+	    nwarm <= 0)
+		usage();
+
+	self = realpath(progname, NULL);
+	if (!self)
+	{
+		printf("%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	if (!mkdtemp(dir))
+	{
+		free(self);
+		return 1;
+	}
+	ret |= run_startup(argv[0], self, dir, "master", NULL, count, gap);
+	ret |= run_startup_host(argv[0], self, dir, count, gap, 0);
+	ret |= run_startup_host(argv[0], self, dir, count, gap, nwarm);
+	rmdir(dir);
+	free(self);
+	return ret;
+}
+
+static int
+latency_main(int argc, char **argv)
+{
+	unsigned long long rate = 32 * 1024 * 1024;
+	int count = 2000, ret = 0;
+	char *self;
+
+	while (argc > 1 && argv[0][0] == '-' && argv[0][1] && !argv[0][2])
+	{
+		switch (argv[0][1])
+		{
+		case 'n':
+			count = atoi(argv[1]);
+			break;
+		case 'f':
+			rate = parse_size(argv[1]);
+			break;
+		default:
+			usage();
+		}
+		argv += 2; argc -= 2;
+	}
+	if (argc != 1 || argv[0][0] == '-' || count <= 0 || rate == 0)
+		usage();
+
+	self = realpath(progname, NULL);
+	if (!self)
+	{
+		printf("%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+#ifdef HAVE_FORKPTY
+	ret |= run_latency(argv[0], self, count, 0);
+	ret |= run_latency(argv[0], self, count, rate);
+#else
+	printf("%s: The latency benchmark needs forkpty.\n", progname);
+	ret = 1;
+#endif
+	free(self);
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long long size = 64 * 1024 * 1024, rate = 32 * 1024 * 1024;
+	const char *only = NULL;
+	char *clients = NULL, *self, *p;
+	int i, ret = 0;
+
+	progname = argv[0];
+	++argv; --argc;
+	if (argc > 0 && strcmp(argv[0], "gen") == 0)
+		return gen_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "echo") == 0)
+		return echo_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "latency") == 0)
+		return latency_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "startup") == 0)
+		return startup_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "nop") == 0)
+		return 0;
+	if (argc > 1 && strcmp(argv[0], "ppid") == 0)
+	{
+		FILE *f = fopen(argv[1], "w");
+
+		if (!f)
+			return 1;
+		fprintf(f, "%d\n", (int)getppid());
+		return fclose(f) != 0;
+	}
+
+	while (argc > 1 && argv[0][0] == '-' && argv[0][1] && !argv[0][2])
+	{
+		switch (argv[0][1])
+		{
+		case 's':
+			size = parse_size(argv[1]);
+			break;
+		case 'r':
+			rate = parse_size(argv[1]);
+			break;
+		case 'p':
+			only = argv[1];
+			break;
+		case 'c':
+			clients = argv[1];
+			break;
+		default:
+			usage();
+		}
+		argv += 2; argc -= 2;
+	}
+	if (argc != 1 || argv[0][0] == '-' || size == 0 || rate == 0)
+		usage();
+
+	/* The generator is run by the master, which may not share our idea
+	** of the current directory. */
+	self = realpath(progname, NULL);
+	if (!self)
+	{
+		printf("%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; patterns[i]; ++i)
+	{
+		if (only && !strstr(only, patterns[i]))
+			continue;
+		if (clients)
+		{
+			for (p = clients; p; p = strchr(p, ','))
+			{
+				if (*p == ',')
+					++p;
+				ret |= run(argv[0], self, patterns[i],
+					   atoi(p), size, rate);
+			}
+		}
+		else
+		{
+			unsigned j;
+
+			for (j = 0; j < sizeof(default_clients) /
+				     sizeof(default_clients[0]); ++j)
+				ret |= run(argv[0], self, patterns[i],
+					   default_clients[j], size, rate);
+		}
+	}
+	free(self);
+	return ret;
+}
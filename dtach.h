@@ -35,6 +35,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -83,6 +84,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #ifndef S_ISREG
@@ -93,10 +95,50 @@
 #define S_ISSOCK(m) (((m) & S_IFMT) == S_IFSOCK)
 #endif
 
-extern char *progname, *sockname;
-extern int detach_char, no_suspend, redraw_method;
-extern struct termios orig_term;
-extern int dont_have_tty;
+/*
+** On Linux, a socket named @name lives in the abstract namespace and has no
+** file behind it. Since such a socket has no permissions to keep others out,
+** whoever listens on it checks who is connecting instead.
+*/
+#if defined(__linux__) && defined(SO_PEERCRED)
+#define USE_ABSTRACT
+#define SOCKET_ABSTRACT(name) ((name)[0] == '@')
+#else
+#define SOCKET_ABSTRACT(name) 0
+#endif
+
+/*
+** A host daemon (dtach -D) runs many sessions in one process, each on a
+** thread of its own. Everything that belongs to a session, including the
+** options it was created with, is kept per thread so that the master's code
+** can stay the same either way.
+*/
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE) && \
+    defined(HAVE_TLS)
+#define USE_HOST
+#define SESSION_LOCAL __thread
+#else
+#define SESSION_LOCAL
+#endif
+
+/* The session logs. */
+#define LOG_OUTPUT	0
+#define LOG_INPUT	1
+#define LOG_STREAMS	2
+
+extern char *progname, *host_sockname;
+extern SESSION_LOCAL char *sockname;
+extern int detach_char, no_suspend, use_ring;
+extern SESSION_LOCAL int redraw_method, queue_policy, zero_copy;
+extern SESSION_LOCAL size_t client_budget, session_budget, replay_size;
+extern SESSION_LOCAL size_t read_burst;
+extern SESSION_LOCAL unsigned long latency_budget;
+extern SESSION_LOCAL int size_policy;
+extern SESSION_LOCAL unsigned long resize_delay;
+extern SESSION_LOCAL char *log_path[LOG_STREAMS];
+extern SESSION_LOCAL size_t log_rotate_size;
+extern SESSION_LOCAL struct termios orig_term;
+extern SESSION_LOCAL int dont_have_tty;
 
 enum
 {
@@ -105,6 +147,13 @@ enum
 	MSG_DETACH	= 2,
 	MSG_WINCH	= 3,
 	MSG_REDRAW	= 4,
+	MSG_HELLO	= 5,
+	MSG_FRAMED	= 6,
+	MSG_STATS	= 7,
+	MSG_STATUS	= 8,
+	MSG_RING	= 9,
+	MSG_WAIT	= 10,
+	MSG_EXPECT	= 11,
 };
 
 enum
@@ -113,6 +162,25 @@ enum
 	REDRAW_NONE	= 1,
 	REDRAW_CTRL_L	= 2,
 	REDRAW_WINCH	= 3,
+	REDRAW_SNAPSHOT	= 4,
+};
+
+/* What the master does with a client that can't keep up with the output. */
+enum
+{
+	QUEUE_BLOCK	= 0,
+	QUEUE_DROP	= 1,
+	QUEUE_EVICT	= 2,
+};
+
+/* How the master picks the size of the pty when clients of different sizes
+** are attached. */
+enum
+{
+	SIZE_LATEST	= 0,
+	SIZE_SMALLEST	= 1,
+	SIZE_LARGEST	= 2,
+	SIZE_OWNER	= 3,
 };
 
 /* The client to master protocol. */
@@ -127,6 +195,74 @@ struct packet
 	} u;
 };
 
+/*
+** Clients that have more to say than fits in a packet can switch to framed
+** messages. The client sends MSG_HELLO with the highest protocol version it
+** understands in len, and a master that knows about framing replies with a
+** MSG_HELLO packet holding the version it picked. The client then sends
+** MSG_FRAMED with that version, and everything after it is framed. Masters
+** that predate framing ignore both packets and never reply, so the client
+** carries on with plain packets.
+**
+** A frame is a header followed by len bytes of payload. MSG_PUSH frames carry
+** up to MAX_FRAME bytes of input for the program, and frames of any other
+** type carry a struct packet.
+*/
+#define PROTOCOL_FRAMED 1
+
+struct frame
+{
+	unsigned char type;
+	/* The length of the payload, big endian. */
+	unsigned char len[3];
+};
+
+#define MAX_FRAME 65536
+#define FRAME_LEN(f) \
+	(((size_t)(f)->len[0] << 16) | ((f)->len[1] << 8) | (f)->len[2])
+#define FRAME_SET_LEN(f, n) \
+	((f)->len[0] = ((n) >> 16) & 0xff, (f)->len[1] = ((n) >> 8) & 0xff, \
+	 (f)->len[2] = (n) & 0xff)
+
+/*
+** A client asks whether anyone is attached with MSG_STATUS, and the master
+** answers with a MSG_STATUS packet whose len is the number of attached
+** clients, up to 255. This takes the place of looking at the socket's user
+** execute bit, which only a socket file has.
+*/
+
+/*
+** A local client can ask for its output to come through a ring in shared
+** memory instead of the socket, by sending MSG_RING before it attaches. The
+** master answers with a MSG_RING packet whose len is the client's reader
+** number plus one, along with the ring and an eventfd to wait on, passed
+** with SCM_RIGHTS. A len of 0 means no ring, and the output keeps coming
+** through the socket.
+*/
+#define RING_READERS 64
+
+/*
+** A client that waits for a pattern to turn up in the output sends a
+** MSG_WAIT frame holding the pattern, of up to MATCH_MAX bytes. Once the
+** pattern has been seen, the master answers with a MSG_WAIT packet whose len
+** is 1. A len of 0 means the master couldn't take the pattern on.
+*/
+#define MATCH_MAX 256
+
+/*
+** A client can also send input and collect the output it causes in one go.
+** It sends a MSG_EXPECT frame holding how long the output may go quiet, in
+** milliseconds as 4 bytes big endian (0 for no limit), followed by a pattern
+** of up to MATCH_MAX bytes, which may be empty. Its input follows in MSG_PUSH
+** frames. From then on, the master sends it the output of the program in
+** MSG_PUSH frames, up to the end of the first match of the pattern or until
+** the output has been quiet for that long. It finishes with a MSG_WAIT
+** frame holding a struct packet whose len is 1 if the pattern turned up and
+** 2 if the output went quiet, or 0 if the master couldn't take it on.
+*/
+#define EXPECT_FOUND	1
+#define EXPECT_QUIET	2
+
 /*
 ** The master sends a simple stream of text to the attaching clients, without
 ** any protocol. This might change back to the packet based protocol in the
@@ -139,12 +275,174 @@ struct packet
 /* This hopefully moves to the bottom of the screen */
 #define EOS "\033[999H"
 
+/* Conditions reported by the master's event loop. */
+#define EV_READ		0x01
+#define EV_WRITE	0x02
+
+/* A descriptor watched by the master's event loop. */
+struct watch
+{
+	/* The descriptor being watched. */
+	int fd;
+	/* The conditions the owner is interested in. */
+	int want;
+	/* The conditions the kernel reported and that were not consumed yet. */
+	int ready;
+	/* Called when one of the wanted conditions is ready. */
+	void (*handler)(struct watch *w);
+	/* The owner of the watch. */
+	void *data;
+	/* Links in the list of ready watches. */
+	struct watch *next;
+	struct watch **pprev;
+	/* Link in the list of all watches, for backends that need it. */
+	struct watch *all_next;
+	/* Backend-specific state. */
+	void *priv;
+};
+
+/* A write handed to the kernel with ev_writev. */
+struct ev_req
+{
+	/* Called with the result once the write has finished. */
+	void (*done)(struct ev_req *r, int res);
+	/* The result, and the link in the list of finished requests. */
+	int res;
+	struct ev_req *next;
+};
+
+/* A one-shot timer run by the master's event loop. */
+struct timer
+{
+	/* When the timer expires, in microseconds on the ev_now() clock. */
+	unsigned long long when;
+	/* Called once the timer has expired. */
+	void (*handler)(struct timer *t);
+	/* The owner of the timer. */
+	void *data;
+	/* Links in the list of armed timers, or NULL if not armed. */
+	struct timer *next;
+	struct timer **pprev;
+};
+
+struct screen *screen_new(int rows, int cols);
+void screen_feed(struct screen *scr, const unsigned char *buf, size_t len);
+void screen_resize(struct screen *scr, int rows, int cols);
+size_t screen_snapshot(struct screen *scr, unsigned char **out);
+void screen_free(struct screen *scr);
+
+int log_open(int stream, const char *path, size_t rotate);
+int log_start(void);
+void log_close(void);
+void log_write(int stream, const void *buf, size_t len);
+unsigned long long log_dropped(int stream);
+
+struct ring *ring_new(void);
+int ring_memfd(struct ring *r);
+void ring_free(struct ring *r);
+int ring_eventfd(void);
+void ring_signal(int fd);
+void ring_clear(int fd);
+void ring_reader_reset(struct ring *r, int n);
+void ring_put(struct ring *r, unsigned int to, const struct iovec *iov, int n);
+int ring_wake_wanted(struct ring *r, int n);
+unsigned long long ring_overruns(struct ring *r);
+struct ring *ring_open(int fd, int n);
+void ring_restart(struct ring *r);
+int ring_pending(struct ring *r);
+int ring_sleep(struct ring *r);
+size_t ring_get(struct ring *r, unsigned char *buf, size_t len, int *lost);
+
+struct matcher *matcher_new(void);
+void matcher_free(struct matcher *m);
+struct pattern *pattern_get(struct matcher *m, const unsigned char *str,
+			    size_t len);
+void pattern_put(struct matcher *m, struct pattern *pat);
+int pattern_matched(struct pattern *pat);
+size_t pattern_end(struct pattern *pat);
+int matcher_feed(struct matcher *m, const unsigned char *buf, size_t len);
+
+void registry_add(char **argv, pid_t pid);
+void registry_update(int attached, unsigned long long output);
+void registry_remove(void);
+int list_main(void);
+
+/* A histogram with power of two buckets. Bucket i counts the values up to
+** unit << i, and the last bucket counts everything above that. */
+#define HIST_BUCKETS	20
+struct histogram
+{
+	unsigned long unit;
+	unsigned long long bucket[HIST_BUCKETS + 1];
+	unsigned long long count, sum;
+};
+
+/* A growing buffer of text. */
+struct text
+{
+	char *buf;
+	size_t len, size;
+};
+
+void hist_add(struct histogram *h, unsigned long long value);
+void text_printf(struct text *t, const char *fmt, ...);
+void stats_header(struct text *t, const char *name, const char *type,
+		  const char *help);
+void stats_value(struct text *t, const char *name, const char *type,
+		 const char *help, unsigned long long value);
+void stats_seconds(struct text *t, const char *name, const char *help,
+		   unsigned long long usec);
+void stats_histogram(struct text *t, const char *name, const char *help,
+		     const struct histogram *h, double scale);
+
+int ev_init(void);
+void ev_close(void);
+int ev_add(struct watch *w);
+void ev_del(struct watch *w);
+void ev_want(struct watch *w, int want);
+void ev_clear(struct watch *w, int cond);
+int ev_pending(void);
+int ev_wait(int timeout);
+void ev_dispatch(void);
+int ev_async(void);
+const char *ev_backend(void);
+void ev_counts(unsigned long long *syscalls, unsigned long long *async);
+int ev_writev(int fd, const struct iovec *iov, int iovcnt, struct ev_req *r);
+void ev_cancel(struct ev_req *r);
+unsigned long long ev_now(void);
+void ev_timer_set(struct timer *t, unsigned long usec);
+void ev_timer_cancel(struct timer *t);
+
+int connect_socket(char *name);
+int setnonblocking(int fd);
+int socket_at(int s, const char *name, int create);
+int peer_allowed(int fd);
+int create_socket(char *name);
 void write_buf_or_fail(int fd, const void *buf, size_t count);
+int read_all(int fd, void *buf, size_t count);
 void write_packet_or_fail(int fd, const struct packet *pkt);
 
 int attach_main(int noerror);
 int master_main(char **argv, int waitattach, int dontfork);
 int push_main(void);
+int stats_main(void);
+int status_main(void);
+int wait_main(const char *pattern, unsigned long timeout);
+int expect_main(const char *pattern, unsigned long timeout,
+		unsigned long quiet);
+int relay_main(char *address);
+int relay_address(const char *name);
+int relay_connect(const char *name, int compress);
+ssize_t relay_read(int s, void *buf, size_t len);
+int relay_pending(void);
+int host_main(int nwarm);
+int host_create(char **argv, int waitattach);
+void host_session_started(void);
+void host_session_end(void);
+void master_hosted(int s, char **argv, int waitattach, int statusfd,
+		   const char *cwd, char **env, mode_t mask);
+int master_warm(void);
+void master_unwarm(void);
 
 #ifdef sun
 #define BROKEN_MASTER
@@ -0,0 +1,855 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** The master's event loop. Every descriptor is registered once, and the
+** kernel reports edges (a descriptor becoming readable or writable). The
+** reported conditions are remembered in the watch until its owner consumes
+** them by running into EAGAIN, so a handler is free to stop early and will
+** simply be called again on the next pass. Watches with something to do are
+** kept on a ready list, which makes each pass cost O(ready descriptors)
+** instead of O(connected clients).
+**
+** io_uring is used where the kernel supports it, followed by epoll.
+** Otherwise we fall back to select, which has to rebuild its descriptor
+** sets on every pass and cannot handle descriptors at or above FD_SETSIZE.
+**
+** With io_uring, every descriptor has a multishot poll armed for as long as
+** it is watched, so that readiness is reported without any system calls
+** beyond the one that waits. Owners can also hand writes to the kernel with
+** ev_writev, which are queued up and submitted all at once when the loop
+** next waits, instead of one system call each.
+*/
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define USE_EPOLL
+#include <sys/epoll.h>
+
+/* The number of events fetched from the kernel at once. */
+#define MAX_EVENTS 256
+
+static SESSION_LOCAL int epfd = -1;
+#else
+/* Every registered watch, since select needs to see all of them. */
+static SESSION_LOCAL struct watch *all_watches;
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && \
+    defined(HAVE_SYS_SYSCALL_H)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG) && \
+    defined(IORING_POLL_ADD_MULTI)
+#define USE_URING
+
+/* The number of submission queue entries. */
+#define RING_ENTRIES 256
+
+/* What the user_data of a submission refers to. Requests are tagged by
+** setting the lowest bit, the rest are poll tokens. */
+#define TAG_NONE	0
+#define TAG_REQ		1
+
+/* The multishot poll of a watch. It outlives the watch until the kernel
+** has reported the poll as finished. */
+struct poll_token
+{
+	/* The watch, or NULL once it has been deleted. */
+	struct watch *w;
+};
+
+static SESSION_LOCAL int ring_fd = -1;
+static SESSION_LOCAL unsigned ring_entries;
+/* The mappings of the rings, for unmapping them. */
+static SESSION_LOCAL void *ring_mem;
+static SESSION_LOCAL size_t ring_size;
+/* The submission queue. */
+static SESSION_LOCAL unsigned *sq_head, *sq_tail, *sq_mask;
+static SESSION_LOCAL struct io_uring_sqe *sqes;
+static SESSION_LOCAL unsigned sq_local_tail;
+static SESSION_LOCAL unsigned to_submit;
+/* The completion queue. */
+static SESSION_LOCAL unsigned *cq_head, *cq_tail, *cq_mask;
+static SESSION_LOCAL struct io_uring_cqe *cqes;
+
+/* Finished requests whose owners still have to be told. */
+static SESSION_LOCAL struct ev_req *done_list;
+static SESSION_LOCAL struct ev_req **done_tail;
+#endif
+#endif
+
+/* The watches that have a wanted condition pending. The tails are set up
+** by ev_init. */
+static SESSION_LOCAL struct watch *ready_list;
+static SESSION_LOCAL struct watch **ready_tail;
+
+/* The watch whose handler is currently running, or NULL if it went away. */
+static SESSION_LOCAL struct watch *running;
+
+/* The armed timers, soonest first. */
+static SESSION_LOCAL struct timer *timers;
+
+/* The system calls made by the event loop itself, and the writes handed to
+** the kernel without a system call of their own. See ev_counts. */
+static SESSION_LOCAL unsigned long long nsyscalls, nasync;
+
+/* Puts a watch at the end of the ready list. */
+static void
+ready_link(struct watch *w)
+{
+	w->next = NULL;
+	w->pprev = ready_tail;
+	*ready_tail = w;
+	ready_tail = &w->next;
+}
+
+/* Takes a watch off whichever ready list it is on. */
+static void
+ready_unlink(struct watch *w)
+{
+	if (!w->pprev)
+		return;
+	if (w->next)
+		w->next->pprev = w->pprev;
+	else if (ready_tail == &w->next)
+		ready_tail = w->pprev;
+	*(w->pprev) = w->next;
+	w->next = NULL;
+	w->pprev = NULL;
+}
+
+/* Queue or dequeue the watch depending on whether it has work to do. */
+static void
+ready_update(struct watch *w)
+{
+	if (w->ready & w->want)
+	{
+		if (!w->pprev)
+			ready_link(w);
+	}
+	else
+		ready_unlink(w);
+}
+
+#if (defined(USE_EPOLL) || defined(USE_URING)) && \
+    defined(HAVE_SYS_RESOURCE_H) && defined(RLIMIT_NOFILE)
+/* Raise the descriptor limit as far as we are allowed to, so that the
+** number of attached clients is not capped by the default soft limit. This
+** is done after the child has been started, so it still sees the usual
+** limit. */
+static void
+raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+	if (rl.rlim_cur == rl.rlim_max)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+#endif
+
+/* Shorten a timeout in milliseconds so that the wait ends when the next
+** timer is due, rounding up so that we don't wake up early. */
+static int
+timer_timeout(int timeout)
+{
+	unsigned long long now;
+	unsigned long long ms;
+
+	if (!timers)
+		return timeout;
+	now = ev_now();
+	if (timers->when <= now)
+		return 0;
+	ms = (timers->when - now + 999) / 1000;
+	if (timeout < 0 || ms < (unsigned long long)timeout)
+		timeout = ms;
+	return timeout;
+}
+
+#ifdef USE_URING
+/* Set up the rings. Returns -1 if the kernel can't give us what we need,
+** in which case the other backends are used. */
+static int
+uring_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	unsigned char *ring;
+	void *mem;
+	unsigned i, *sq_array;
+	unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+		IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_EXT_ARG;
+
+	memset(&p, 0, sizeof(p));
+	ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (ring_fd < 0)
+		return -1;
+	if ((p.features & need) != need)
+		goto fail;
+	ring_entries = p.sq_entries;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+	mem = mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (mem == MAP_FAILED)
+		goto fail;
+	ring = mem;
+	mem = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd,
+		   IORING_OFF_SQES);
+	if (mem == MAP_FAILED)
+	{
+		munmap(ring, sq_size);
+		goto fail;
+	}
+	sqes = mem;
+	ring_mem = ring;
+	ring_size = sq_size;
+
+	sq_head = (unsigned *)(ring + p.sq_off.head);
+	sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(ring + p.sq_off.array);
+	cq_head = (unsigned *)(ring + p.cq_off.head);
+	cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/* Submission queue entries are always used in order. */
+	for (i = 0; i < p.sq_entries; ++i)
+		sq_array[i] = i;
+	sq_local_tail = *sq_tail;
+	return 0;
+
+fail:
+	close(ring_fd);
+	ring_fd = -1;
+	return -1;
+}
+
+/* Hand the queued submissions to the kernel, optionally waiting up to
+** timeout milliseconds (-1 for forever) for at least one completion. */
+static int
+uring_enter(int wait, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	int ret;
+
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+	memset(&arg, 0, sizeof(arg));
+	if (wait)
+	{
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout >= 0)
+		{
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+	ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait ? 1 : 0,
+		      flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+	nsyscalls++;
+	if (ret < 0)
+	{
+		if (errno == ETIME)
+			return 0;
+		return -1;
+	}
+	if ((unsigned)ret < to_submit)
+		to_submit -= ret;
+	else
+		to_submit = 0;
+	return 0;
+}
+
+/* Get a submission queue entry to fill in, submitting what is queued if
+** the queue is full. */
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+	       ring_entries)
+	{
+		if (uring_enter(0, 0) < 0 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY)
+			return NULL;
+	}
+	sqe = &sqes[sq_local_tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_local_tail++;
+	to_submit++;
+	return sqe;
+}
+
+/* Arm the multishot poll of a watch. */
+static int
+uring_poll(struct poll_token *t)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = t->w->fd;
+	/* The kernel swaps the halves of poll32_events on big endian
+	** machines, which makes this right on both. */
+	sqe->poll_events = POLLIN | POLLOUT;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (unsigned long)t;
+	return 0;
+}
+
+/* Take what the kernel finished off the completion queue. */
+static void
+uring_reap(void)
+{
+	unsigned head = *cq_head;
+
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		unsigned long data = cqe->user_data;
+
+		head++;
+		if (data == TAG_NONE)
+			continue;
+		if (data & TAG_REQ)
+		{
+			struct ev_req *r = (struct ev_req *)(data & ~TAG_REQ);
+
+			r->res = cqe->res;
+			r->next = NULL;
+			*done_tail = r;
+			done_tail = &r->next;
+		}
+		else
+		{
+			struct poll_token *t = (struct poll_token *)data;
+			struct watch *w = t->w;
+
+			if (w && cqe->res > 0)
+			{
+				if (cqe->res & (POLLIN|POLLHUP|POLLERR))
+					w->ready |= EV_READ;
+				if (cqe->res & (POLLOUT|POLLHUP|POLLERR))
+					w->ready |= EV_WRITE;
+				ready_update(w);
+			}
+
+			/* The poll is finished. Either the watch is gone,
+			** or the kernel gave up on it and it has to be armed
+			** again. */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				if (!w)
+					free(t);
+				else if (uring_poll(t) < 0)
+				{
+					w->ready |= EV_READ|EV_WRITE;
+					ready_update(w);
+				}
+			}
+		}
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+/* Initialize the event loop. */
+int
+ev_init(void)
+{
+	ready_tail = &ready_list;
+#ifdef USE_URING
+	done_tail = &done_list;
+	if (uring_init() == 0)
+	{
+#if defined(HAVE_SYS_RESOURCE_H) && defined(RLIMIT_NOFILE)
+		raise_fd_limit();
+#endif
+		return 0;
+	}
+#endif
+#ifdef USE_EPOLL
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+#if defined(HAVE_SYS_RESOURCE_H) && defined(RLIMIT_NOFILE)
+	raise_fd_limit();
+#endif
+#endif
+	return 0;
+}
+
+/* Tear down the event loop, once every watch has been deleted. Requests
+** that haven't finished are forgotten, and their owners are never told. */
+void
+ev_close(void)
+{
+#ifdef USE_URING
+	if (ring_fd >= 0)
+	{
+		/* Poll tokens that the kernel hasn't let go of yet are
+		** leaked, which beats freeing them under its feet. */
+		uring_enter(0, 0);
+		uring_reap();
+		munmap(sqes, ring_entries * sizeof(struct io_uring_sqe));
+		munmap(ring_mem, ring_size);
+		close(ring_fd);
+		ring_fd = -1;
+		done_list = NULL;
+		return;
+	}
+#endif
+#ifdef USE_EPOLL
+	close(epfd);
+	epfd = -1;
+#endif
+}
+
+/* Start watching w->fd. The descriptor must be in non-blocking mode, and is
+** initially assumed to be neither readable nor writable. */
+int
+ev_add(struct watch *w)
+{
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+#endif
+
+#ifdef USE_URING
+	if (ring_fd >= 0)
+	{
+		struct poll_token *t = malloc(sizeof(struct poll_token));
+
+		if (!t)
+			return -1;
+		t->w = w;
+		if (uring_poll(t) < 0)
+		{
+			free(t);
+			return -1;
+		}
+		w->priv = t;
+		w->ready = 0;
+		w->next = NULL;
+		w->pprev = NULL;
+		return 0;
+	}
+#endif
+#ifdef USE_EPOLL
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = w;
+	nsyscalls++;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
+		return -1;
+#else
+	if (w->fd >= FD_SETSIZE)
+	{
+		errno = EMFILE;
+		return -1;
+	}
+	w->all_next = all_watches;
+	all_watches = w;
+#endif
+	w->ready = 0;
+	w->next = NULL;
+	w->pprev = NULL;
+	return 0;
+}
+
+/* Stop watching w->fd. This must be done before the descriptor is closed. */
+void
+ev_del(struct watch *w)
+{
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+#endif
+
+#ifdef USE_URING
+	if (ring_fd >= 0)
+	{
+		struct poll_token *t = w->priv;
+		struct io_uring_sqe *sqe = uring_sqe();
+
+		/* The token is freed once the kernel says the poll is
+		** gone. */
+		t->w = NULL;
+		if (sqe)
+		{
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->addr = (unsigned long)t;
+			sqe->user_data = TAG_NONE;
+		}
+		w->priv = NULL;
+	}
+	else
+#endif
+	{
+#ifdef USE_EPOLL
+	/* Older kernels insist on a non-NULL event. */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, &ev);
+	nsyscalls++;
+#else
+	struct watch **pw;
+
+	for (pw = &all_watches; *pw; pw = &(*pw)->all_next)
+	{
+		if (*pw == w)
+		{
+			*pw = w->all_next;
+			break;
+		}
+	}
+#endif
+	}
+	ready_unlink(w);
+	if (running == w)
+		running = NULL;
+}
+
+/* Change the set of conditions the owner of w is interested in. */
+void
+ev_want(struct watch *w, int want)
+{
+	w->want = want;
+	ready_update(w);
+}
+
+/* The owner ran into EAGAIN, so the conditions are no longer true. */
+void
+ev_clear(struct watch *w, int cond)
+{
+	w->ready &= ~cond;
+	ready_update(w);
+}
+
+/* Returns non-zero if a watch or a finished request is waiting to be
+** dispatched. */
+int
+ev_pending(void)
+{
+#ifdef USE_URING
+	if (done_list)
+		return 1;
+#endif
+	return ready_list != NULL;
+}
+
+/* Returns non-zero if writes can be handed to the kernel with ev_writev. */
+int
+ev_async(void)
+{
+#ifdef USE_URING
+	return ring_fd >= 0;
+#else
+	return 0;
+#endif
+}
+
+/* The name of the backend the event loop runs on. */
+const char *
+ev_backend(void)
+{
+#ifdef USE_URING
+	if (ring_fd >= 0)
+		return "io_uring";
+#endif
+#ifdef USE_EPOLL
+	return "epoll";
+#else
+	return "select";
+#endif
+}
+
+/* Get the number of system calls the event loop has made itself, such as
+** waiting for events, and the number of writes handed to the kernel with
+** ev_writev, which take no system call of their own. Reads and writes made
+** by the callers are not counted. */
+void
+ev_counts(unsigned long long *syscalls, unsigned long long *async)
+{
+	*syscalls = nsyscalls;
+	*async = nasync;
+}
+
+/* Start writing iov to fd in the background. The memory it refers to must
+** stay put until r->done has been called with the result of the write, as
+** a byte count or a negative errno value. Returns -1 if the write could not
+** be started. */
+int
+ev_writev(int fd, const struct iovec *iov, int iovcnt, struct ev_req *r)
+{
+#ifdef USE_URING
+	struct io_uring_sqe *sqe;
+
+	if (ring_fd >= 0 && (sqe = uring_sqe()) != NULL)
+	{
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long)iov;
+		sqe->len = iovcnt;
+		sqe->user_data = (unsigned long)r | TAG_REQ;
+		nasync++;
+		return 0;
+	}
+#else
+	(void)fd;
+	(void)iov;
+	(void)iovcnt;
+	(void)r;
+#endif
+	errno = ENOSYS;
+	return -1;
+}
+
+/* Ask the kernel to give up on a write started with ev_writev. r->done is
+** still called when it has. The write has been handed to the kernel by the
+** time this returns, so the descriptor may be closed right away. */
+void
+ev_cancel(struct ev_req *r)
+{
+#ifdef USE_URING
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long)r | TAG_REQ;
+		sqe->user_data = TAG_NONE;
+	}
+
+	/* A write still waiting to be submitted only names the descriptor,
+	** and would go to whatever it is reused for once it is closed. Once
+	** submitted, the write holds on to the file it was started on. */
+	while (to_submit > 0)
+	{
+		if (uring_enter(0, 0) < 0 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY)
+			break;
+	}
+#else
+	(void)r;
+#endif
+}
+
+/* Returns the current time in microseconds. Only differences between two
+** values mean anything. */
+unsigned long long
+ev_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long long)ts.tv_sec * 1000000 +
+			ts.tv_nsec / 1000;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+}
+
+/* Arm a timer to expire usec microseconds from now, replacing whatever it
+** was armed for before. */
+void
+ev_timer_set(struct timer *t, unsigned long usec)
+{
+	struct timer **pt;
+
+	ev_timer_cancel(t);
+	t->when = ev_now() + usec;
+	for (pt = &timers; *pt && (*pt)->when <= t->when; pt = &(*pt)->next)
+		;
+	t->next = *pt;
+	t->pprev = pt;
+	if (*pt)
+		(*pt)->pprev = &t->next;
+	*pt = t;
+}
+
+/* Disarm a timer. Nothing happens if it isn't armed. */
+void
+ev_timer_cancel(struct timer *t)
+{
+	if (!t->pprev)
+		return;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	*(t->pprev) = t->next;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* Wait up to timeout milliseconds (-1 for forever) for the kernel to report
+** new conditions, and queue the watches that became ready. The wait is cut
+** short when a timer is due. Returns -1 with errno set on failure. */
+int
+ev_wait(int timeout)
+{
+#ifdef USE_EPOLL
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+#else
+	fd_set readfds, writefds;
+	struct timeval tv, *tvp = NULL;
+	struct watch *w;
+	int highest_fd = -1;
+#endif
+
+	timeout = timer_timeout(timeout);
+#ifdef USE_URING
+	if (ring_fd >= 0)
+	{
+		int wait = (timeout != 0 && *cq_head ==
+			    __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE));
+
+		if (uring_enter(wait, timeout) < 0)
+			return -1;
+		uring_reap();
+		return 0;
+	}
+#endif
+#ifdef USE_EPOLL
+	n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+	nsyscalls++;
+	if (n < 0)
+		return -1;
+	for (i = 0; i < n; ++i)
+	{
+		struct watch *w = events[i].data.ptr;
+
+		if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			w->ready |= EV_READ;
+		if (events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+			w->ready |= EV_WRITE;
+		ready_update(w);
+	}
+	return 0;
+#else
+	/* Like epoll, report each condition once when it becomes true, whether
+	** or not it is wanted right now. Conditions that are already known to
+	** be true don't need to be asked about again. */
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	for (w = all_watches; w; w = w->all_next)
+	{
+		int ask = (EV_READ|EV_WRITE) & ~w->ready;
+
+		if (ask & EV_READ)
+			FD_SET(w->fd, &readfds);
+		if (ask & EV_WRITE)
+			FD_SET(w->fd, &writefds);
+		if (ask && w->fd > highest_fd)
+			highest_fd = w->fd;
+	}
+	if (timeout >= 0)
+	{
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		tvp = &tv;
+	}
+	nsyscalls++;
+	if (select(highest_fd + 1, &readfds, &writefds, NULL, tvp) < 0)
+		return -1;
+	for (w = all_watches; w; w = w->all_next)
+	{
+		if (FD_ISSET(w->fd, &readfds))
+			w->ready |= EV_READ;
+		if (FD_ISSET(w->fd, &writefds))
+			w->ready |= EV_WRITE;
+		ready_update(w);
+	}
+	return 0;
+#endif
+}
+
+/* Run the handler of every timer that is due, and of every watch that was
+** ready when the pass started. */
+void
+ev_dispatch(void)
+{
+	struct watch *pending;
+
+#ifdef USE_URING
+	/* Tell the owners about their finished requests. */
+	while (done_list)
+	{
+		struct ev_req *r = done_list;
+
+		done_list = r->next;
+		if (!done_list)
+			done_tail = &done_list;
+		r->done(r, r->res);
+	}
+#endif
+
+	if (timers)
+	{
+		unsigned long long now = ev_now();
+
+		while (timers && timers->when <= now)
+		{
+			struct timer *t = timers;
+
+			ev_timer_cancel(t);
+			t->handler(t);
+		}
+	}
+
+	pending = ready_list;
+	if (!pending)
+		return;
+
+	/* Detach the current list, so that watches becoming ready while we
+	** work are handled on the next pass instead of starving the rest. */
+	pending->pprev = &pending;
+	ready_list = NULL;
+	ready_tail = &ready_list;
+
+	while (pending)
+	{
+		struct watch *w = pending;
+
+		ready_unlink(w);
+		running = w;
+		w->handler(w);
+
+		/* Requeue it if the handler stopped before running dry. */
+		if (running)
+			ready_update(running);
+	}
+	running = NULL;
+}
@@ -0,0 +1,644 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** The host daemon. Instead of a master process per session, one daemon
+** runs any number of sessions, which saves a process (and its page tables)
+** per session and lets all of them be shut down at once.
+**
+** dtach -n -H <host> connects to the daemon and sends it what the master
+** would have been started with: the session's socket, its options, the
+** command, and the directory, environment and umask to run it with. The
+** daemon gives the session a thread of its own, which creates the socket
+** and runs the master's code from there, so clients attach to it exactly
+** like they attach to any other session. Errors are sent back over the
+** connection, which is closed once the program is running.
+**
+** Every session has its own event loop on its own thread, rather than all
+** of them sharing one loop served by a small pool of workers. The master's
+** code is written around the state of a single session, which it keeps per
+** thread for this (see SESSION_LOCAL), so a hosted session runs the very
+** same code as a master of its own. Sharing a loop would mean passing a
+** session to every function of the master, and a session busy with a flood
+** of output or a slow client could hold up the others on its worker. As it
+** is, the kernel spreads the threads over the CPUs, and a session can't
+** stall any other.
+**
+** The price is a thread and an event loop descriptor (an epoll or io_uring
+** instance) per session. An idle session's thread sleeps in the kernel and
+** costs the scheduler nothing until its session has work, and of its stack
+** (HOST_STACK) only the few pages touched are ever backed by memory. What is
+** saved over a master per session is the process: its page tables, its
+** copy of the program's data, and the fork.
+**
+** With dtach -D <host> -k <count>, the daemon keeps a pool of count warm
+** sessions: threads that have their event loop and pty set up, and a child
+** on the pty waiting to run the program (see master_warm). A request is
+** handed to a warm session if one is ready, so that creating the session
+** only takes binding its socket and executing the program, and the pool is
+** topped up in the background.
+*/
+#ifdef USE_HOST
+#include <poll.h>
+#include <pthread.h>
+
+/* Identifies a request, and the version of its layout. */
+#define HOST_MAGIC	0x64746832
+
+/* The stack of a session's thread. */
+#define HOST_STACK	(256 * 1024)
+
+/* The most a request may hold. */
+#define HOST_MAX_REQUEST	(1024 * 1024)
+
+/* What is sent to the daemon to create a session. It is followed by len
+** bytes of strings: the socket, the directory to run the program in, the
+** output and input logs (empty if not logged), argc arguments and envc
+** environment variables. Both ends are the same dtach, so the layout is
+** simply that of the structure. */
+struct host_request
+{
+	unsigned int magic;
+	int waitattach;
+	int redraw_method, queue_policy, zero_copy, dont_have_tty;
+	int size_policy;
+	unsigned long client_budget, session_budget, replay_size;
+	unsigned long latency_budget, log_rotate_size, read_burst;
+	unsigned long resize_delay;
+	unsigned int umask;
+	struct termios term;
+	unsigned int argc, envc;
+	unsigned int len;
+};
+
+/* A session run by the daemon. */
+struct session
+{
+	/* The connection the session was asked for on. */
+	int fd;
+	struct host_request req;
+	char *strings;
+	char **argv, **env;
+	/* The session's socket, which points into strings. */
+	char *sockname;
+	struct session *next, **pprev;
+	/* The next request waiting for a warm session to pick it up. */
+	struct session *claim_next;
+};
+
+/* The sessions, which the daemon needs to know about to shut them down. */
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct session *sessions;
+/* The session of the current thread. */
+static SESSION_LOCAL struct session *this_session;
+/* The warm pool: the number of sessions it should have, the number it has,
+** including the ones still getting ready, and the number that are ready.
+** Requests handed to the pool wait in pool_claims until a ready session
+** picks them up. All of it is protected by host_lock. */
+static int pool_size, pool_live, pool_idle;
+static struct session *pool_claims;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+/* Set by the signals that tell the daemon to shut down. */
+static volatile sig_atomic_t host_quit;
+
+/* Make a path absolute, relative to cwd. Abstract socket names are left
+** alone. */
+static char *
+absolute(const char *cwd, const char *path)
+{
+	char *abs;
+
+	if (path[0] == '/' || SOCKET_ABSTRACT(path))
+		return strdup(path);
+	abs = malloc(strlen(cwd) + strlen(path) + 2);
+	if (abs)
+		sprintf(abs, "%s/%s", cwd, path);
+	return abs;
+}
+
+/* Pick count strings out of a request, returning a NULL terminated array
+** of them. */
+static char **
+take_strings(char **pos, char *end, unsigned int count)
+{
+	char **v = malloc((count + 1) * sizeof(char *));
+	unsigned int i;
+
+	if (!v)
+		return NULL;
+	for (i = 0; i < count; ++i)
+	{
+		char *s = *pos;
+
+		if (s >= end)
+		{
+			free(v);
+			return NULL;
+		}
+		v[i] = s;
+		*pos = s + strlen(s) + 1;
+	}
+	v[count] = NULL;
+	return v;
+}
+
+/* Read the request of a session, and give the session's thread the options
+** it asks for. */
+static int
+read_request(struct session *h)
+{
+	struct host_request *r = &h->req;
+	char *pos, *end, **fixed;
+
+	if (read_all(h->fd, r, sizeof(*r)) < 0 || r->magic != HOST_MAGIC ||
+	    r->len == 0 || r->len > HOST_MAX_REQUEST || r->argc == 0)
+		return -1;
+	h->strings = malloc(r->len + 1);
+	if (!h->strings || read_all(h->fd, h->strings, r->len) < 0)
+		return -1;
+	/* Make sure the last string ends. */
+	h->strings[r->len] = '\0';
+
+	pos = h->strings;
+	end = h->strings + r->len;
+	fixed = take_strings(&pos, end, 4);
+	if (!fixed)
+		return -1;
+	h->argv = take_strings(&pos, end, r->argc);
+	h->env = take_strings(&pos, end, r->envc);
+	if (!h->argv || !h->env || fixed[1][0] != '/' ||
+	    (fixed[0][0] != '/' && !SOCKET_ABSTRACT(fixed[0])))
+	{
+		free(fixed);
+		return -1;
+	}
+
+	h->sockname = sockname = fixed[0];
+	log_path[LOG_OUTPUT] = fixed[2][0] ? fixed[2] : NULL;
+	log_path[LOG_INPUT] = fixed[3][0] ? fixed[3] : NULL;
+	redraw_method = r->redraw_method;
+	queue_policy = r->queue_policy;
+	zero_copy = r->zero_copy;
+	client_budget = r->client_budget;
+	session_budget = r->session_budget;
+	replay_size = r->replay_size;
+	latency_budget = r->latency_budget;
+	read_burst = r->read_burst;
+	size_policy = r->size_policy;
+	resize_delay = r->resize_delay;
+	log_rotate_size = r->log_rotate_size;
+	orig_term = r->term;
+	dont_have_tty = r->dont_have_tty;
+	free(fixed);
+	return 0;
+}
+
+static void host_fill_pool(void);
+
+/* The session of the current thread is up and running. If it came from the
+** warm pool, the pool is topped up now that the session is no longer in a
+** hurry, so that getting the next one ready doesn't compete with it. */
+void
+host_session_started(void)
+{
+	host_fill_pool();
+}
+
+/* Forget about the session of the current thread, once it has ended. */
+void
+host_session_end(void)
+{
+	struct session *h = this_session;
+
+	if (!h)
+		return;
+	pthread_mutex_lock(&host_lock);
+	if (h->next)
+		h->next->pprev = h->pprev;
+	*(h->pprev) = h->next;
+	pthread_mutex_unlock(&host_lock);
+
+	free(h->strings);
+	free(h->argv);
+	free(h->env);
+	free(h);
+	this_session = NULL;
+}
+
+/* Run the session asked for on h, on the current thread. */
+static void
+host_run(struct session *h)
+{
+	int s;
+
+	this_session = h;
+	if (read_request(h) < 0)
+	{
+		close(h->fd);
+		master_unwarm();
+		host_session_end();
+		host_fill_pool();
+		return;
+	}
+
+	s = create_socket(sockname);
+	if (s < 0)
+	{
+		char buf[1024];
+		int len;
+
+		len = snprintf(buf, sizeof(buf), "%s: %s: %s\n", progname,
+			       sockname, strerror(errno));
+		if (len > 0 && write(h->fd, buf, len) < 0)
+			len = 0;
+		close(h->fd);
+		master_unwarm();
+		host_session_end();
+		host_fill_pool();
+		return;
+	}
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+
+	/* This only returns by ending the thread. */
+	master_hosted(s, h->argv, h->req.waitattach, h->fd,
+		      h->strings + strlen(h->sockname) + 1, h->env,
+		      h->req.umask);
+}
+
+/* The thread of a session. */
+static void *
+host_session(void *arg)
+{
+	host_run(arg);
+	return NULL;
+}
+
+/* A thread of the warm pool. It gets a session ready, and then waits for a
+** request to run it for. */
+static void *
+host_warm(ATTRIBUTE_UNUSED void *arg)
+{
+	struct session *h;
+
+	if (master_warm() < 0)
+	{
+		pthread_mutex_lock(&host_lock);
+		pool_live--;
+		pthread_mutex_unlock(&host_lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&host_lock);
+	pool_idle++;
+	while (!pool_claims)
+		pthread_cond_wait(&pool_cond, &host_lock);
+	h = pool_claims;
+	pool_claims = h->claim_next;
+	pthread_mutex_unlock(&host_lock);
+
+	host_run(h);
+	return NULL;
+}
+
+/* Start a thread for a session. */
+static int
+host_spawn(void *(*start)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int ret;
+
+	/* Signals are for the daemon, not the sessions. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, HOST_STACK);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&thread, &attr, start, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+/* Start warm sessions until the pool is back to its size. */
+static void
+host_fill_pool(void)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&host_lock);
+		if (pool_live >= pool_size)
+		{
+			pthread_mutex_unlock(&host_lock);
+			return;
+		}
+		pool_live++;
+		pthread_mutex_unlock(&host_lock);
+
+		if (host_spawn(host_warm, NULL) != 0)
+		{
+			pthread_mutex_lock(&host_lock);
+			pool_live--;
+			pthread_mutex_unlock(&host_lock);
+			return;
+		}
+	}
+}
+
+/* Hand a new connection to a warm session if one is ready, or start a
+** thread for it. */
+static void
+host_accept(int s)
+{
+	struct session *h;
+	int fd, claimed = 0;
+
+	fd = accept(s, NULL, NULL);
+	if (fd < 0)
+		return;
+	if (SOCKET_ABSTRACT(sockname) && !peer_allowed(fd))
+	{
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	h = calloc(1, sizeof(struct session));
+	if (!h)
+	{
+		close(fd);
+		return;
+	}
+	h->fd = fd;
+
+	pthread_mutex_lock(&host_lock);
+	h->pprev = &sessions;
+	h->next = sessions;
+	if (h->next)
+		h->next->pprev = &h->next;
+	sessions = h;
+	if (pool_idle > 0)
+	{
+		pool_idle--;
+		pool_live--;
+		h->claim_next = pool_claims;
+		pool_claims = h;
+		pthread_cond_signal(&pool_cond);
+		claimed = 1;
+	}
+	pthread_mutex_unlock(&host_lock);
+
+	if (!claimed && host_spawn(host_session, h) != 0)
+	{
+		this_session = h;
+		close(fd);
+		host_session_end();
+	}
+}
+
+/* Signal */
+static RETSIGTYPE
+host_die(ATTRIBUTE_UNUSED int sig)
+{
+	host_quit = 1;
+}
+
+/* The daemon - It accepts requests for new sessions until it is told to
+** shut down, which ends every session. */
+static void
+host_process(int s, int nwarm)
+{
+	struct session *h;
+	int nullfd;
+
+	setsid();
+
+	/* Sessions are created with the umask of whoever asked for them,
+	** and their sockets are private. */
+	umask(077);
+	if (chdir("/") < 0)
+		exit(1);
+	nullfd = open("/dev/null", O_RDWR);
+	dup2(nullfd, 0);
+	dup2(nullfd, 1);
+	dup2(nullfd, 2);
+	if (nullfd > 2)
+		close(nullfd);
+
+	/* Programs that exit are reaped by the kernel. */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGXFSZ, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+	signal(SIGINT, host_die);
+	signal(SIGTERM, host_die);
+
+	pool_size = nwarm;
+	host_fill_pool();
+
+	while (!host_quit)
+	{
+		struct pollfd pfd;
+
+		pfd.fd = s;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) > 0)
+			host_accept(s);
+	}
+
+	/* Take the sockets of the sessions away. The programs get a hangup
+	** when their ptys are closed on the way out. */
+	pthread_mutex_lock(&host_lock);
+	for (h = sessions; h; h = h->next)
+	{
+		if (h->sockname && !SOCKET_ABSTRACT(h->sockname))
+			unlink(h->sockname);
+	}
+	if (!SOCKET_ABSTRACT(sockname))
+		unlink(sockname);
+	exit(0);
+}
+
+int
+host_main(int nwarm)
+{
+	char cwd[4096];
+	int s;
+	pid_t pid;
+
+	/* The daemon runs in /, and still has to find its socket there. */
+	if (!getcwd(cwd, sizeof(cwd)) || !(sockname = absolute(cwd, sockname)))
+	{
+		printf("%s: getcwd: %s\n", progname, strerror(errno));
+		return 1;
+	}
+
+	s = create_socket(sockname);
+	if (s < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 1;
+	}
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+
+	/* Fork off so we can daemonize and such */
+	pid = fork();
+	if (pid < 0)
+	{
+		printf("%s: fork: %s\n", progname, strerror(errno));
+		if (!SOCKET_ABSTRACT(sockname))
+			unlink(sockname);
+		return 1;
+	}
+	else if (pid == 0)
+	{
+		host_process(s, nwarm);
+		return 0;
+	}
+	close(s);
+	return 0;
+}
+
+/* Add a string to a request. */
+static int
+add_string(struct text *t, const char *s)
+{
+	size_t len = t->len;
+
+	text_printf(t, "%s", s);
+	text_printf(t, "%c", 0);
+	return t->len == len + strlen(s) + 1 ? 0 : -1;
+}
+
+int
+host_create(char **argv, int waitattach)
+{
+	extern char **environ;
+	struct host_request r;
+	struct text t = {NULL, 0, 0};
+	char cwd[4096], *path[3], **v, buf[1024];
+	ssize_t len;
+	mode_t mask;
+	int s, i, failed = 0;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+	{
+		printf("%s: getcwd: %s\n", progname, strerror(errno));
+		return 1;
+	}
+
+	/* The daemon has a directory of its own, so the paths it is given
+	** have to be absolute. */
+	path[0] = absolute(cwd, sockname);
+	path[1] = log_path[LOG_OUTPUT] ? absolute(cwd, log_path[LOG_OUTPUT]) :
+		strdup("");
+	path[2] = log_path[LOG_INPUT] ? absolute(cwd, log_path[LOG_INPUT]) :
+		strdup("");
+	failed |= add_string(&t, path[0] ? path[0] : "");
+	failed |= add_string(&t, cwd);
+	failed |= add_string(&t, path[1] ? path[1] : "");
+	failed |= add_string(&t, path[2] ? path[2] : "");
+	for (i = 0; i < 3; ++i)
+	{
+		if (!path[i])
+			failed = 1;
+		free(path[i]);
+	}
+
+	memset(&r, 0, sizeof(r));
+	for (v = argv; *v; ++v, ++r.argc)
+		failed |= add_string(&t, *v);
+	for (v = environ; *v; ++v, ++r.envc)
+		failed |= add_string(&t, *v);
+	if (failed || t.len > HOST_MAX_REQUEST)
+	{
+		printf("%s: The command is too large.\n", progname);
+		free(t.buf);
+		return 1;
+	}
+
+	r.magic = HOST_MAGIC;
+	r.waitattach = waitattach;
+	r.redraw_method = redraw_method == REDRAW_UNSPEC ? REDRAW_CTRL_L :
+		redraw_method;
+	r.queue_policy = queue_policy;
+	r.zero_copy = zero_copy;
+	r.dont_have_tty = dont_have_tty;
+	r.client_budget = client_budget;
+	r.session_budget = session_budget;
+	r.replay_size = replay_size;
+	r.latency_budget = latency_budget;
+	r.read_burst = read_burst;
+	r.size_policy = size_policy;
+	r.resize_delay = resize_delay;
+	r.log_rotate_size = log_rotate_size;
+	mask = umask(0);
+	umask(mask);
+	r.umask = mask;
+	r.term = orig_term;
+	r.len = t.len;
+
+	s = connect_socket(host_sockname);
+	if (s < 0)
+	{
+		printf("%s: %s: %s\n", progname, host_sockname,
+		       strerror(errno));
+		free(t.buf);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	write_buf_or_fail(s, &r, sizeof(r));
+	write_buf_or_fail(s, t.buf, t.len);
+	free(t.buf);
+
+	/* Anything that comes back is an error, and the connection is closed
+	** once the program is running. */
+	len = read(s, buf, sizeof(buf));
+	if (len > 0)
+	{
+		do
+		{
+			write_buf_or_fail(2, buf, len);
+			len = read(s, buf, sizeof(buf));
+		} while (len > 0);
+		close(s);
+		return 1;
+	}
+	close(s);
+	return 0;
+}
+#else
+int
+host_main(ATTRIBUTE_UNUSED int nwarm)
+{
+	printf("%s: Host daemons are not supported on this system.\n",
+	       progname);
+	return 1;
+}
+
+int
+host_create(ATTRIBUTE_UNUSED char **argv, ATTRIBUTE_UNUSED int waitattach)
+{
+	printf("%s: Host daemons are not supported on this system.\n",
+	       progname);
+	return 1;
+}
+#endif
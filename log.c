@@ -0,0 +1,415 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** Session logging. The master copies what it wants logged into a ring per
+** log, and a writer thread takes it from there to the disk. The master and
+** the writer only ever touch their own end of a ring, so no locks are
+** needed, and a slow disk can never hold up the master: when a ring is
+** full, the master throws the new data away and counts it as dropped.
+**
+** The writer waits until it has a batch worth writing, and writes in
+** multiples of LOG_ALIGN where it can, so that the file is written in
+** whole blocks. Whatever is left is written when things go quiet for
+** LOG_FLUSH milliseconds, and when the master exits.
+*/
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#define USE_LOG
+#include <pthread.h>
+#include <poll.h>
+
+/* The size of the ring of each log. */
+#define LOG_RING	(4 * 1024 * 1024)
+/* How much the writer waits for before writing. */
+#define LOG_BATCH	(64 * 1024)
+/* The block size writes are aligned to. */
+#define LOG_ALIGN	4096
+/* How long the writer leaves a partial batch sitting around. */
+#define LOG_FLUSH	200
+
+struct log
+{
+	/* The file, its name, its size and the size it is rotated at. */
+	int fd;
+	char *path;
+	off_t size;
+	size_t rotate;
+	/* The ring. */
+	unsigned char *ring;
+	/* The number of bytes ever put into and taken out of the ring. The
+	** master owns tail and the writer owns head. */
+	unsigned long tail;
+	unsigned long head;
+	/* Bytes thrown away by the master because the ring was full, and by
+	** the writer because they could not be written. */
+	unsigned long long dropped;
+	unsigned long long lost;
+};
+
+/* The logs of a session and their writer. In a host daemon every session
+** has its own, and the writer only ever sees the one it was started for. */
+struct logger
+{
+	struct log logs[LOG_STREAMS];
+	pthread_t writer;
+	int writer_running;
+	/* Wakes up the writer early. */
+	int wake_pipe[2];
+	/* Set when the writer should write out everything and stop. */
+	int closing;
+};
+
+static SESSION_LOCAL struct logger *logger;
+
+/* Start over with a new file once the log is over its size. The previous
+** file is kept with .1 added to its name. */
+static void
+log_rotate(struct log *l)
+{
+	size_t len = strlen(l->path);
+	char *old = malloc(len + 3);
+
+	if (!old)
+		return;
+	memcpy(old, l->path, len);
+	memcpy(old + len, ".1", 3);
+	if (rename(l->path, old) == 0)
+	{
+		int fd = open(l->path, O_WRONLY|O_CREAT|O_APPEND|O_TRUNC,
+			      0600);
+
+		if (fd >= 0)
+		{
+			close(l->fd);
+			l->fd = fd;
+			l->size = 0;
+		}
+	}
+	free(old);
+}
+
+/* Write n bytes from the ring of a log to its file. Whatever can't be
+** written is counted as lost. */
+static void
+log_flush(struct log *l, unsigned long n)
+{
+	if (l->rotate > 0 && l->size > 0 &&
+	    l->size + (off_t)n > (off_t)l->rotate)
+		log_rotate(l);
+
+	while (n > 0)
+	{
+		struct iovec iov[2];
+		size_t off = l->head % LOG_RING;
+		int cnt = 1;
+		ssize_t ret;
+
+		iov[0].iov_base = l->ring + off;
+		iov[0].iov_len = n < LOG_RING - off ? n : LOG_RING - off;
+		if (n > iov[0].iov_len)
+		{
+			iov[1].iov_base = l->ring;
+			iov[1].iov_len = n - iov[0].iov_len;
+			cnt = 2;
+		}
+		ret = writev(l->fd, iov, cnt);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			__atomic_add_fetch(&l->lost, n, __ATOMIC_RELAXED);
+			ret = n;
+		}
+		else
+			l->size += ret;
+		n -= ret;
+		__atomic_store_n(&l->head, l->head + ret, __ATOMIC_RELEASE);
+	}
+}
+
+/* Returns non-zero if a log has a batch waiting. */
+static int
+log_ready(struct log *l)
+{
+	return l->ring &&
+		__atomic_load_n(&l->tail, __ATOMIC_ACQUIRE) - l->head >=
+		LOG_BATCH;
+}
+
+/* Write out what is waiting in a log. A partial batch is only written if
+** all is true. */
+static void
+log_drain(struct log *l, int all)
+{
+	unsigned long n;
+
+	n = __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE) - l->head;
+	if (n == 0)
+		return;
+	if (!all)
+	{
+		/* Write whole blocks, ending on a block boundary of the
+		** file. */
+		unsigned long skew = l->size % LOG_ALIGN;
+
+		if (n < LOG_BATCH)
+			return;
+		n = (n + skew) / LOG_ALIGN * LOG_ALIGN - skew;
+	}
+	log_flush(l, n);
+}
+
+/* The writer thread. */
+static void *
+log_writer(void *arg)
+{
+	struct logger *lg = arg;
+	struct log *logs = lg->logs;
+	struct pollfd pfd;
+	int i, done = 0;
+
+	pfd.fd = lg->wake_pipe[0];
+	pfd.events = POLLIN;
+	while (!done)
+	{
+		char buf[64];
+		int timeout, ready = 0;
+
+		done = __atomic_load_n(&lg->closing, __ATOMIC_ACQUIRE);
+		for (i = 0; i < LOG_STREAMS; ++i)
+		{
+			if (logs[i].ring)
+				log_drain(&logs[i], done);
+		}
+		if (done)
+			break;
+
+		/* More may have come in while we were writing. */
+		for (i = 0; i < LOG_STREAMS; ++i)
+			ready |= log_ready(&logs[i]);
+		if (ready)
+			continue;
+
+		/* Go to sleep until the master says a batch is ready, and
+		** write what there is if it never does. */
+		timeout = poll(&pfd, 1, LOG_FLUSH);
+		if (timeout > 0)
+		{
+			while (read(lg->wake_pipe[0], buf, sizeof(buf)) > 0)
+				;
+		}
+		else if (timeout == 0)
+		{
+			for (i = 0; i < LOG_STREAMS; ++i)
+			{
+				if (logs[i].ring)
+					log_drain(&logs[i], 1);
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Write out what is left in the logs and close them, before the session
+** ends. */
+void
+log_close(void)
+{
+	struct logger *lg = logger;
+	char c = 0;
+	int i;
+
+	if (!lg)
+		return;
+	if (lg->writer_running)
+	{
+		__atomic_store_n(&lg->closing, 1, __ATOMIC_RELEASE);
+		write(lg->wake_pipe[1], &c, 1);
+		pthread_join(lg->writer, NULL);
+		close(lg->wake_pipe[0]);
+		close(lg->wake_pipe[1]);
+	}
+	for (i = 0; i < LOG_STREAMS; ++i)
+	{
+		if (lg->logs[i].ring)
+		{
+			close(lg->logs[i].fd);
+			free(lg->logs[i].path);
+			free(lg->logs[i].ring);
+		}
+	}
+	free(lg);
+	logger = NULL;
+}
+
+/* Returns the logs of the session, setting them up the first time. */
+static struct logger *
+log_get(void)
+{
+	if (!logger)
+		logger = calloc(1, sizeof(struct logger));
+	return logger;
+}
+
+/* Open one of the logs, which is rotated once it would grow past rotate
+** bytes (0 for never). Returns -1 with errno set on failure. */
+int
+log_open(int stream, const char *path, size_t rotate)
+{
+	struct logger *lg = log_get();
+	struct log *l;
+	struct stat st;
+
+	if (!lg)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	l = &lg->logs[stream];
+	l->fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+	if (l->fd < 0)
+		return -1;
+	if (fstat(l->fd, &st) == 0)
+		l->size = st.st_size;
+	l->path = strdup(path);
+	l->ring = malloc(LOG_RING);
+	if (!l->path || !l->ring)
+	{
+		free(l->path);
+		free(l->ring);
+		l->ring = NULL;
+		close(l->fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	l->rotate = rotate;
+	return 0;
+}
+
+/* Start the writer thread, once the logs have been opened. */
+int
+log_start(void)
+{
+	struct logger *lg = logger;
+	sigset_t all, old;
+	int ret;
+
+	if (pipe(lg->wake_pipe) < 0)
+		return -1;
+	fcntl(lg->wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(lg->wake_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(lg->wake_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(lg->wake_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	/* Signals are for the master, not the writer. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&lg->writer, NULL, log_writer, lg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		close(lg->wake_pipe[0]);
+		close(lg->wake_pipe[1]);
+		errno = ret;
+		return -1;
+	}
+	lg->writer_running = 1;
+	return 0;
+}
+
+/* Add data to a log, or count it as dropped if there is no room for it. */
+void
+log_write(int stream, const void *buf, size_t len)
+{
+	struct log *l;
+	unsigned long head, used;
+	size_t off, first;
+
+	if (!logger || len == 0)
+		return;
+	l = &logger->logs[stream];
+	if (!l->ring)
+		return;
+	head = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+	used = l->tail - head;
+	if (len > LOG_RING - used)
+	{
+		l->dropped += len;
+		return;
+	}
+
+	off = l->tail % LOG_RING;
+	first = len < LOG_RING - off ? len : LOG_RING - off;
+	memcpy(l->ring + off, buf, first);
+	memcpy(l->ring, (const unsigned char *)buf + first, len - first);
+	__atomic_store_n(&l->tail, l->tail + len, __ATOMIC_RELEASE);
+
+	/* Wake up the writer when a batch has filled up. */
+	if (used < LOG_BATCH && used + len >= LOG_BATCH)
+	{
+		char c = 0;
+
+		write(logger->wake_pipe[1], &c, 1);
+	}
+}
+
+/* Returns the number of bytes that did not make it into a log. */
+unsigned long long
+log_dropped(int stream)
+{
+	struct log *l;
+
+	if (!logger)
+		return 0;
+	l = &logger->logs[stream];
+	return l->dropped + __atomic_load_n(&l->lost, __ATOMIC_RELAXED);
+}
+#else
+int
+log_open(ATTRIBUTE_UNUSED int stream, ATTRIBUTE_UNUSED const char *path,
+	 ATTRIBUTE_UNUSED size_t rotate)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+log_start(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+log_write(ATTRIBUTE_UNUSED int stream, ATTRIBUTE_UNUSED const void *buf,
+	  ATTRIBUTE_UNUSED size_t len)
+{
+}
+
+unsigned long long
+log_dropped(ATTRIBUTE_UNUSED int stream)
+{
+	return 0;
+}
+
+void
+log_close(void)
+{
+}
+#endif
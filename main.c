@@ -29,21 +29,50 @@ const char copyright[] = "dtach - version " PACKAGE_VERSION "(C)Copyright 2004-2
 /* argv[0] from the program */
 char *progname;
 /* The name of the passed in socket. */
-char *sockname;
+SESSION_LOCAL char *sockname;
+/* The socket of the host daemon to create sessions in, if any. */
+char *host_sockname;
 /* The character used for detaching. Defaults to '^\' */
 int detach_char = '\\' - 64;
 /* 1 if we should not interpret the suspend character. */
 int no_suspend;
+/* 1 if output should be read from the master's ring rather than the
+** socket. */
+int use_ring;
 /* The default redraw method. Initially set to unspecified. */
-int redraw_method = REDRAW_UNSPEC;
+SESSION_LOCAL int redraw_method = REDRAW_UNSPEC;
+/* How the master picks the size of the pty, and how long, in microseconds,
+** it lets resizes settle before applying them. */
+SESSION_LOCAL int size_policy = SIZE_LATEST;
+SESSION_LOCAL unsigned long resize_delay = 30000;
+/* What the master does with clients that can't keep up. */
+SESSION_LOCAL int queue_policy = QUEUE_BLOCK;
+/* The most output the master queues for a single client, and for all of the
+** clients of a session together. */
+SESSION_LOCAL size_t client_budget = 1024 * 1024;
+SESSION_LOCAL size_t session_budget = 8 * 1024 * 1024;
+/* The amount of recent output the master replays to attaching clients. */
+SESSION_LOCAL size_t replay_size;
+/* The most output the master reads from the program before handing it to
+** the clients. */
+SESSION_LOCAL size_t read_burst = 256 * 1024;
+/* 1 if the master should pass output to clients without copying it. */
+SESSION_LOCAL int zero_copy;
+/* How long, in microseconds, the master may hold output back to hand it out
+** in larger pieces. */
+SESSION_LOCAL unsigned long latency_budget;
+/* The files the master logs output and input to, and the size at which they
+** are rotated. */
+SESSION_LOCAL char *log_path[LOG_STREAMS];
+SESSION_LOCAL size_t log_rotate_size;
 
 /*
 ** The original terminal settings. Shared between the master and attach
 ** processes. The master uses it to initialize the pty, and the attacher uses
 ** it to restore the original settings.
 */
-struct termios orig_term;
-int dont_have_tty;
+SESSION_LOCAL struct termios orig_term;
+SESSION_LOCAL int dont_have_tty;
 
 /* Write buf to fd handling partial writes. Exit on failure. */
 void
@@ -68,6 +97,24 @@ write_buf_or_fail(int fd, const void *buf, size_t count)
 	}
 }
 
+/* Read exactly count bytes from fd. Returns -1 on failure or end of file. */
+int
+read_all(int fd, void *buf, size_t count)
+{
+	while (count > 0)
+	{
+		ssize_t n = read(fd, buf, count);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		count -= n;
+	}
+	return 0;
+}
+
 /* Write pkt to fd. Exit on failure. */
 void
 write_packet_or_fail(int fd, const struct packet *pkt)
@@ -88,6 +135,213 @@ write_packet_or_fail(int fd, const struct packet *pkt)
 	}
 }
 
+/* Sets a file descriptor to non-blocking mode. */
+int
+setnonblocking(int fd)
+{
+	int flags;
+
+#if defined(O_NONBLOCK)
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	return 0;
+#elif defined(FIONBIO)
+	flags = 1;
+	if (ioctl(fd, FIONBIO, &flags) < 0)
+		return -1;
+	return 0;
+#else
+#warning Do not know how to set non-blocking mode.
+	return 0;
+#endif
+}
+
+/* Bind s to addr if create is set, or connect it. */
+static int
+bind_or_connect(int s, struct sockaddr_un *addr, socklen_t len, int create)
+{
+	if (create)
+		return bind(s, (struct sockaddr *)addr, len);
+	return connect(s, (struct sockaddr *)addr, len);
+}
+
+/*
+** Bind s to the socket called name if create is set, giving it mode 0600, or
+** connect s to it. A name starting with @ is in the abstract namespace where
+** there is one. A path too long for a socket address is reached through a
+** descriptor of its directory, so that the working directory, which other
+** threads share, is only changed where there is no other way.
+*/
+int
+socket_at(int s, const char *name, int create)
+{
+	struct sockaddr_un sockun;
+	size_t len = strlen(name);
+	const char *file;
+	char *dir;
+	int dirfd, ret, saved;
+
+	memset(&sockun, 0, sizeof(sockun));
+	sockun.sun_family = AF_UNIX;
+#ifdef USE_ABSTRACT
+	if (SOCKET_ABSTRACT(name))
+	{
+		/* The @ stands for the leading nul, and there is no
+		** terminator. */
+		if (len > sizeof(sockun.sun_path))
+		{
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(sockun.sun_path + 1, name + 1, len - 1);
+		return bind_or_connect(s, &sockun,
+			offsetof(struct sockaddr_un, sun_path) + len, create);
+	}
+#endif
+	if (len < sizeof(sockun.sun_path))
+	{
+		strcpy(sockun.sun_path, name);
+		ret = bind_or_connect(s, &sockun, sizeof(sockun), create);
+		if (ret == 0 && create)
+			ret = chmod(name, 0600);
+		return ret;
+	}
+
+	file = strrchr(name, '/');
+	if (!file || strlen(file + 1) >= sizeof(sockun.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	dir = strdup(name);
+	if (!dir)
+		return -1;
+	dir[file == name ? 1 : file - name] = '\0';
+	++file;
+	dirfd = open(dir, O_RDONLY);
+	free(dir);
+	if (dirfd < 0)
+		return -1;
+
+#if defined(HAVE_BINDAT) && defined(HAVE_CONNECTAT)
+	strcpy(sockun.sun_path, file);
+	if (create)
+		ret = bindat(dirfd, s, (struct sockaddr *)&sockun,
+			     sizeof(sockun));
+	else
+		ret = connectat(dirfd, s, (struct sockaddr *)&sockun,
+				sizeof(sockun));
+#else
+	/* Linux lets the directory be named through /proc. Anywhere else,
+	** step into it for a moment. */
+	ret = snprintf(sockun.sun_path, sizeof(sockun.sun_path),
+		       "/proc/self/fd/%d/%s", dirfd, file);
+	if (ret > 0 && (size_t)ret < sizeof(sockun.sun_path) &&
+	    access("/proc/self/fd", X_OK) == 0)
+		ret = bind_or_connect(s, &sockun, sizeof(sockun), create);
+	else
+	{
+		int cwdfd = open(".", O_RDONLY);
+
+		ret = -1;
+		if (cwdfd >= 0 && fchdir(dirfd) == 0)
+		{
+			strcpy(sockun.sun_path, file);
+			ret = bind_or_connect(s, &sockun, sizeof(sockun),
+					      create);
+			if (fchdir(cwdfd) < 0)
+				ret = -1;
+		}
+		if (cwdfd >= 0)
+			close(cwdfd);
+	}
+#endif
+	if (ret == 0 && create)
+		ret = fchmodat(dirfd, file, 0600, 0);
+	saved = errno;
+	close(dirfd);
+	errno = saved;
+	return ret;
+}
+
+/* Whether the peer on fd may use a socket in the abstract namespace, which
+** is left to the same user, or root. */
+int
+peer_allowed(int fd)
+{
+#ifdef USE_ABSTRACT
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return 0;
+	return cred.uid == geteuid() || cred.uid == 0;
+#else
+	return 1;
+#endif
+}
+
+/* Parse a size such as 65536, 64k or 1m. Returns -1 if it is invalid. */
+static int
+parse_size(const char *str, size_t *size)
+{
+	unsigned long val;
+	char *end;
+
+	if (*str < '0' || *str > '9')
+		return -1;
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (errno)
+		return -1;
+	if (*end == 'k' || *end == 'K')
+	{
+		val *= 1024;
+		end++;
+	}
+	else if (*end == 'm' || *end == 'M')
+	{
+		val *= 1024 * 1024;
+		end++;
+	}
+	else if (*end == 'g' || *end == 'G')
+	{
+		val *= 1024 * 1024 * 1024;
+		end++;
+	}
+	if (*end)
+		return -1;
+	*size = val;
+	return 0;
+}
+
+/* Parse a time such as 2ms, 500us or 1s, in milliseconds if no unit is
+** given, into microseconds. Returns -1 if it is invalid. */
+static int
+parse_time(const char *str, unsigned long *usec)
+{
+	unsigned long val;
+	char *end;
+
+	if (*str < '0' || *str > '9')
+		return -1;
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (errno)
+		return -1;
+	if (strcmp(end, "us") == 0)
+		;
+	else if (*end == '\0' || strcmp(end, "ms") == 0)
+		val *= 1000;
+	else if (strcmp(end, "s") == 0)
+		val *= 1000000;
+	else
+		return -1;
+	*usec = val;
+	return 0;
+}
+
 static void
 usage()
 {
@@ -99,6 +353,13 @@ usage()
 	       "       dtach -n <socket> <options> <command...>\n"
 	       "       dtach -N <socket> <options> <command...>\n"
 	       "       dtach -p <socket>\n"
+	       "       dtach -S <socket>\n"
+	       "       dtach -s <socket>\n"
+	       "       dtach -l\n"
+	       "       dtach -w <socket> [-t <time>] <pattern>\n"
+	       "       dtach -x <socket> [-t <time>] [-g <time>] [<pattern>]\n"
+	       "       dtach -D <socket> [-k <count>]\n"
+	       "       dtach -T <socket> <options> <address>\n"
 	       "Modes:\n"
 	       "  -a\t\tAttach to the specified socket.\n"
 	       "  -A\t\tAttach to the specified socket, or create it if it\n"
@@ -111,24 +372,101 @@ usage()
 	       "\t\t  and have dtach run in the foreground.\n"
 	       "  -p\t\tCopy the contents of standard input to the specified\n"
 	       "\t\t  socket.\n"
+	       "  -S\t\tPrint the stats of the session at the specified "
+	       "socket.\n"
+	       "  -s\t\tExit with status 0 if a client is attached to the "
+	       "specified\n"
+	       "\t\t  socket, and 1 if not.\n"
+	       "  -l\t\tList the sessions of the user.\n"
+	       "  -w\t\tWait until <pattern> shows up in the output of the "
+	       "session\n"
+	       "\t\t  at the specified socket, or for up to <time> with "
+	       "-t.\n"
+	       "\t\t  Exits with status 0 if it did, and 1 if the time ran "
+	       "out.\n"
+	       "  -x\t\tSend standard input to the specified socket, and "
+	       "copy the\n"
+	       "\t\t  output to standard output until <pattern> shows up,\n"
+	       "\t\t  or the output is quiet for the time given with -g.\n"
+	       "  -D\t\tStart a host daemon at the specified socket, to "
+	       "run\n"
+	       "\t\t  sessions created with -H. With -k, keep <count>\n"
+	       "\t\t  sessions ready ahead of time, so that they start\n"
+	       "\t\t  faster.\n"
+	       "  -T\t\tRelay clients from the TCP address [<host>:]<port> "
+	       "to\n"
+	       "\t\t  the specified socket. Clients attach to a relay "
+	       "with\n"
+	       "\t\t  tcp:<host>:<port> as the socket.\n"
 	       "Options:\n"
+	       "  -b <size>\tRead up to <size> bytes of output at a time "
+	       "before\n"
+	       "\t\t  handing it to the clients (up to 1m).\n"
 	       "  -e <char>\tSet the detach character to <char>, defaults "
 	       "to ^\\.\n"
 	       "  -E\t\tDisable the detach character.\n"
+	       "  -H <socket>\tCreate the session in the host daemon at "
+	       "<socket>.\n"
+	       "  -i <file>\tLog input pushed to the program to <file>.\n"
+	       "  -L <time>\tHold output back for up to <time> (such as 2ms) "
+	       "when\n"
+	       "\t\t  there is a lot of it, to send it in larger pieces.\n"
+	       "\t\t  For a relay, how long output is collected before\n"
+	       "\t\t  it is sent.\n"
+	       "  -m <size>[:<size>]\n"
+	       "\t\tSet how much output may be queued for one client, and\n"
+	       "\t\t  for all clients of the session together.\n"
+	       "  -M\t\tRead output from shared memory instead of the "
+	       "socket,\n"
+	       "\t\t  when attaching to a local session.\n"
+	       "  -o <file>\tLog output of the program to <file>.\n"
+	       "  -O <size>\tStart a new log once it would grow past <size>.\n"
+	       "  -q <policy>\tSet what to do with clients that can't keep up. "
+	       "The\n"
+	       "\t\t  valid policies are:\n"
+	       "\t\t    block: Stop the program until the client catches up.\n"
+	       "\t\t     drop: Throw away the oldest output of the client.\n"
+	       "\t\t    evict: Disconnect the client.\n"
+	       "  -R <size>\tKeep the last <size> bytes of output, and send "
+	       "them to\n"
+	       "\t\t  clients when they attach.\n"
 	       "  -r <method>\tSet the redraw method to <method>. The "
 	       "valid methods are:\n"
 	       "\t\t     none: Don't redraw at all.\n"
 	       "\t\t   ctrl_l: Send a Ctrl L character to the program.\n"
 	       "\t\t    winch: Send a WINCH signal to the program.\n"
+	       "\t\t snapshot: Repaint the screen from the master's copy "
+	       "of it.\n"
+	       "  -W <policy>[:<time>]\n"
+	       "\t\tSet how the window size is picked when several "
+	       "clients\n"
+	       "\t\t  are attached, and how long to let resizes settle\n"
+	       "\t\t  (30ms by default). The valid policies are:\n"
+	       "\t\t    latest: The last client to resize wins.\n"
+	       "\t\t  smallest: The smallest size that fits every client.\n"
+	       "\t\t   largest: The largest size of any client.\n"
+	       "\t\t     owner: The client that attached first.\n"
 	       "  -z\t\tDisable processing of the suspend key.\n"
+	       "  -Z\t\tPass output to clients without copying it, where "
+	       "possible.\n"
 	       "\nReport any bugs to <" PACKAGE_BUGREPORT ">.\n",
 		PACKAGE_VERSION, __DATE__, __TIME__);
 	exit(0);
 }
 
+/* Create a session, in a master of its own or in a host daemon. */
+static int
+create_session(char **argv, int waitattach)
+{
+	if (host_sockname)
+		return host_create(argv, waitattach);
+	return master_main(argv, waitattach, 0);
+}
+
 int
 main(int argc, char **argv)
 {
+	long nwarm = 0;
 	int mode = 0;
 
 	/* Save the program name */
@@ -151,7 +489,10 @@ main(int argc, char **argv)
 		if (mode == '?')
 			usage();
 		else if (mode != 'a' && mode != 'c' && mode != 'n' &&
-			 mode != 'A' && mode != 'N' && mode != 'p')
+			 mode != 'A' && mode != 'N' && mode != 'p' &&
+			 mode != 'S' && mode != 's' && mode != 'D' &&
+			 mode != 'T' && mode != 'l' && mode != 'w' &&
+			 mode != 'x')
 		{
 			printf("%s: Invalid mode '-%c'\n", progname, mode);
 			printf("Try '%s --help' for more information.\n",
@@ -168,6 +509,20 @@ main(int argc, char **argv)
 	}
 	++argv; --argc;
 
+	/* Listing the sessions is the only mode without a socket. */
+	if (mode == 'l')
+	{
+		if (argc > 0)
+		{
+			printf("%s: Invalid number of arguments.\n",
+			       progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		return list_main();
+	}
+
 	if (argc < 1)
 	{
 		printf("%s: No socket was specified.\n", progname);
@@ -178,7 +533,69 @@ main(int argc, char **argv)
 	sockname = *argv;
 	++argv; --argc;
 
-	if (mode == 'p')
+	/* A host daemon may keep sessions warm. */
+	if (mode == 'D' && argc > 0 && strcmp(argv[0], "-k") == 0)
+	{
+		char *end;
+
+		if (argc < 2)
+		{
+			printf("%s: No number of warm sessions specified.\n",
+			       progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		nwarm = strtol(argv[1], &end, 10);
+		if (end == argv[1] || *end || nwarm < 0 || nwarm > 1024)
+		{
+			printf("%s: Invalid number of warm sessions "
+			       "specified.\n", progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		argv += 2; argc -= 2;
+	}
+
+	/* Waiting takes an optional timeout and the pattern. Sending input
+	** and waiting may also stop once the output goes quiet, in which case
+	** the pattern may be left out. */
+	if (mode == 'w' || mode == 'x')
+	{
+		unsigned long timeout = 0, quiet = 0;
+
+		while (argc > 0 && (strcmp(argv[0], "-t") == 0 ||
+				    (mode == 'x' && strcmp(argv[0], "-g") == 0)))
+		{
+			int t = (argv[0][1] == 't');
+
+			if (argc < 2 ||
+			    parse_time(argv[1], t ? &timeout : &quiet) < 0)
+			{
+				printf("%s: Invalid %s specified.\n", progname,
+				       t ? "timeout" : "quiet time");
+				printf("Try '%s --help' for more "
+				       "information.\n", progname);
+				return 1;
+			}
+			argv += 2; argc -= 2;
+		}
+		if (mode == 'x' && argc == 0 && quiet > 0)
+			return expect_main("", timeout, quiet);
+		if (argc != 1 || !argv[0][0] || strlen(argv[0]) > MATCH_MAX)
+		{
+			printf("%s: Invalid pattern specified.\n", progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		if (mode == 'x')
+			return expect_main(argv[0], timeout, quiet);
+		return wait_main(argv[0], timeout);
+	}
+
+	if (mode == 'p' || mode == 'S' || mode == 's' || mode == 'D')
 	{
 		if (argc > 0)
 		{
@@ -188,6 +605,12 @@ main(int argc, char **argv)
 			       progname);
 			return 1;
 		}
+		if (mode == 'S')
+			return stats_main();
+		if (mode == 's')
+			return status_main();
+		if (mode == 'D')
+			return host_main(nwarm);
 		return push_main();
 	}
 
@@ -207,6 +630,10 @@ main(int argc, char **argv)
 				detach_char = -1;
 			else if (*p == 'z')
 				no_suspend = 1;
+			else if (*p == 'M')
+				use_ring = 1;
+			else if (*p == 'Z')
+				zero_copy = 1;
 			else if (*p == 'e')
 			{
 				++argv; --argc;
@@ -246,6 +673,8 @@ main(int argc, char **argv)
 					redraw_method = REDRAW_CTRL_L;
 				else if (strcmp(argv[0], "winch") == 0)
 					redraw_method = REDRAW_WINCH;
+				else if (strcmp(argv[0], "snapshot") == 0)
+					redraw_method = REDRAW_SNAPSHOT;
 				else
 				{
 					printf("%s: Invalid redraw method "
@@ -256,6 +685,214 @@ main(int argc, char **argv)
 				}
 				break;
 			}
+			else if (*p == 'o' || *p == 'i')
+			{
+				int stream = (*p == 'o') ? LOG_OUTPUT :
+					LOG_INPUT;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No log file specified.\n",
+					       progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				log_path[stream] = argv[0];
+				break;
+			}
+			else if (*p == 'O')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No log size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (parse_size(argv[0], &log_rotate_size) < 0)
+				{
+					printf("%s: Invalid log size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'L')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No latency budget "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (parse_time(argv[0], &latency_budget) < 0)
+				{
+					printf("%s: Invalid latency budget "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'R')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No replay size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (parse_size(argv[0], &replay_size) < 0)
+				{
+					printf("%s: Invalid replay size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'b')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No read size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (parse_size(argv[0], &read_burst) < 0 ||
+				    read_burst == 0)
+				{
+					printf("%s: Invalid read size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'H')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No host socket "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				host_sockname = argv[0];
+				break;
+			}
+			else if (*p == 'q')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No queue policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "block") == 0)
+					queue_policy = QUEUE_BLOCK;
+				else if (strcmp(argv[0], "drop") == 0)
+					queue_policy = QUEUE_DROP;
+				else if (strcmp(argv[0], "evict") == 0)
+					queue_policy = QUEUE_EVICT;
+				else
+				{
+					printf("%s: Invalid queue policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'W')
+			{
+				char *colon;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No size policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				colon = strchr(argv[0], ':');
+				if (colon)
+					*colon = '\0';
+				if (strcmp(argv[0], "latest") == 0)
+					size_policy = SIZE_LATEST;
+				else if (strcmp(argv[0], "smallest") == 0)
+					size_policy = SIZE_SMALLEST;
+				else if (strcmp(argv[0], "largest") == 0)
+					size_policy = SIZE_LARGEST;
+				else if (strcmp(argv[0], "owner") == 0)
+					size_policy = SIZE_OWNER;
+				else
+					size_policy = -1;
+				if (size_policy < 0 || (colon &&
+				    parse_time(colon + 1, &resize_delay) < 0))
+				{
+					printf("%s: Invalid size policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'm')
+			{
+				char *colon;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No queue size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				colon = strchr(argv[0], ':');
+				if (colon)
+					*colon = '\0';
+				if (parse_size(argv[0], &client_budget) < 0 ||
+				    (colon && parse_size(colon + 1,
+							 &session_budget) < 0))
+				{
+					printf("%s: Invalid queue size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
 			else
 			{
 				printf("%s: Invalid option '-%c'\n",
@@ -268,6 +905,34 @@ main(int argc, char **argv)
 		++argv; --argc;
 	}
 
+	if (mode == 'T')
+	{
+		if (argc < 1)
+		{
+			printf("%s: No address was specified.\n", progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		else if (argc > 1)
+		{
+			printf("%s: Invalid number of arguments.\n",
+			       progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		return relay_main(argv[0]);
+	}
+	else if (mode != 'a' && relay_address(sockname))
+	{
+		printf("%s: Sessions can't be created at a relay address.\n",
+		       progname);
+		printf("Try '%s --help' for more information.\n",
+		       progname);
+		return 1;
+	}
+
 	if (mode != 'a' && argc < 1)
 	{
 		printf("%s: No command was specified.\n", progname);
@@ -302,13 +967,20 @@ main(int argc, char **argv)
 		}
 		return attach_main(0);
 	}
+	else if (mode == 'N' && host_sockname)
+	{
+		printf("%s: A session in a host daemon can't be run in the "
+		       "foreground.\n", progname);
+		printf("Try '%s --help' for more information.\n", progname);
+		return 1;
+	}
 	else if (mode == 'n')
-		return master_main(argv, 0, 0);
+		return create_session(argv, 0);
 	else if (mode == 'N')
 		return master_main(argv, 0, 1);
 	else if (mode == 'c')
 	{
-		if (master_main(argv, 1, 0) != 0)
+		if (create_session(argv, 1) != 0)
 			return 1;
 		return attach_main(0);
 	}
@@ -320,9 +992,10 @@ main(int argc, char **argv)
 		{
 			if (errno == ECONNREFUSED || errno == ENOENT)
 			{
-				if (errno == ECONNREFUSED)
+				if (errno == ECONNREFUSED &&
+				    !SOCKET_ABSTRACT(sockname))
 					unlink(sockname);
-				if (master_main(argv, 1, 0) != 0)
+				if (create_session(argv, 1) != 0)
 					return 1;
 			}
 			return attach_main(0);
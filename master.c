@@ -16,12 +16,28 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "dtach.h"
+#include <poll.h>
+#include <stdarg.h>
+#ifdef USE_HOST
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+/* Output can be passed from the pty to the clients without copying it into
+** the master where splice and tee are available. */
+#if defined(HAVE_SPLICE) && defined(HAVE_TEE) && defined(SPLICE_F_NONBLOCK)
+#define USE_SPLICE
+#endif
 
 /* The pty struct - The pty information is stored here. */
 struct pty
 {
 	/* File descriptor of the pty */
 	int fd;
+	/* The event loop's view of fd. */
+	struct watch w;
 #ifdef BROKEN_MASTER
 	/* File descriptor of the slave side of the pty. For broken systems. */
 	int slave;
@@ -35,6 +51,57 @@ struct pty
 	struct winsize ws;
 };
 
+/* The most spare chunks we hang on to. */
+#define MAX_SPARE_CHUNKS 16
+/* The most chunks of output read in one burst, and so the most that can be
+** asked for with -b. */
+#define MAX_BATCH 256
+/* The most chunks passed to a single writev. */
+#define MAX_IOV 64
+/* The size we ask for when creating a client's pipe. */
+#define PIPE_SIZE (256 * 1024)
+/* The most input written to the pty for one client before the next client
+** waiting to write gets its turn. */
+#define INPUT_SLICE 512
+/* How long the output queued for the clients is given to be written out
+** once the program is gone, in microseconds. */
+#define DRAIN_TIME 5000000
+
+/* A chunk of output read from the pty. Chunks are shared by the output
+** queues of all the clients that were attached when it was read, and are
+** released once the last of them has written it out. */
+struct chunk
+{
+	/* The number of output queues holding this chunk. */
+	int refs;
+	/* The number of bytes in the chunk. */
+	size_t len;
+	/* The next chunk in the list of spare chunks. */
+	struct chunk *next;
+	/* The output itself. */
+	unsigned char data[BUFSIZE];
+};
+
+struct client;
+
+/* A write of queued output that was handed to the kernel. It holds on to the
+** chunks it is writing from, and may outlive its client. */
+struct wop
+{
+	/* The request given to the event loop. Must be first. */
+	struct ev_req req;
+	/* The client, or NULL if it went away. */
+	struct client *p;
+	/* Whether the client's queue was thrown away in the meantime. */
+	int stale;
+	/* The number of bytes being written. */
+	size_t len;
+	/* The chunks being written, and the pieces of them. */
+	int nchunks;
+	struct chunk *chunks[MAX_IOV];
+	struct iovec iov[MAX_IOV];
+};
+
 /* A connected client */
 struct client
 {
@@ -44,25 +111,244 @@ struct client
 	struct client **pprev;
 	/* File descriptor of the client. */
 	int fd;
-	/* Whether or not the client is attached. */
+	/* The event loop's view of fd. */
+	struct watch w;
+	/* Whether or not the client is attached, and when it attached, as a
+	** count of attaches, for the owner size policy. */
 	int attached;
+	unsigned long attach_seq;
+	/* The window size the client asked for, if it did. */
+	struct winsize ws;
+	int has_ws;
+	/* The output queue, a ring of chunks waiting to be written. */
+	struct chunk **queue;
+	/* The size of the ring, the index of the oldest chunk and the number
+	** of chunks in it. */
+	int qsize, qhead, qlen;
+	/* The number of bytes of the oldest chunk already written. */
+	size_t qoff;
+	/* The number of bytes waiting to be written. */
+	size_t queued;
+	/* Whether or not the queue is over its budget. */
+	int over;
+	/* Whether or not the client sends framed messages. */
+	int framed;
+	/* Framed input that has been read but not processed yet. */
+	unsigned char *ibuf;
+	size_t ilen;
+	/* The part of the replay ring still to be sent, as positions in the
+	** output stream. It is sent before anything in the queue. */
+	unsigned long long rpos, rend;
+#ifdef USE_SPLICE
+	/* A pipe holding output that is passed along without copying, and the
+	** number of bytes in it. It is sent before anything in the queue. */
+	int pipe[2];
+	size_t piped;
+	/* How much of the latest output made it into the pipe. */
+	size_t teed;
+#endif
+	/* The write in progress in the background, if any. */
+	struct wop *wop;
+	/* Input for the program that the pty had no room for, and the links
+	** in the list of clients waiting to write to the pty. The client is
+	** not read from until its input is out. */
+	unsigned char *input;
+	size_t input_off, input_len;
+	struct client *input_next;
+	struct client **input_pprev;
+	/* The number of the connection, for telling clients apart in the
+	** stats. */
+	unsigned long id;
+	/* The client's reader number in the output ring plus one, and the
+	** eventfd it is woken up with, if it reads its output from there. */
+	int ring;
+	int ring_wake;
+	/* Set while the answer to the client asking for the ring waits for
+	** the output queued ahead of it. */
+	int ring_asked;
+	/* The pattern the client is waiting for, if any. */
+	struct pattern *wait;
+	/* Whether the client collects the output its input causes, and for
+	** how long, in microseconds, the output may go quiet before it is
+	** done (0 for no limit). */
+	int expect;
+	unsigned long quiet;
+	struct timer quiet_timer;
 };
 
 /* The list of connected clients. */
-static struct client *clients;
+static SESSION_LOCAL struct client *clients;
+/* The number of attached clients. */
+static SESSION_LOCAL int nattached;
+/* The mode of the socket file, once it is known. */
+static SESSION_LOCAL mode_t socket_mode;
+/* The event loop's view of the control socket. */
+static SESSION_LOCAL struct watch control_watch;
+/* Whether we are waiting for the first client to attach. */
+static SESSION_LOCAL int waiting_for_attach;
+/* Bytes of output held by chunks that are still queued somewhere. */
+static SESSION_LOCAL size_t session_queued;
+/* The number of attached clients whose queue is over its budget. */
+static SESSION_LOCAL int nover;
+/* The replay ring - the last replay_size bytes of output, which are sent to
+** clients when they attach. */
+static SESSION_LOCAL unsigned char *replay;
+/* The number of bytes of output ever added to the replay ring. */
+static SESSION_LOCAL unsigned long long replay_total;
+/* A model of the program's screen, for the snapshot redraw method. */
+static SESSION_LOCAL struct screen *the_screen;
+/* The patterns that clients are waiting for, and how many clients wait. */
+static SESSION_LOCAL struct matcher *the_matcher;
+static SESSION_LOCAL int nwaiting;
+/* The number of clients collecting output. */
+static SESSION_LOCAL int nexpecting;
+/* Spare chunks, so that we don't malloc for every read. */
+static SESSION_LOCAL struct chunk *spare_chunks;
+static SESSION_LOCAL int nspare_chunks;
+/* Output held back to be handed out in one go, the most chunks it may
+** take up, and the timer that limits how long it is held. See
+** pty_activity. */
+static SESSION_LOCAL struct chunk *batch[MAX_BATCH];
+static SESSION_LOCAL int nbatch, batch_max;
+static SESSION_LOCAL struct timer batch_timer;
+/* The timer that lets resizes settle before the pty is resized, the last
+** size any client asked for, and the number of attaches so far. */
+static SESSION_LOCAL struct timer resize_timer;
+static SESSION_LOCAL struct winsize latest_ws;
+static SESSION_LOCAL int has_latest_ws;
+static SESSION_LOCAL unsigned long nattaches;
+/* Set once the program is gone and the output queued for the clients is
+** being written out, and the timer that limits how long that may take. */
+static SESSION_LOCAL int pty_gone;
+static SESSION_LOCAL struct timer drain_timer;
+/* When output was last handed out to the clients. */
+static SESSION_LOCAL unsigned long long last_output;
+/* How much to ask the pty for on the next read, and whether the last read
+** filled all the room it was given. */
+static SESSION_LOCAL size_t read_hint = BUFSIZE;
+static SESSION_LOCAL int read_filled;
+#ifdef USE_SPLICE
+/* The pipe that output is spliced into from the pty when it is passed along
+** without copying, and /dev/null for throwing it away afterwards. Both are
+** -1 when output is copied as usual. */
+static SESSION_LOCAL int splice_pipe[2] = {-1, -1};
+static SESSION_LOCAL int splice_sink = -1;
+#endif
+
+/* The ring that output is put into for the clients that read it from
+** shared memory, once one of them has asked for it. */
+static SESSION_LOCAL struct ring *out_ring;
+
 /* The pseudo-terminal created for the child process. */
-static struct pty the_pty;
+static SESSION_LOCAL struct pty the_pty;
+/* The clients with input waiting for room in the pty, in the order they
+** get their turn, the amount of input waiting, and since when. */
+static SESSION_LOCAL struct client *input_head;
+static SESSION_LOCAL struct client **input_tail;
+static SESSION_LOCAL size_t input_queued;
+static SESSION_LOCAL unsigned long long input_since;
+
+/* What the master has been up to, for the stats request. Durations are in
+** microseconds. */
+static SESSION_LOCAL struct
+{
+	/* Bytes read from and written to the pty. */
+	unsigned long long pty_read, pty_written;
+	/* Time input spent waiting for room in the pty, the number of times
+	** input had to wait, and time the pty was not read from. */
+	unsigned long long pty_write_blocked, input_held, pty_paused;
+	/* When the pty was last paused, if it is. */
+	unsigned long long paused_since;
+	/* Bytes written to clients, and writes that came up short. */
+	unsigned long long client_written, partial_writes;
+	/* Output thrown away by the drop policy, and evicted clients. */
+	unsigned long long dropped, evicted;
+	/* Wakeups sent to clients reading from the ring. */
+	unsigned long long ring_wakeups;
+	/* Clients whose pattern turned up. */
+	unsigned long long wait_matches;
+	/* Sizes asked for by clients, and times the pty was resized. */
+	unsigned long long resize_requests, resizes;
+	/* The number of connections so far. */
+	unsigned long connections;
+	/* Sizes of pty reads, output read per wakeup, time spent handing
+	** output to the clients, and time spent in each pass of the event
+	** loop. */
+	struct histogram read_size, burst_size, fanout, loop;
+} stats;
+
+#ifdef USE_HOST
+/* Set when the session runs on a thread of a host daemon, along with what
+** its program is started with. */
+static SESSION_LOCAL int hosted;
+static SESSION_LOCAL const char *host_cwd;
+static SESSION_LOCAL char **host_env;
+static SESSION_LOCAL mode_t host_umask;
+/* Set when the session was made ready before it was asked for, along with
+** the slave side of its pty and the connection to the child waiting to run
+** its program. See master_warm. */
+static SESSION_LOCAL int warm;
+static SESSION_LOCAL int warm_slave = -1, warm_chan = -1;
+
+extern char **environ;
+#endif
+
+#ifndef HAVE_OPENPTY
+int openpty(int *amaster, int *aslave, char *name, struct termios *termp,
+	    struct winsize *winp);
+#endif
 
 #ifndef HAVE_FORKPTY
 pid_t forkpty(int *amaster, char *name, struct termios *termp,
 	      struct winsize *winp);
 #endif
 
+#ifdef USE_HOST
+static void session_free(void);
+#endif
+
 /* Unlink the socket */
 static void
 unlink_socket(void)
 {
-	unlink(sockname);
+	if (!SOCKET_ABSTRACT(sockname))
+		unlink(sockname);
+}
+
+/* End the session. A hosted session only takes its own thread down. */
+static void
+master_exit(int status)
+{
+#ifdef USE_HOST
+	if (hosted)
+	{
+		session_free();
+		host_session_end();
+		pthread_exit(NULL);
+	}
+#endif
+	exit(status);
+}
+
+/* Report an error in setting up the session to statusfd (or stdout), and
+** give up. */
+static void
+master_fail(int statusfd, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (len > 0 && write(statusfd != -1 ? statusfd : 1, buf, len) < 0)
+		len = 0;
+	if (statusfd != -1)
+		close(statusfd);
+	master_exit(1);
 }
 
 /* Signal */
@@ -81,26 +367,72 @@ die(int sig)
 	exit(1);
 }
 
-/* Sets a file descriptor to non-blocking mode. */
-static int
-setnonblocking(int fd)
+#ifdef USE_HOST
+/* Undo what the daemon set up for itself in the child of a hosted session:
+** its signal handling, and the descriptors that belong to other sessions.
+** Descriptors from 3 on are closed, except for keep. */
+static void
+host_child_reset(int keep)
 {
-	int flags;
+	static const int sigs[] = {SIGPIPE, SIGXFSZ, SIGHUP, SIGTTIN,
+				   SIGTTOU, SIGINT, SIGTERM, SIGCHLD};
+	sigset_t none;
+	unsigned i;
+	int fd, max;
+
+	for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); ++i)
+		signal(sigs[i], SIG_DFL);
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+#if defined(HAVE_SYS_SYSCALL_H) && defined(__NR_close_range)
+	if ((keep == 3 ||
+	     syscall(__NR_close_range, 3, keep - 1, 0) == 0) &&
+	    syscall(__NR_close_range, keep + 1, ~0U, 0) == 0)
+		return;
+#endif
+	max = sysconf(_SC_OPEN_MAX);
+	for (fd = 3; fd < max; ++fd)
+	{
+		if (fd != keep)
+			close(fd);
+	}
+}
 
-#if defined(O_NONBLOCK)
-	flags = fcntl(fd, F_GETFL);
-	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
-		return -1;
-	return 0;
-#elif defined(FIONBIO)
-	flags = 1;
-	if (ioctl(fd, FIONBIO, &flags) < 0)
-		return -1;
-	return 0;
-#else
-#warning Do not know how to set non-blocking mode.
-	return 0;
+/* Set up the child of a hosted session as if it had been started by
+** whoever asked for the session, rather than by the daemon. */
+static void
+host_child(int statusfd)
+{
+	umask(host_umask);
+	environ = host_env;
+	if (chdir(host_cwd) < 0)
+	{
+		dup2(statusfd, 1);
+		printf("%s: %s: %s\r\n", progname, host_cwd, strerror(errno));
+		fflush(stdout);
+		_exit(1);
+	}
+}
 #endif
+
+/* Execute the program in the child of the pty, reporting failure to
+** statusfd (or stdout). */
+static void
+pty_exec(char **argv, int statusfd)
+{
+	execvp(*argv, argv);
+
+	/* Report the error to statusfd if we can, or stdout if we can't. */
+	if (statusfd != -1)
+		dup2(statusfd, 1);
+	else
+		printf(EOS "\r\n");
+
+	printf("%s: could not execute %s: %s\r\n", progname,
+	       *argv, strerror(errno));
+	fflush(stdout);
+	_exit(1);
 }
 
 /* Initialize the pty structure. */
@@ -122,19 +454,14 @@ init_pty(char **argv, int statusfd)
 	else if (the_pty.pid == 0)
 	{
 		/* Child.. Execute the program. */
-		execvp(*argv, argv);
-
-		/* Report the error to statusfd if we can, or stdout if we
-		** can't. */
-		if (statusfd != -1)
-			dup2(statusfd, 1);
-		else
-			printf(EOS "\r\n");
-
-		printf("%s: could not execute %s: %s\r\n", progname,
-		       *argv, strerror(errno));
-		fflush(stdout);
-		_exit(1);
+#ifdef USE_HOST
+		if (hosted)
+		{
+			host_child_reset(statusfd);
+			host_child(statusfd);
+		}
+#endif
+		pty_exec(argv, statusfd);
 	}
 	/* Parent.. Finish up and return */
 #ifdef BROKEN_MASTER
@@ -178,19 +505,12 @@ killpty(struct pty *pty, int sig)
 }
 
 /* Creates a new unix domain socket. */
-static int
+int
 create_socket(char *name)
 {
 	int s;
-	struct sockaddr_un sockun;
 	mode_t omask;
 
-	if (strlen(name) > sizeof(sockun.sun_path) - 1)
-	{
-		errno = ENAMETOOLONG;
-		return -1;
-	}
-
 	omask = umask(077);
 	s = socket(PF_UNIX, SOCK_STREAM, 0);
 	if (s < 0)
@@ -198,9 +518,8 @@ create_socket(char *name)
 		umask(omask); /* umask always succeeds, errno is untouched. */
 		return -1;
 	}
-	sockun.sun_family = AF_UNIX;
-	strcpy(sockun.sun_path, name);
-	if (bind(s, (struct sockaddr *)&sockun, sizeof(sockun)) < 0)
+	/* This also chmods it to prevent any surprises. */
+	if (socket_at(s, name, 1) < 0)
 	{
 		umask(omask); /* umask always succeeds, errno is untouched. */
 		close(s);
@@ -217,354 +536,2615 @@ create_socket(char *name)
 		close(s);
 		return -1;
 	}
-	/* chmod it to prevent any surprises */
-	if (chmod(name, 0600) < 0)
-	{
-		close(s);
-		return -1;
-	}
 	return s;
 }
 
-/* Update the modes on the socket. */
+/* Update the modes on the socket. The socket's mode is looked up the first
+** time, and remembered from then on. An abstract socket has no modes, and
+** clients ask with MSG_STATUS instead. */
 static void
 update_socket_modes(int exec)
 {
 	struct stat st;
 	mode_t newmode;
 
-	if (stat(sockname, &st) < 0)
+	if (SOCKET_ABSTRACT(sockname))
 		return;
+	if (!socket_mode)
+	{
+		if (stat(sockname, &st) < 0)
+			return;
+		socket_mode = st.st_mode;
+	}
 
 	if (exec)
-		newmode = st.st_mode | S_IXUSR;
+		newmode = socket_mode | S_IXUSR;
 	else
-		newmode = st.st_mode & ~S_IXUSR;
+		newmode = socket_mode & ~S_IXUSR;
 
-	if (st.st_mode != newmode)
-		chmod(sockname, newmode);
+	if (socket_mode != newmode && chmod(sockname, newmode) == 0)
+		socket_mode = newmode;
 }
 
-/* Process activity on the pty - Input and terminal changes are sent out to
-** the attached clients. If the pty goes away, we die. */
-static void
-pty_activity(int s)
+/* Get a chunk to read pty output into. */
+static struct chunk *
+chunk_alloc(void)
 {
-	unsigned char buf[BUFSIZE];
-	ssize_t len;
-	struct client *p;
-	fd_set readfds, writefds;
-	int highest_fd, nclients;
-
-	/* Read the pty activity */
-	len = read(the_pty.fd, buf, sizeof(buf));
+	struct chunk *c = spare_chunks;
 
-	/* Error -> die */
-	if (len <= 0)
+	if (c)
 	{
-		int status;
-
-		if (wait(&status) >= 0)
-		{
-			if (WIFEXITED(status))
-				exit(WEXITSTATUS(status));
-		}
-		exit(1);
+		spare_chunks = c->next;
+		nspare_chunks--;
+	}
+	else
+	{
+		c = malloc(sizeof(struct chunk));
+		if (!c)
+			return NULL;
 	}
+	c->refs = 0;
+	c->len = 0;
+	return c;
+}
 
-#ifdef BROKEN_MASTER
-	/* Get the current terminal settings. */
-	if (tcgetattr(the_pty.slave, &the_pty.term) < 0)
-		exit(1);
-#else
-	/* Get the current terminal settings. */
-	if (tcgetattr(the_pty.fd, &the_pty.term) < 0)
-		exit(1);
-#endif
-
-top:
-	/*
-	** Wait until at least one client is writable. Also wait on the control
-	** socket in case a new client tries to connect.
-	*/
-	FD_ZERO(&readfds);
-	FD_ZERO(&writefds);
-	FD_SET(s, &readfds);
-	highest_fd = s;
-	for (p = clients, nclients = 0; p; p = p->next)
+/* Give a chunk back once nobody holds it anymore. */
+static void
+chunk_free(struct chunk *c)
+{
+	if (nspare_chunks < MAX_SPARE_CHUNKS)
 	{
-		if (!p->attached)
-			continue;
-		FD_SET(p->fd, &writefds);
-		if (p->fd > highest_fd)
-			highest_fd = p->fd;
-		nclients++;
+		c->next = spare_chunks;
+		spare_chunks = c;
+		nspare_chunks++;
 	}
-	if (nclients == 0)
-		return;
-	if (select(highest_fd + 1, &readfds, &writefds, NULL, NULL) < 0)
+	else
+		free(c);
+}
+
+/* Drop a queue's reference to a chunk. */
+static void
+chunk_unref(struct chunk *c)
+{
+	if (--c->refs > 0)
 		return;
+	session_queued -= c->len;
+	chunk_free(c);
+}
 
-	/* Send the data out to the clients. */
-	for (p = clients, nclients = 0; p; p = p->next)
+/* Add output to the replay ring. */
+static void
+replay_add(const unsigned char *buf, size_t len)
+{
+	size_t off, n;
+
+	/* Only the tail of a very large write survives anyway. */
+	if (len > replay_size)
 	{
-		ssize_t written;
+		replay_total += len - replay_size;
+		buf += len - replay_size;
+		len = replay_size;
+	}
+	off = replay_total % replay_size;
+	n = replay_size - off;
+	if (n > len)
+		n = len;
+	memcpy(replay + off, buf, n);
+	memcpy(replay, buf + n, len - n);
+	replay_total += len;
+}
 
-		if (!FD_ISSET(p->fd, &writefds))
-			continue;
+/* Tell the event loop what we want from a client. Its queue is written out
+** if write is set, and it is read from unless it has input waiting for the
+** pty. */
+static void
+client_want(struct client *p, int write)
+{
+	ev_want(&p->w, (p->input ? 0 : EV_READ) | (write ? EV_WRITE : 0));
+}
 
-		written = 0;
-		while (written < len)
-		{
-			ssize_t n = write(p->fd, buf + written, len - written);
+/* Find where a replay starts in the output stream. If the ring has wrapped
+** around, the replay starts at a line boundary, so that the client doesn't
+** begin in the middle of an escape sequence. */
+static unsigned long long
+replay_begin(void)
+{
+	unsigned long long pos = 0;
+
+	if (replay_total > replay_size)
+	{
+		unsigned long long end = replay_total;
 
-			if (n > 0)
+		for (pos = replay_total - replay_size; pos < end; ++pos)
+		{
+			if (replay[pos % replay_size] == '\n')
 			{
-				written += n;
-				continue;
+				++pos;
+				break;
 			}
-			else if (n < 0 && errno == EINTR)
-				continue;
-			else if (n < 0 && errno != EAGAIN)
-				nclients = -1;
-			break;
 		}
-		if (nclients != -1 && written == len)
-			nclients++;
 	}
+	return pos;
+}
 
-	/* Try again if nothing happened. */
-	if (!FD_ISSET(s, &readfds) && nclients == 0)
-		goto top;
+/* Start sending the contents of the replay ring to a client. */
+static void
+replay_start(struct client *p)
+{
+	p->rpos = replay_begin();
+	p->rend = replay_total;
+	if (p->rpos < p->rend && !(p->w.want & EV_WRITE))
+		client_want(p, 1);
 }
 
-/* Process activity on the control socket */
+/* Decide whether we can keep reading from the pty. It is not read while
+** waiting for the first client to attach, or while the block policy is
+** holding the program back until a slow client catches up. */
 static void
-control_activity(int s)
+pty_update_want(void)
 {
-	int fd;
-	struct client *p;
+	int want = EV_READ;
 
-	/* Accept the new client and link it in. */
-	fd = accept(s, NULL, NULL);
-	if (fd < 0)
+	if (pty_gone)
 		return;
-	else if (setnonblocking(fd) < 0)
+	if (waiting_for_attach)
+		want = 0;
+	else if (queue_policy == QUEUE_BLOCK &&
+		 (nover > 0 || session_queued > session_budget))
+		want = 0;
+	if (want != (the_pty.w.want & EV_READ))
 	{
-		close(fd);
-		return;
+		if (!want)
+			stats.paused_since = ev_now();
+		else if (stats.paused_since)
+		{
+			stats.pty_paused += ev_now() - stats.paused_since;
+			stats.paused_since = 0;
+		}
 	}
 
-	/* Link it in. */
-	p = malloc(sizeof(struct client));
-	p->fd = fd;
-	p->attached = 0;
-	p->pprev = &clients;
-	p->next = *(p->pprev);
-	if (p->next)
-		p->next->pprev = &p->next;
-	*(p->pprev) = p;
+	/* Wait for room for input, too. */
+	if (input_head)
+		want |= EV_WRITE;
+	if (want != the_pty.w.want)
+		ev_want(&the_pty.w, want);
 }
 
-/* Process activity from a client. */
+/* Recompute whether a client's queue is over its budget. */
 static void
-client_activity(struct client *p)
+client_update_over(struct client *p)
 {
-	ssize_t len;
-	struct packet pkt;
-
-	/* Read the activity. */
-	len = read(p->fd, &pkt, sizeof(struct packet));
-	if (len < 0 && (errno == EAGAIN || errno == EINTR))
-		return;
+	int over = (p->queued > client_budget);
 
-	/* Close the client on an error. */
-	if (len != sizeof(struct packet))
+	if (over != p->over)
 	{
-		close(p->fd);
-		if (p->next)
-			p->next->pprev = p->pprev;
-		*(p->pprev) = p->next;
-		free(p);
-		return;
+		p->over = over;
+		nover += over ? 1 : -1;
 	}
+}
 
-	/* Push out data to the program. */
-	if (pkt.type == MSG_PUSH)
-	{
-		if (pkt.len <= sizeof(pkt.u.buf))
-			write_buf_or_fail(the_pty.fd, pkt.u.buf, pkt.len);
-	}
+/* Remove the oldest chunk from a client's queue. */
+static void
+client_dequeue(struct client *p)
+{
+	struct chunk *c = p->queue[p->qhead];
 
-	/* Attach or detach from the program. */
-	else if (pkt.type == MSG_ATTACH)
-		p->attached = 1;
-	else if (pkt.type == MSG_DETACH)
-		p->attached = 0;
+	p->queued -= c->len - p->qoff;
+	p->qoff = 0;
+	p->qhead = (p->qhead + 1) % p->qsize;
+	p->qlen--;
+	chunk_unref(c);
+}
 
-	/* Window size change request, without a forced redraw. */
-	else if (pkt.type == MSG_WINCH)
+/* Add a chunk to the end of a client's queue. */
+static int
+client_enqueue(struct client *p, struct chunk *c)
+{
+	if (p->qlen == p->qsize)
 	{
-		the_pty.ws = pkt.u.ws;
-		ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
+		int i, nsize = p->qsize ? p->qsize * 2 : 16;
+		struct chunk **nqueue;
+
+		nqueue = malloc(nsize * sizeof(struct chunk *));
+		if (!nqueue)
+			return -1;
+		for (i = 0; i < p->qlen; ++i)
+			nqueue[i] = p->queue[(p->qhead + i) % p->qsize];
+		free(p->queue);
+		p->queue = nqueue;
+		p->qsize = nsize;
+		p->qhead = 0;
 	}
+	p->queue[(p->qhead + p->qlen) % p->qsize] = c;
+	p->qlen++;
+	p->queued += c->len;
+	c->refs++;
+	if (!(p->w.want & EV_WRITE))
+		client_want(p, 1);
+	return 0;
+}
 
-	/* Force a redraw using a particular method. */
-	else if (pkt.type == MSG_REDRAW)
-	{
-		int method = pkt.len;
+/* Throw away everything queued for a client. */
+static void
+client_clear_queue(struct client *p)
+{
+	/* A write in progress will finish on its own, but must not touch
+	** the queue anymore. */
+	if (p->wop)
+		p->wop->stale = 1;
+	while (p->qlen > 0)
+		client_dequeue(p);
+	free(p->queue);
+	p->queue = NULL;
+	p->qsize = 0;
+	p->qhead = 0;
+	client_update_over(p);
+	if (p->w.want & EV_WRITE)
+		client_want(p, 0);
+}
 
-		/* If the client didn't specify a particular method, use
-		** whatever we had on startup. */
-		if (method == REDRAW_UNSPEC)
-			method = redraw_method;
-		if (method == REDRAW_NONE)
-			return;
+/* Drop the oldest output of a slow client until it fits in the budget. A
+** partially written chunk is kept, since the client has seen part of it,
+** and so are the chunks of a write in progress. */
+static void
+client_drop_oldest(struct client *p, size_t budget)
+{
+	int keep = p->wop ? p->wop->nchunks : (p->qoff > 0);
 
-		/* Set the window size. */
-		the_pty.ws = pkt.u.ws;
-		ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
+	while (p->queued > budget && p->qlen > keep)
+	{
+		struct chunk *c;
+		int i;
 
-		/* Send a ^L character if the terminal is in no-echo and
-		** character-at-a-time mode. */
-		if (method == REDRAW_CTRL_L)
+		if (keep == 0)
 		{
-			char c = '\f';
+			client_dequeue(p);
+			continue;
+		}
 
-			if (((the_pty.term.c_lflag & (ECHO|ICANON)) == 0) &&
-			    (the_pty.term.c_cc[VMIN] == 1))
-			{
-				write_buf_or_fail(the_pty.fd, &c, 1);
-			}
+		/* Drop the chunk right after the ones we keep. */
+		i = (p->qhead + keep) % p->qsize;
+		c = p->queue[i];
+		p->queued -= c->len;
+		for (; i != (p->qhead + p->qlen - 1) % p->qsize;
+		     i = (i + 1) % p->qsize)
+			p->queue[i] = p->queue[(i + 1) % p->qsize];
+		p->qlen--;
+		chunk_unref(c);
+	}
+	client_update_over(p);
+}
+
+/* Account for n bytes of a client's replay and queue having been
+** written. */
+static void
+client_written(struct client *p, size_t n)
+{
+	stats.client_written += n;
+	if (p->rpos < p->rend)
+	{
+		size_t left = p->rend - p->rpos;
+
+		if (n < left)
+		{
+			p->rpos += n;
+			return;
 		}
-		/* Send a WINCH signal to the program. */
-		else if (method == REDRAW_WINCH)
+		p->rpos = p->rend;
+		n -= left;
+	}
+	while (n > 0 && p->qlen > 0)
+	{
+		size_t left = p->queue[p->qhead]->len - p->qoff;
+
+		if (n < left)
 		{
-			killpty(&the_pty, SIGWINCH);
+			p->qoff += n;
+			p->queued -= n;
+			break;
 		}
+		n -= left;
+		client_dequeue(p);
 	}
+	client_update_over(p);
 }
 
-/* The master process - It watches over the pty process and the attached */
-/* clients. */
+static void client_close(struct client *p);
+static void client_wait_end(struct client *p, int how);
+static int client_ring(struct client *p);
+
+/* A write in the background has finished. */
 static void
-master_process(int s, char **argv, int waitattach, int statusfd)
+client_write_done(struct ev_req *r, int res)
 {
-	struct client *p, *next;
-	fd_set readfds;
-	int highest_fd;
-	int nullfd;
+	struct wop *op = (struct wop *)r;
+	struct client *p = op->p;
+	int i;
 
-	int has_attached_client = 0;
+	if (p)
+	{
+		p->wop = NULL;
+		if (res > 0 && !op->stale)
+			client_written(p, res);
+		if (res >= 0 && (size_t)res < op->len)
+			stats.partial_writes++;
+	}
+	for (i = 0; i < op->nchunks; ++i)
+		chunk_unref(op->chunks[i]);
+	free(op);
+	if (!p)
+		return;
 
-	/* Okay, disassociate ourselves from the original terminal, as we
-	** don't care what happens to it. */
-	setsid();
+	if (res == -EAGAIN)
+	{
+		/* Wait until the kernel says there is room. */
+		ev_clear(&p->w, EV_WRITE);
+		client_want(p, 1);
+	}
+	else if (res < 0 && res != -EINTR && res != -ECANCELED)
+		client_close(p);
+	else if (p->qlen > 0 || p->ring_asked)
+		client_want(p, 1);
+	pty_update_want();
+}
 
-	/* Set a trap to unlink the socket when we die. */
-	atexit(unlink_socket);
+/* Hand the queued output in iov to the kernel to write in the background.
+** Returns -1 if that is not possible, and the caller should write it
+** itself. */
+static int
+client_write_async(struct client *p, struct iovec *iov, int n)
+{
+	struct wop *op = malloc(sizeof(struct wop));
+	int i;
 
-	/* Create a pty in which the process is running. */
-	signal(SIGCHLD, die);
-	if (init_pty(argv, statusfd) < 0)
+	if (!op)
+		return -1;
+	op->req.done = client_write_done;
+	op->p = p;
+	op->stale = 0;
+	op->nchunks = n;
+	op->len = 0;
+	for (i = 0; i < n; ++i)
 	{
-		if (statusfd != -1)
-			dup2(statusfd, 1);
-		if (errno == ENOENT)
-			printf("%s: Could not find a pty.\n", progname);
-		else
-			printf("%s: init_pty: %s\n", progname, strerror(errno));
-		exit(1);
+		op->chunks[i] = p->queue[(p->qhead + i) % p->qsize];
+		op->chunks[i]->refs++;
+		op->iov[i] = iov[i];
+		op->len += iov[i].iov_len;
 	}
+	if (ev_writev(p->fd, op->iov, n, &op->req) < 0)
+	{
+		for (i = 0; i < n; ++i)
+			chunk_unref(op->chunks[i]);
+		free(op);
+		return -1;
+	}
+	p->wop = op;
 
-	/* Set up some signals. */
-	signal(SIGPIPE, SIG_IGN);
-	signal(SIGXFSZ, SIG_IGN);
-	signal(SIGHUP, SIG_IGN);
-	signal(SIGTTIN, SIG_IGN);
-	signal(SIGTTOU, SIG_IGN);
-	signal(SIGINT, die);
-	signal(SIGTERM, die);
+	/* There is nothing more to write until it has finished. */
+	client_want(p, 0);
+	return 0;
+}
 
-	/* Close statusfd, since we don't need it anymore. */
-	if (statusfd != -1)
-		close(statusfd);
+/* Write out as much of a client's queue as it will take. Returns -1 if the
+** client has gone away. */
+static int
+client_flush(struct client *p)
+{
+	struct iovec iov[MAX_IOV];
+	size_t total;
+	ssize_t n;
+	int i = 0, j;
+
+	if (p->wop)
+	{
+		client_want(p, 0);
+		return 0;
+	}
+
+	/* Live output that came in since the client attached may have
+	** overwritten part of the replay already. */
+	if (p->rpos < p->rend && replay_total - p->rpos > replay_size)
+		p->rpos = replay_total - replay_size;
+	if (p->rpos > p->rend)
+		p->rpos = p->rend;
+
+#ifdef USE_SPLICE
+	/* Whatever is in the pipe came before the queue. */
+	if (p->piped > 0)
+	{
+		n = splice(p->pipe[0], NULL, p->fd, NULL, p->piped,
+			   SPLICE_F_NONBLOCK);
+		if (n < 0)
+		{
+			if (errno == EAGAIN)
+				ev_clear(&p->w, EV_WRITE);
+			else if (errno != EINTR)
+				return -1;
+			return 0;
+		}
+		p->piped -= n;
+		stats.client_written += n;
+		if (p->piped > 0)
+			return 0;
+	}
+#endif
+
+	/* The answer to asking for the ring carries descriptors, so it can't
+	** be queued. It goes out once everything ahead of it has. */
+	if (p->qlen == 0 && p->rpos == p->rend)
+	{
+		client_want(p, 0);
+		return p->ring_asked ? client_ring(p) : 0;
+	}
+
+	/* The rest of the replay comes first, in one or two pieces. */
+	if (p->rpos < p->rend)
+	{
+		size_t off = p->rpos % replay_size;
+		size_t len = p->rend - p->rpos;
+
+		iov[i].iov_base = replay + off;
+		iov[i].iov_len = len < replay_size - off ? len :
+			replay_size - off;
+		if (len > iov[i].iov_len)
+		{
+			iov[i + 1].iov_base = replay;
+			iov[i + 1].iov_len = len - iov[i].iov_len;
+			i++;
+		}
+		i++;
+	}
+	for (j = 0; j < p->qlen && i < MAX_IOV; ++i, ++j)
+	{
+		struct chunk *c = p->queue[(p->qhead + j) % p->qsize];
+
+		iov[i].iov_base = c->data;
+		iov[i].iov_len = c->len;
+		if (j == 0)
+		{
+			iov[i].iov_base = c->data + p->qoff;
+			iov[i].iov_len -= p->qoff;
+		}
+	}
+
+	/* Once the replay is out of the way, the kernel can write the queue
+	** in the background, if the event loop supports that. The replay
+	** ring may be overwritten at any time, so it is written here. */
+	if (p->rpos == p->rend && ev_async() &&
+	    client_write_async(p, iov, i) == 0)
+		return 0;
+
+	n = writev(p->fd, iov, i);
+	if (n < 0)
+	{
+		if (errno == EAGAIN)
+			ev_clear(&p->w, EV_WRITE);
+		else if (errno != EINTR)
+			return -1;
+		return 0;
+	}
+
+	/* Release whatever was written completely. */
+	for (j = 0, total = 0; j < i; ++j)
+		total += iov[j].iov_len;
+	if ((size_t)n < total)
+		stats.partial_writes++;
+	client_written(p, n);
+	if (p->qlen == 0 && p->rpos == p->rend && !p->ring_asked)
+		client_want(p, 0);
+	return 0;
+}
+
+#ifdef USE_SPLICE
+/* Give an attaching client a pipe for output passed along without copying.
+** Without one, the client simply gets its output copied. */
+static void
+client_open_pipe(struct client *p)
+{
+	if (splice_pipe[0] < 0 || p->pipe[0] >= 0)
+		return;
+	if (pipe(p->pipe) < 0)
+	{
+		p->pipe[0] = p->pipe[1] = -1;
+		return;
+	}
+#ifdef F_SETPIPE_SZ
+	/* A bigger pipe means fewer trips through the event loop. The
+	** default size will do if the system won't allow it. */
+	fcntl(p->pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+#endif
+}
+
+/* Close a client's pipe, throwing away whatever is still in it. */
+static void
+client_close_pipe(struct client *p)
+{
+	if (p->pipe[0] < 0)
+		return;
+	close(p->pipe[0]);
+	close(p->pipe[1]);
+	p->pipe[0] = p->pipe[1] = -1;
+	p->piped = 0;
+}
+#endif
+
+/* Put a client at the back of the line for writing to the pty. */
+static void
+input_link(struct client *p)
+{
+	if (!input_head)
+		input_tail = &input_head;
+	p->input_next = NULL;
+	p->input_pprev = input_tail;
+	*input_tail = p;
+	input_tail = &p->input_next;
+}
+
+/* Take a client out of the line for writing to the pty. */
+static void
+input_unlink(struct client *p)
+{
+	if (p->input_next)
+		p->input_next->input_pprev = p->input_pprev;
+	else
+		input_tail = p->input_pprev;
+	*(p->input_pprev) = p->input_next;
+	p->input_pprev = NULL;
+}
+
+/* Throw away a client's input that is waiting for the pty. */
+static void
+input_free(struct client *p)
+{
+	input_unlink(p);
+	input_queued -= p->input_len;
+	free(p->input);
+	p->input = NULL;
+	p->input_len = 0;
+	if (!input_head && input_since)
+	{
+		stats.pty_write_blocked += ev_now() - input_since;
+		input_since = 0;
+	}
+}
+
+/* Pick the size of the pty out of the sizes the clients asked for, by the
+** size policy. Returns 0 if there is nothing to go by. */
+static int
+pick_size(struct winsize *ws)
+{
+	struct client *p, *owner = NULL;
+	int found = 0;
+
+	if (size_policy == SIZE_LATEST)
+	{
+		*ws = latest_ws;
+		return has_latest_ws;
+	}
+	for (p = clients; p; p = p->next)
+	{
+		if (!p->attached || !p->has_ws)
+			continue;
+		if (size_policy == SIZE_OWNER)
+		{
+			if (!owner || p->attach_seq < owner->attach_seq)
+				owner = p;
+			continue;
+		}
+		if (!found)
+			*ws = p->ws;
+		else if (size_policy == SIZE_SMALLEST)
+		{
+			if (p->ws.ws_row < ws->ws_row)
+				ws->ws_row = p->ws.ws_row;
+			if (p->ws.ws_col < ws->ws_col)
+				ws->ws_col = p->ws.ws_col;
+			if (p->ws.ws_xpixel < ws->ws_xpixel)
+				ws->ws_xpixel = p->ws.ws_xpixel;
+			if (p->ws.ws_ypixel < ws->ws_ypixel)
+				ws->ws_ypixel = p->ws.ws_ypixel;
+		}
+		else
+		{
+			if (p->ws.ws_row > ws->ws_row)
+				ws->ws_row = p->ws.ws_row;
+			if (p->ws.ws_col > ws->ws_col)
+				ws->ws_col = p->ws.ws_col;
+			if (p->ws.ws_xpixel > ws->ws_xpixel)
+				ws->ws_xpixel = p->ws.ws_xpixel;
+			if (p->ws.ws_ypixel > ws->ws_ypixel)
+				ws->ws_ypixel = p->ws.ws_ypixel;
+		}
+		found = 1;
+	}
+	if (owner)
+	{
+		*ws = owner->ws;
+		found = 1;
+	}
+	return found;
+}
+
+/* Resize the pty to the size the policy picks, if that changed. */
+static void
+pty_resize(void)
+{
+	struct winsize ws;
+
+	ev_timer_cancel(&resize_timer);
+	if (!pick_size(&ws) ||
+	    memcmp(&ws, &the_pty.ws, sizeof(struct winsize)) == 0)
+		return;
+	the_pty.ws = ws;
+	ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
+	if (the_screen)
+		screen_resize(the_screen, the_pty.ws.ws_row,
+			      the_pty.ws.ws_col);
+	stats.resizes++;
+}
+
+/* The resizes have settled. */
+static void
+resize_expired(ATTRIBUTE_UNUSED struct timer *t)
+{
+	pty_resize();
+}
+
+/* Resize the pty once the sizes have stopped changing for resize_delay, so
+** that a window being dragged around makes the program redraw once, rather
+** than for every step of the way. */
+static void
+resize_later(void)
+{
+	if (resize_delay == 0)
+		pty_resize();
+	else
+		ev_timer_set(&resize_timer, resize_delay);
+}
+
+/* Note down the size a client asked for. Clients without a terminal ask for
+** nothing at all. */
+static void
+client_set_size(struct client *p, const struct winsize *ws)
+{
+	stats.resize_requests++;
+	if (ws->ws_row == 0 || ws->ws_col == 0)
+		return;
+	p->ws = *ws;
+	p->has_ws = 1;
+	latest_ws = *ws;
+	has_latest_ws = 1;
+}
+
+/* Unlink a client and close its connection. */
+static void
+client_close(struct client *p)
+{
+	int attached = p->attached;
+
+	if (p->attached)
+		nattached--;
+	client_clear_queue(p);
+#ifdef USE_SPLICE
+	client_close_pipe(p);
+#endif
+	if (p->wop)
+	{
+		p->wop->p = NULL;
+		ev_cancel(&p->wop->req);
+	}
+	if (p->ring)
+		close(p->ring_wake);
+	client_wait_end(p, 0);
+	if (p->input)
+		input_free(p);
+	free(p->ibuf);
+	ev_del(&p->w);
+	close(p->fd);
+	if (p->next)
+		p->next->pprev = p->pprev;
+	*(p->pprev) = p->next;
+	free(p);
+
+	/* Its size may no longer count. */
+	if (attached && size_policy != SIZE_LATEST)
+		resize_later();
+}
+
+/* Wake up the clients reading from the ring that went to sleep waiting for
+** output, or only p if it is not NULL. */
+static void
+ring_wakeup(struct client *only)
+{
+	struct client *p;
+
+	for (p = only ? only : clients; p; p = only ? NULL : p->next)
+	{
+		if (p->ring && (p == only || p->attached) &&
+		    ring_wake_wanted(out_ring, p->ring - 1))
+		{
+			ring_signal(p->ring_wake);
+			stats.ring_wakeups++;
+		}
+	}
+}
+
+/* Put output into the ring for every client reading from it, or only for p
+** if it is not NULL, and wake them up. */
+static void
+ring_send(struct client *only, const struct iovec *iov, int n)
+{
+	ring_put(out_ring, only ? only->ring : 0, iov, n);
+	ring_wakeup(only);
+}
+
+/* Start a client off in the ring, with the replay if there is one. Its first
+** record is always addressed to it, even if it is empty, since it ignores
+** the output for everyone until then. */
+static void
+ring_start(struct client *p)
+{
+	struct iovec iov[2];
+	unsigned long long pos;
+	int n = 0;
+
+	for (pos = replay ? replay_begin() : 0; replay && pos < replay_total;
+	     ++n)
+	{
+		size_t off = pos % replay_size, len = replay_size - off;
+
+		if (len > replay_total - pos)
+			len = replay_total - pos;
+		iov[n].iov_base = replay + off;
+		iov[n].iov_len = len;
+		pos += len;
+	}
+	ring_send(p, iov, n);
+}
+
+/* Hand a client the output ring, if it can have it: only before it
+** attaches, and only while there are reader numbers left. Otherwise it is
+** told no, and its output comes through the socket as usual. This is only
+** done once nothing else is on its way to the client. Returns -1 if the
+** answer could not be sent, and the client has to go. */
+static int
+client_ring(struct client *p)
+{
+	union
+	{
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	unsigned char used[RING_READERS];
+	struct packet reply;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct client *q;
+	int n, fds[2] = {-1, -1};
+
+	memset(&reply, 0, sizeof(struct packet));
+	reply.type = MSG_RING;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &reply;
+	iov.iov_len = sizeof(struct packet);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	memset(used, 0, sizeof(used));
+	for (q = clients; q; q = q->next)
+	{
+		if (q->ring)
+			used[q->ring - 1] = 1;
+	}
+	for (n = 0; n < RING_READERS && used[n]; ++n)
+		;
+	if (!p->attached && !p->ring && n < RING_READERS && !out_ring)
+		out_ring = ring_new();
+	if (!p->attached && !p->ring && n < RING_READERS && out_ring &&
+	    (fds[1] = ring_eventfd()) >= 0)
+	{
+		fds[0] = ring_memfd(out_ring);
+		ring_reader_reset(out_ring, n);
+		reply.len = n + 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	}
+
+	p->ring_asked = 0;
+	if (sendmsg(p->fd, &msg, 0) != sizeof(struct packet))
+	{
+		if (fds[1] >= 0)
+			close(fds[1]);
+		return -1;
+	}
+	if (reply.len)
+	{
+		p->ring = reply.len;
+		p->ring_wake = fds[1];
+	}
+	return 0;
+}
+
+/* Queue a copy of buf for a client, outside of the session's output. */
+static void
+client_send(struct client *p, const void *buf, size_t len)
+{
+	size_t off;
+
+	for (off = 0; off < len; off += BUFSIZE)
+	{
+		struct chunk *c = chunk_alloc();
+
+		if (!c)
+			break;
+		c->len = len - off < BUFSIZE ? len - off : BUFSIZE;
+		memcpy(c->data, (const char *)buf + off, c->len);
+		c->refs = 1;
+		session_queued += c->len;
+		if (client_enqueue(p, c) < 0)
+		{
+			chunk_unref(c);
+			break;
+		}
+		chunk_unref(c);
+	}
+	client_update_over(p);
+}
+
+/* Queue a frame for a client collecting output. */
+static void
+client_send_frame(struct client *p, int type, const void *buf, size_t len)
+{
+	unsigned char frame[sizeof(struct frame) + BUFSIZE];
+	struct frame *f = (struct frame *)frame;
+
+	f->type = type;
+	FRAME_SET_LEN(f, len);
+	memcpy(frame + sizeof(struct frame), buf, len);
+	client_send(p, frame, sizeof(struct frame) + len);
+}
+
+/* Tell a waiting client how its wait ended: EXPECT_FOUND if its pattern
+** turned up, EXPECT_QUIET if the output went quiet, and 0 if it can't wait
+** at all. A client collecting output gets a frame, after the output. */
+static void
+client_wait_reply(struct client *p, int how, int framed)
+{
+	struct packet reply;
+
+	memset(&reply, 0, sizeof(struct packet));
+	reply.type = MSG_WAIT;
+	reply.len = how;
+	if (framed)
+		client_send_frame(p, MSG_WAIT, &reply, sizeof(struct packet));
+	else
+		client_send(p, &reply, sizeof(struct packet));
+}
+
+/* A client is done waiting, for whatever reason. */
+static void
+client_wait_end(struct client *p, int how)
+{
+	if (p->wait)
+	{
+		pattern_put(the_matcher, p->wait);
+		p->wait = NULL;
+		nwaiting--;
+	}
+	if (how)
+		client_wait_reply(p, how, p->expect);
+	if (p->expect)
+	{
+		ev_timer_cancel(&p->quiet_timer);
+		p->expect = 0;
+		nexpecting--;
+	}
+}
+
+/* Start a client waiting for a pattern to turn up in the output. */
+static int
+client_wait(struct client *p, const unsigned char *str, size_t len)
+{
+	if (!p->wait && !the_matcher)
+		the_matcher = matcher_new();
+	if (p->wait || !the_matcher ||
+	    !(p->wait = pattern_get(the_matcher, str, len)))
+	{
+		client_wait_reply(p, 0, p->expect);
+		return -1;
+	}
+	nwaiting++;
+	return 0;
+}
+
+/* The output of a client collecting it has been quiet for long enough,
+** unless its input is still waiting to be written. */
+static void
+client_quiet(struct timer *t)
+{
+	struct client *p = t->data;
+
+	if (p->input)
+		ev_timer_set(&p->quiet_timer, p->quiet);
+	else
+		client_wait_end(p, EXPECT_QUIET);
+}
+
+/* Start a client collecting the output its input causes, until a pattern
+** turns up or the output goes quiet. */
+static void
+client_expect(struct client *p, const unsigned char *buf, size_t len)
+{
+	unsigned long quiet;
+
+	if (p->expect || p->wait || len < 4 || (len == 4 && !buf[0] &&
+						!buf[1] && !buf[2] && !buf[3]))
+	{
+		client_wait_reply(p, 0, 1);
+		return;
+	}
+	quiet = ((unsigned long)buf[0] << 24) | (buf[1] << 16) |
+		(buf[2] << 8) | buf[3];
+	p->expect = 1;
+	nexpecting++;
+	if (len > 4 && client_wait(p, buf + 4, len - 4) < 0)
+	{
+		client_wait_end(p, 0);
+		return;
+	}
+	if (quiet)
+	{
+		p->quiet = quiet * 1000;
+		p->quiet_timer.handler = client_quiet;
+		p->quiet_timer.data = p;
+		ev_timer_set(&p->quiet_timer, p->quiet);
+	}
+}
+
+/* Look for the patterns that clients wait for in a piece of output, and
+** hand it to the clients collecting output. Only the clients whose pattern
+** turned up are told. A client collecting output that goes over its budget
+** is evicted, unless the block policy holds the program back instead, since
+** dropping some of its output would break up the frames. */
+static void
+wait_feed(const unsigned char *buf, size_t len)
+{
+	struct client *p, *next;
+	int found = nwaiting ? matcher_feed(the_matcher, buf, len) : 0;
+
+	if (!found && !nexpecting)
+		return;
+	for (p = clients; p; p = next)
+	{
+		int matched = p->wait && pattern_matched(p->wait);
+		size_t off, n = matched ? pattern_end(p->wait) : len;
+
+		next = p->next;
+		if (p->expect)
+		{
+			for (off = 0; off < n; off += BUFSIZE)
+				client_send_frame(p, MSG_PUSH, buf + off,
+						  n - off < BUFSIZE ?
+						  n - off : BUFSIZE);
+			if (p->over && queue_policy != QUEUE_BLOCK)
+			{
+				stats.evicted++;
+				client_close(p);
+				continue;
+			}
+			if (n > 0 && p->quiet)
+				ev_timer_set(&p->quiet_timer, p->quiet);
+		}
+		if (matched)
+		{
+			client_wait_end(p, EXPECT_FOUND);
+			stats.wait_matches++;
+		}
+	}
+}
+
+/* Replace the output queued for a client with a snapshot of the screen,
+** which already includes the effect of that output. A partially written
+** chunk is finished first. */
+static void
+client_snapshot(struct client *p)
+{
+	unsigned char *buf;
+	size_t len;
+
+	len = screen_snapshot(the_screen, &buf);
+	if (len == 0)
+		return;
+
+	/* A client reading from the ring gets it there, in order with the
+	** rest of its output. */
+	if (p->ring)
+	{
+		struct iovec iov;
+
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		ring_send(p, &iov, 1);
+		free(buf);
+		return;
+	}
+
+	client_drop_oldest(p, 0);
+	p->rpos = p->rend;
+	client_send(p, buf, len);
+	free(buf);
+}
+
+/* Find the attached or collecting client with the most output queued. */
+static struct client *
+slowest_client(void)
+{
+	struct client *p, *slowest = NULL;
+
+	for (p = clients; p; p = p->next)
+	{
+		if ((p->attached || p->expect) &&
+		    (!slowest || p->queued > slowest->queued))
+			slowest = p;
+	}
+	return slowest;
+}
+
+/* Write input from a client to the pty. If the pty has no room for all of
+** it, or other clients are already waiting for room, the rest waits its
+** turn, and the client is not read from until it has been written. The
+** program can't hold up the master by not reading its input, and a client
+** can only have so much waiting. */
+static void
+client_input(struct client *p, const void *buf, size_t len)
+{
+	ssize_t n = 0;
+
+	if (len == 0 || pty_gone)
+		return;
+	if (!input_head)
+	{
+		n = write(the_pty.fd, buf, len);
+		if (n < 0 && errno == EAGAIN)
+			ev_clear(&the_pty.w, EV_WRITE);
+		else if (n < 0 && errno != EINTR)
+			master_exit(1);
+		if (n < 0)
+			n = 0;
+		stats.pty_written += n;
+		if ((size_t)n == len)
+			return;
+	}
+
+	p->input = malloc(len - n);
+	if (!p->input)
+		return;
+	memcpy(p->input, (const unsigned char *)buf + n, len - n);
+	p->input_off = 0;
+	p->input_len = len - n;
+	if (!input_head)
+		input_since = ev_now();
+	input_link(p);
+	input_queued += p->input_len;
+	stats.input_held++;
+	client_want(p, p->w.want & EV_WRITE);
+	pty_update_want();
+}
+
+static void client_resume(struct client *p);
+
+/* The pty has room for input. The clients waiting for it take turns, so
+** that one pasting a lot of text doesn't hold up the keystrokes of the
+** others. */
+static void
+pty_input(void)
+{
+	while (input_head)
+	{
+		struct client *p = input_head;
+		size_t len = p->input_len < INPUT_SLICE ? p->input_len :
+			INPUT_SLICE;
+		ssize_t n;
+
+		n = write(the_pty.fd, p->input + p->input_off, len);
+		if (n < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				ev_clear(&the_pty.w, EV_WRITE);
+				break;
+			}
+			else if (errno == EINTR)
+				continue;
+			master_exit(1);
+		}
+		stats.pty_written += n;
+		p->input_off += n;
+		p->input_len -= n;
+		input_queued -= n;
+
+		input_unlink(p);
+		if (p->input_len > 0)
+			input_link(p);
+		else
+		{
+			free(p->input);
+			p->input = NULL;
+			client_want(p, p->w.want & EV_WRITE);
+			client_resume(p);
+		}
+	}
+	if (!input_head && input_since)
+	{
+		stats.pty_write_blocked += ev_now() - input_since;
+		input_since = 0;
+	}
+	pty_update_want();
+}
+
+/* The program is gone and its output has been written out, or given up
+** on. Exit the same way the program did. A host daemon reaps its children
+** as they exit, so a hosted session just ends. */
+static void
+session_end(void)
+{
+	int status;
+
+#ifdef USE_HOST
+	if (hosted)
+		master_exit(0);
+#endif
+	if (waitpid(the_pty.pid, &status, 0) >= 0)
+	{
+		if (WIFEXITED(status))
+			exit(WEXITSTATUS(status));
+	}
+	exit(1);
+}
+
+/* Give up on the output that could not be written out in time. */
+static void
+drain_expired(ATTRIBUTE_UNUSED struct timer *t)
+{
+	session_end();
+}
+
+/* Whether everything read from the pty has been written out to the
+** clients. Clients reading from the ring already have it. */
+static int
+session_drained(void)
+{
+	struct client *p;
+
+	if (nbatch > 0)
+		return 0;
+	for (p = clients; p; p = p->next)
+	{
+		if (p->qlen > 0 || p->rpos < p->rend || p->wop)
+			return 0;
+#ifdef USE_SPLICE
+		if (p->piped > 0)
+			return 0;
+#endif
+	}
+	return 1;
+}
+
+/* The pty went away, so the program is gone. Stop reading from the pty,
+** and end the session once the clients have been sent what is already
+** queued for them, or DRAIN_TIME has passed, whichever comes first. Input
+** for the program has nowhere to go, and the clients waiting for output
+** will not get it. */
+static void
+pty_exit(void)
+{
+	struct client *p;
+
+	if (pty_gone)
+		return;
+	pty_gone = 1;
+	ev_del(&the_pty.w);
+	the_pty.w.handler = NULL;
+	while (input_head)
+	{
+		p = input_head;
+		input_free(p);
+		client_want(p, p->w.want & EV_WRITE);
+		client_resume(p);
+	}
+	for (p = clients; p; p = p->next)
+		client_wait_end(p, 0);
+	ev_timer_set(&drain_timer, DRAIN_TIME);
+}
+
+/* Get the current terminal settings. They are only needed to decide how to
+** redraw, so they are asked for then rather than kept up to date as the
+** program changes them. Returns -1 on failure. */
+static int
+pty_get_term(void)
+{
+#ifdef BROKEN_MASTER
+	return tcgetattr(the_pty.slave, &the_pty.term);
+#else
+	return tcgetattr(the_pty.fd, &the_pty.term);
+#endif
+}
+
+/* Queue n chunks of output for an attached client, skipping the first skip
+** bytes, which it already has. Skipping is only possible when nothing else
+** is queued. Clients that can't keep up are dealt with here. */
+static void
+client_output(struct client *p, struct chunk **c, int n, size_t skip)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (client_enqueue(p, c[i]) < 0)
+		{
+			client_close(p);
+			return;
+		}
+	}
+	if (skip > 0)
+	{
+		p->qoff = skip;
+		p->queued -= skip;
+	}
+	client_update_over(p);
+
+	if (p->over && queue_policy == QUEUE_DROP)
+	{
+		size_t before = p->queued;
+
+		client_drop_oldest(p, client_budget);
+		stats.dropped += before - p->queued;
+	}
+	else if (p->over && queue_policy == QUEUE_EVICT)
+	{
+		stats.evicted++;
+		client_close(p);
+	}
+}
+
+/* Keep the session as a whole within its budget. The output of a client
+** collecting it is never dropped, as that would break up its frames. */
+static void
+session_check_budget(void)
+{
+	struct client *p;
+
+	while (session_queued > session_budget && queue_policy != QUEUE_BLOCK)
+	{
+		p = slowest_client();
+		if (!p)
+			break;
+		if (queue_policy == QUEUE_DROP && !p->expect)
+		{
+			size_t before = p->queued;
+
+			client_drop_oldest(p, 0);
+			if (p->queued == before)
+				break;
+			stats.dropped += before - p->queued;
+		}
+		else
+		{
+			stats.evicted++;
+			client_close(p);
+		}
+	}
+}
+
+#ifdef USE_SPLICE
+/* Set up for passing output along without copying. The pipe is never
+** waited on, so that reading what it doesn't hold can't hang the master. */
+static void
+splice_init(void)
+{
+	if (pipe(splice_pipe) < 0)
+	{
+		splice_pipe[0] = splice_pipe[1] = -1;
+		return;
+	}
+	splice_sink = open("/dev/null", O_WRONLY);
+	if (splice_sink < 0 || setnonblocking(splice_pipe[0]) < 0 ||
+	    setnonblocking(splice_pipe[1]) < 0)
+	{
+		if (splice_sink >= 0)
+			close(splice_sink);
+		splice_sink = -1;
+		close(splice_pipe[0]);
+		close(splice_pipe[1]);
+		splice_pipe[0] = splice_pipe[1] = -1;
+	}
+}
+
+/* Go back to copying output. Clients keep their pipes until they have
+** written out what is in them. */
+static void
+splice_shutdown(void)
+{
+	close(splice_pipe[0]);
+	close(splice_pipe[1]);
+	close(splice_sink);
+	splice_pipe[0] = splice_pipe[1] = splice_sink = -1;
+}
+
+/* Output can be passed along without copying if every attached client has a
+** pipe, and nothing queued that has to be written out first. */
+static int
+splice_usable(void)
+{
+	struct client *p;
+
+	if (splice_pipe[0] < 0 || nattached == 0 || nbatch > 0 || nwaiting ||
+	    nexpecting)
+		return 0;
+	for (p = clients; p; p = p->next)
+	{
+		if (p->attached && (p->pipe[0] < 0 || p->qlen > 0))
+			return 0;
+	}
+	return 1;
+}
+
+/* Like pty_activity, except that the output stays in the kernel. It is
+** spliced from the pty into a pipe, and tee'd from there into the pipe of
+** every attached client. Only when a client's pipe is too full to take all
+** of it is the output read into a chunk, so that the rest can be queued. */
+static void
+pty_splice(struct watch *w)
+{
+	struct chunk *c;
+	ssize_t len;
+	struct client *p, *next;
+	unsigned long long start;
+	int copy = 0;
+
+	c = chunk_alloc();
+	if (!c)
+		return;
+	len = splice(the_pty.fd, NULL, splice_pipe[1], NULL, sizeof(c->data),
+		     SPLICE_F_NONBLOCK);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		if (errno == EAGAIN)
+			ev_clear(w, EV_READ);
+		chunk_free(c);
+		return;
+	}
+
+	/* Some kernels can't splice from a pty. The pty is still readable,
+	** so it will be read the usual way on the next pass. */
+	if (len < 0 && errno == EINVAL)
+	{
+		splice_shutdown();
+		chunk_free(c);
+		return;
+	}
+
+	/* Error -> the program is gone */
+	if (len <= 0)
+	{
+		chunk_free(c);
+		pty_exit();
+		return;
+	}
+	stats.pty_read += len;
+	hist_add(&stats.read_size, len);
+
+	start = ev_now();
+	for (p = clients; p; p = p->next)
+	{
+		ssize_t n;
+
+		if (!p->attached)
+			continue;
+		n = tee(splice_pipe[0], p->pipe[1], len, SPLICE_F_NONBLOCK);
+		p->teed = n > 0 ? n : 0;
+		p->piped += p->teed;
+		if (p->teed < (size_t)len)
+			copy = 1;
+		if (p->piped > 0 && !(p->w.want & EV_WRITE))
+			client_want(p, 1);
+	}
+	hist_add(&stats.fanout, ev_now() - start);
+
+	/* Throw the output away if everyone has it. */
+	if (!copy && splice(splice_pipe[0], NULL, splice_sink, NULL, len,
+			    SPLICE_F_NONBLOCK) == len)
+	{
+		chunk_free(c);
+		return;
+	}
+
+	/* Otherwise read it, and queue what didn't fit. Some of it may have
+	** gone to the sink after all, and is of no use to anyone then, so
+	** reading stops once the pipe is empty. */
+	c->len = 0;
+	while (c->len < (size_t)len)
+	{
+		ssize_t n = read(splice_pipe[0], c->data + c->len,
+				 len - c->len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		c->len += n;
+	}
+	c->refs = 1;
+	session_queued += c->len;
+	for (p = clients; p; p = next)
+	{
+		next = p->next;
+		if (p->attached && p->teed < c->len)
+			client_output(p, &c, 1, p->teed);
+	}
+	chunk_unref(c);
+	session_check_budget();
+	pty_update_want();
+}
+#endif
+
+/* Hand out the output that was held back, to every attached client but
+** skip. If skip is not NULL, it is a client that is being dealt with by the
+** caller, and it is left alone even if the session is over its budget. */
+static void
+batch_flush(struct client *skip)
+{
+	struct client *p, *next;
+	unsigned long long start = ev_now();
+	int ring = 0, i;
+
+	ev_timer_cancel(&batch_timer);
+	for (p = clients; p; p = next)
+	{
+		next = p->next;
+		if (p->ring)
+			ring |= p->attached;
+		else if (p->attached && p != skip)
+			client_output(p, batch, nbatch, 0);
+	}
+
+	/* The clients reading from the ring share a single copy. */
+	if (ring)
+	{
+		struct iovec iov[MAX_BATCH];
+
+		for (i = 0; i < nbatch; ++i)
+		{
+			iov[i].iov_base = batch[i]->data;
+			iov[i].iov_len = batch[i]->len;
+		}
+		ring_send(NULL, iov, nbatch);
+	}
+	hist_add(&stats.fanout, ev_now() - start);
+	while (nbatch > 0)
+		chunk_unref(batch[--nbatch]);
+	last_output = ev_now();
+	if (!skip)
+		session_check_budget();
+	pty_update_want();
+}
+
+/* The latency budget ran out while output was being held back. */
+static void
+batch_expired(ATTRIBUTE_UNUSED struct timer *t)
+{
+	batch_flush(NULL);
+}
+
+/* Decide how much to ask the pty for, out of the left bytes the burst may
+** still read. The last read is the guide. When it filled all the room it
+** was given, there is probably more waiting, so the pty is asked how much
+** where it can tell. */
+static size_t
+pty_read_want(size_t left)
+{
+	size_t want = read_hint;
+#ifdef FIONREAD
+	int avail;
+
+	if (read_filled && ioctl(the_pty.fd, FIONREAD, &avail) == 0 &&
+	    (size_t)avail > want)
+		want = avail;
+#endif
+	return want < left ? want : left;
+}
+
+/* Read from the pty into the batch, filling the room left in its last chunk
+** before adding new ones, and taking no more than left bytes unless the
+** last chunk has more room than that. Returns what read returned. */
+static ssize_t
+pty_read(size_t left)
+{
+	struct iovec iov[MAX_BATCH];
+	size_t want = pty_read_want(left), room = 0, got;
+	ssize_t len;
+	int first = nbatch, n = 0, i;
+
+	/* Find room for the output. */
+	if (nbatch > 0 && batch[nbatch - 1]->len < BUFSIZE)
+	{
+		struct chunk *c = batch[--first];
+
+		iov[n].iov_base = c->data + c->len;
+		iov[n].iov_len = BUFSIZE - c->len;
+		room += iov[n++].iov_len;
+	}
+	while (room < want && nbatch < batch_max)
+	{
+		struct chunk *c = chunk_alloc();
+
+		if (!c)
+			break;
+		c->refs = 1;
+		batch[nbatch++] = c;
+		iov[n].iov_base = c->data;
+		iov[n].iov_len = BUFSIZE;
+		room += iov[n++].iov_len;
+	}
+	if (n == 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	len = readv(the_pty.fd, iov, n);
+	if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR))
+		pty_exit();
+
+	/* Take note of what came in, and give back the chunks that got
+	** none of it. */
+	got = len > 0 ? len : 0;
+	for (i = 0; i < n; ++i)
+	{
+		struct chunk *c = batch[first + i];
+		size_t part = got < iov[i].iov_len ? got : iov[i].iov_len;
+
+		if (part == 0)
+		{
+			if (c->len == 0)
+			{
+				chunk_free(c);
+				nbatch--;
+			}
+			continue;
+		}
+		if (replay)
+			replay_add(iov[i].iov_base, part);
+		log_write(LOG_OUTPUT, iov[i].iov_base, part);
+		if (the_screen)
+			screen_feed(the_screen, iov[i].iov_base, part);
+		if (nwaiting || nexpecting)
+			wait_feed(iov[i].iov_base, part);
+		c->len += part;
+		got -= part;
+	}
+	if (len > 0)
+	{
+		session_queued += len;
+		stats.pty_read += len;
+		hist_add(&stats.read_size, len);
+		read_filled = ((size_t)len == room);
+		read_hint = read_filled ? room * 2 : (size_t)len;
+	}
+	return len;
+}
+
+/* Process activity on the pty - Input and terminal changes are queued up
+** for the attached clients. If the pty goes away, we die.
+**
+** The pty is read in bursts, until it has been drained or read_burst bytes
+** have come in, and the clients are handed the output of a burst all at
+** once. A program that writes a lot costs one trip through the clients
+** per burst rather than one per read.
+**
+** With a latency budget, output may be held back over several bursts so
+** that the clients get it in larger pieces. Output that comes in after a
+** quiet spell is handed out as soon as the pty has been drained, so that
+** echoing typed characters is not delayed. Output that comes in within the
+** budget of the last handout is held until the budget runs out or the batch
+** has been filled. */
+static void
+pty_activity(struct watch *w)
+{
+	size_t burst = 0;
+	ssize_t len;
+	int drained = 0;
+
+#ifdef USE_SPLICE
+	if (splice_usable())
+	{
+		pty_splice(w);
+		return;
+	}
+#endif
+
+	while (burst < read_burst &&
+	       (nbatch < batch_max || batch[nbatch - 1]->len < BUFSIZE))
+	{
+		len = pty_read(read_burst - burst);
+		if (len <= 0)
+		{
+			drained = (len < 0 && errno == EAGAIN);
+			break;
+		}
+		burst += len;
+	}
+	if (drained && !pty_gone)
+		ev_clear(w, EV_READ);
+	if (burst > 0)
+		hist_add(&stats.burst_size, burst);
+	if (nbatch == 0)
+		return;
+
+	/* Without a latency budget, with a full batch, or once the program
+	** is gone, the output is handed out right away. Otherwise, dense
+	** output waits for the timer, and the rest waits until the pty has
+	** been drained. */
+	if (latency_budget == 0 || pty_gone ||
+	    (nbatch == batch_max && batch[nbatch - 1]->len == BUFSIZE))
+		batch_flush(NULL);
+	else if (batch_timer.pprev)
+		return;
+	else if (ev_now() - last_output < latency_budget)
+		ev_timer_set(&batch_timer, latency_budget);
+	else if (drained)
+		batch_flush(NULL);
+}
+
+/* Handle the event loop's report for the pty. */
+static void
+pty_event(struct watch *w)
+{
+	/* Write waiting input first. */
+	if (w->ready & w->want & EV_WRITE)
+		pty_input();
+	if (w->ready & w->want & EV_READ)
+		pty_activity(w);
+}
+
+/* Send a client the stats, in the Prometheus text format. */
+static void
+client_stats(struct client *p)
+{
+	struct text t = {NULL, 0, 0};
+	struct client *q;
+	unsigned long long paused, blocked, syscalls, async;
+	int nclients = 0, nring = 0;
+
+	for (q = clients; q; q = q->next)
+	{
+		nclients++;
+		nring += q->ring != 0;
+	}
+
+	stats_value(&t, "dtach_clients", "gauge",
+		    "Clients connected to the master.", nclients);
+	stats_value(&t, "dtach_attached_clients", "gauge",
+		    "Clients attached to the session.", nattached);
+	stats_value(&t, "dtach_connections_total", "counter",
+		    "Connections accepted.", stats.connections);
+	stats_value(&t, "dtach_pty_read_bytes_total", "counter",
+		    "Bytes read from the pty.", stats.pty_read);
+	stats_value(&t, "dtach_pty_written_bytes_total", "counter",
+		    "Bytes written to the pty.", stats.pty_written);
+	blocked = stats.pty_write_blocked;
+	if (input_since)
+		blocked += ev_now() - input_since;
+	stats_seconds(&t, "dtach_pty_write_blocked_seconds_total",
+		      "Time input spent waiting for the pty to take it.",
+		      blocked);
+	stats_value(&t, "dtach_input_held_total", "counter",
+		    "Times input had to wait for the pty to take it.",
+		    stats.input_held);
+	stats_value(&t, "dtach_input_queued_bytes", "gauge",
+		    "Input waiting for the pty to take it.", input_queued);
+	paused = stats.pty_paused;
+	if (stats.paused_since)
+		paused += ev_now() - stats.paused_since;
+	stats_seconds(&t, "dtach_pty_paused_seconds_total",
+		      "Time the pty was not read, waiting for clients.",
+		      paused);
+	stats_value(&t, "dtach_client_written_bytes_total", "counter",
+		    "Bytes written to clients.", stats.client_written);
+	stats_value(&t, "dtach_client_partial_writes_total", "counter",
+		    "Writes to clients that were cut short.",
+		    stats.partial_writes);
+	ev_counts(&syscalls, &async);
+	stats_value(&t, "dtach_loop_syscalls_total", "counter",
+		    "System calls made by the event loop to wait for events.",
+		    syscalls);
+	stats_value(&t, "dtach_async_writes_total", "counter",
+		    "Writes handed to the kernel without a system call.",
+		    async);
+	stats_header(&t, "dtach_event_backend", "gauge",
+		     "The event loop backend in use.");
+	text_printf(&t, "dtach_event_backend{backend=\"%s\"} 1\n",
+		    ev_backend());
+	stats_value(&t, "dtach_dropped_bytes_total", "counter",
+		    "Output thrown away for clients over their budget.",
+		    stats.dropped);
+	stats_value(&t, "dtach_evicted_clients_total", "counter",
+		    "Clients disconnected for being over their budget.",
+		    stats.evicted);
+	stats_value(&t, "dtach_session_queued_bytes", "gauge",
+		    "Output queued for all clients.", session_queued);
+	stats_value(&t, "dtach_clients_over_budget", "gauge",
+		    "Clients over their queue budget.", nover);
+	stats_value(&t, "dtach_ring_clients", "gauge",
+		    "Clients reading their output from the ring.", nring);
+	stats_value(&t, "dtach_ring_wakeups_total", "counter",
+		    "Wakeups sent to clients reading from the ring.",
+		    stats.ring_wakeups);
+	stats_value(&t, "dtach_ring_overruns_total", "counter",
+		    "Times a client fell so far behind that the ring was "
+		    "overwritten.", out_ring ? ring_overruns(out_ring) : 0);
+	stats_value(&t, "dtach_waiting_clients", "gauge",
+		    "Clients waiting for a pattern in the output.", nwaiting);
+	stats_value(&t, "dtach_expecting_clients", "gauge",
+		    "Clients collecting the output their input causes.",
+		    nexpecting);
+	stats_value(&t, "dtach_wait_matches_total", "counter",
+		    "Clients whose pattern turned up in the output.",
+		    stats.wait_matches);
+	stats_value(&t, "dtach_resize_requests_total", "counter",
+		    "Window sizes asked for by clients.",
+		    stats.resize_requests);
+	stats_value(&t, "dtach_pty_resizes_total", "counter",
+		    "Times the pty was resized.", stats.resizes);
+	stats_value(&t, "dtach_log_output_dropped_bytes_total", "counter",
+		    "Output that did not make it into the log.",
+		    log_dropped(LOG_OUTPUT));
+	stats_value(&t, "dtach_log_input_dropped_bytes_total", "counter",
+		    "Input that did not make it into the log.",
+		    log_dropped(LOG_INPUT));
+
+	stats_header(&t, "dtach_client_queued_bytes", "gauge",
+		     "Output queued for each attached client.");
+	for (q = clients; q; q = q->next)
+	{
+		if (q->attached)
+			text_printf(&t, "dtach_client_queued_bytes"
+				    "{client=\"%lu\"} %lu\n", q->id,
+				    (unsigned long)q->queued);
+	}
+
+	stats_histogram(&t, "dtach_pty_read_size_bytes",
+			"Sizes of reads from the pty.", &stats.read_size, 1);
+	stats_histogram(&t, "dtach_pty_burst_size_bytes",
+			"Output read from the pty before handing it out.",
+			&stats.burst_size, 1);
+	stats_histogram(&t, "dtach_fanout_seconds",
+			"Time taken to hand output to every client.",
+			&stats.fanout, 1e6);
+	stats_histogram(&t, "dtach_loop_seconds",
+			"Time taken by each pass of the event loop.",
+			&stats.loop, 1e6);
+	text_printf(&t, "# EOF\n");
+
+	if (t.buf)
+		client_send(p, t.buf, t.len);
+	free(t.buf);
+}
+
+/* Process a packet from a client. */
+static void
+client_packet(struct client *p, struct packet *pkt)
+{
+	/* Push out data to the program. */
+	if (pkt->type == MSG_PUSH)
+	{
+		if (pkt->len <= sizeof(pkt->u.buf))
+		{
+			log_write(LOG_INPUT, pkt->u.buf, pkt->len);
+			client_input(p, pkt->u.buf, pkt->len);
+		}
+	}
+
+	/* The client wants the stats. */
+	else if (pkt->type == MSG_STATS)
+		client_stats(p);
+
+	/* The client wants its output through the ring. The answer waits for
+	** whatever is already on its way to the client. */
+	else if (pkt->type == MSG_RING)
+	{
+		p->ring_asked = 1;
+		client_want(p, 1);
+	}
+
+	/* The client wants to know whether anyone is attached. */
+	else if (pkt->type == MSG_STATUS)
+	{
+		struct packet reply;
+
+		memset(&reply, 0, sizeof(struct packet));
+		reply.type = MSG_STATUS;
+		reply.len = nattached < 255 ? nattached : 255;
+		client_send(p, &reply, sizeof(struct packet));
+	}
+
+	/* The client wants to know whether we understand framed messages. */
+	else if (pkt->type == MSG_HELLO)
+	{
+		struct packet reply;
+
+		memset(&reply, 0, sizeof(struct packet));
+		reply.type = MSG_HELLO;
+		reply.len = pkt->len < PROTOCOL_FRAMED ? pkt->len :
+			PROTOCOL_FRAMED;
+		client_send(p, &reply, sizeof(struct packet));
+	}
+	/* ...and it is switching over to them. */
+	else if (pkt->type == MSG_FRAMED)
+	{
+		if (pkt->len == PROTOCOL_FRAMED && !p->framed)
+		{
+			p->ibuf = malloc(sizeof(struct frame) + MAX_FRAME);
+			if (p->ibuf)
+				p->framed = 1;
+		}
+	}
+
+	/* Attach or detach from the program. */
+	else if (pkt->type == MSG_ATTACH)
+	{
+		if (!p->attached)
+		{
+			/* Output held back is older than the replay. */
+			if (nbatch > 0)
+				batch_flush(p);
+			nattached++;
+			p->attach_seq = ++nattaches;
+			if (size_policy != SIZE_LATEST)
+				resize_later();
+			if (p->ring)
+				ring_start(p);
+			else
+			{
+				if (replay)
+					replay_start(p);
+#ifdef USE_SPLICE
+				client_open_pipe(p);
+#endif
+			}
+		}
+		p->attached = 1;
+
+		/* Start reading from the pty if we were waiting for this. */
+		waiting_for_attach = 0;
+		pty_update_want();
+	}
+	else if (pkt->type == MSG_DETACH)
+	{
+		if (p->attached)
+		{
+			nattached--;
+			if (size_policy != SIZE_LATEST)
+				resize_later();
+		}
+		p->attached = 0;
+
+		/* Anything still queued is of no use to a detached client. */
+		client_clear_queue(p);
+		p->rpos = p->rend;
+#ifdef USE_SPLICE
+		client_close_pipe(p);
+#endif
+		pty_update_want();
+	}
+
+	/* Window size change request, without a forced redraw. These come
+	** in storms while a window is being resized, so the pty is only
+	** resized once they settle. */
+	else if (pkt->type == MSG_WINCH)
+	{
+		client_set_size(p, &pkt->u.ws);
+		resize_later();
+	}
+
+	/* Force a redraw using a particular method. */
+	else if (pkt->type == MSG_REDRAW)
+	{
+		int method = pkt->len;
+
+		/* If the client didn't specify a particular method, use
+		** whatever we had on startup. */
+		if (method == REDRAW_UNSPEC)
+			method = redraw_method;
+		/* Without a screen model, fall back to the default method. */
+		if (method == REDRAW_SNAPSHOT && !the_screen)
+			method = REDRAW_CTRL_L;
+		if (method == REDRAW_NONE)
+			return;
+
+		/* Set the window size. The redraw has to see it, so it
+		** can't wait. */
+		client_set_size(p, &pkt->u.ws);
+		pty_resize();
+
+		/* Send a ^L character if the terminal is in no-echo and
+		** character-at-a-time mode. */
+		if (method == REDRAW_CTRL_L)
+		{
+			char c = '\f';
+
+			if (pty_get_term() == 0 &&
+			    ((the_pty.term.c_lflag & (ECHO|ICANON)) == 0) &&
+			    (the_pty.term.c_cc[VMIN] == 1))
+			{
+				client_input(p, &c, 1);
+			}
+		}
+		/* Send a WINCH signal to the program. */
+		else if (method == REDRAW_WINCH)
+		{
+			killpty(&the_pty, SIGWINCH);
+		}
+		/* Paint the screen for the client ourselves. */
+		else if (method == REDRAW_SNAPSHOT)
+		{
+			/* Output held back is already part of the
+			** screen. */
+			if (nbatch > 0)
+				batch_flush(p);
+			if (p->attached)
+				client_snapshot(p);
+		}
+	}
+}
+
+/* Handle the complete frames a client has sent. Handling stops early when
+** the client's input has to wait for room in the pty, and picks up from
+** there once it has been written. */
+static void
+client_handle_frames(struct client *p)
+{
+	size_t off = 0;
+
+	while (p->ilen - off >= sizeof(struct frame) && !p->input)
+	{
+		struct frame *f = (struct frame *)(p->ibuf + off);
+		unsigned char *payload = p->ibuf + off + sizeof(struct frame);
+		size_t flen = FRAME_LEN(f);
+
+		if (flen > MAX_FRAME)
+		{
+			client_close(p);
+			return;
+		}
+		if (p->ilen - off < sizeof(struct frame) + flen)
+			break;
+
+		if (f->type == MSG_PUSH)
+		{
+			log_write(LOG_INPUT, payload, flen);
+			client_input(p, payload, flen);
+		}
+		else if (f->type == MSG_WAIT)
+			client_wait(p, payload, flen);
+		else if (f->type == MSG_EXPECT)
+			client_expect(p, payload, flen);
+		else if (flen == sizeof(struct packet))
+		{
+			struct packet pkt;
+
+			memcpy(&pkt, payload, sizeof(struct packet));
+			client_packet(p, &pkt);
+		}
+		off += sizeof(struct frame) + flen;
+	}
+
+	/* Keep the partial frame for later. */
+	if (off > 0)
+	{
+		memmove(p->ibuf, p->ibuf + off, p->ilen - off);
+		p->ilen -= off;
+	}
+}
+
+/* Read framed messages from a client. */
+static void
+client_frames(struct client *p)
+{
+	ssize_t len;
 
-	/* Make sure stdin/stdout/stderr point to /dev/null. We are now a
-	** daemon. */
-	nullfd = open("/dev/null", O_RDWR);
-	dup2(nullfd, 0);
-	dup2(nullfd, 1);
-	dup2(nullfd, 2);
-	if (nullfd > 2)
-		close(nullfd);
+	len = read(p->fd, p->ibuf + p->ilen,
+		   sizeof(struct frame) + MAX_FRAME - p->ilen);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		if (errno == EAGAIN)
+			ev_clear(&p->w, EV_READ);
+		return;
+	}
+	else if (len <= 0)
+	{
+		client_close(p);
+		return;
+	}
+	p->ilen += len;
+	client_handle_frames(p);
+}
 
-	/* Loop forever. */
-	while (1)
+/* A client's input made it to the pty, so carry on with what it sent after
+** it. */
+static void
+client_resume(struct client *p)
+{
+	if (p->framed)
+		client_handle_frames(p);
+}
+
+/* Process activity from a client. */
+static void
+client_activity(struct client *p)
+{
+	ssize_t len;
+	struct packet pkt;
+
+	if (p->framed)
 	{
-		int new_has_attached_client = 0;
+		client_frames(p);
+		return;
+	}
+
+	/* Read the activity. One packet is handled at a time, so that a busy
+	** client can't starve the others. */
+	len = read(p->fd, &pkt, sizeof(struct packet));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		if (errno == EAGAIN)
+			ev_clear(&p->w, EV_READ);
+		return;
+	}
 
-		/* Re-initialize the file descriptor set for select. */
-		FD_ZERO(&readfds);
-		FD_SET(s, &readfds);
-		highest_fd = s;
+	/* Close the client on an error. */
+	if (len != sizeof(struct packet))
+	{
+		client_close(p);
+		return;
+	}
+	client_packet(p, &pkt);
+}
+
+/* Handle the event loop's report for a client. */
+static void
+client_event(struct watch *w)
+{
+	struct client *p = w->data;
 
-		/*
-		** When waitattach is set, wait until the client attaches
-		** before trying to read from the pty.
-		*/
-		if (waitattach)
+	/* Write out queued output first. */
+	if (w->ready & w->want & EV_WRITE)
+	{
+		if (client_flush(p) < 0)
 		{
-			if (clients && clients->attached)
-				waitattach = 0;
+			client_close(p);
+			pty_update_want();
+			return;
 		}
+		pty_update_want();
+	}
+	if (w->ready & w->want & EV_READ)
+		client_activity(p);
+}
+
+/* Process activity on the control socket */
+static void
+control_activity(struct watch *w)
+{
+	int fd;
+	struct client *p;
+
+	/* Accept the new client and link it in. */
+	fd = accept(w->fd, NULL, NULL);
+	if (fd < 0)
+	{
+		/* Anything but a transient error means there is nobody left to
+		** accept until the next connection comes in. */
+		if (errno != EINTR && errno != ECONNABORTED)
+			ev_clear(w, EV_READ);
+		return;
+	}
+	else if (setnonblocking(fd) < 0 ||
+		 (SOCKET_ABSTRACT(sockname) && !peer_allowed(fd)))
+	{
+		close(fd);
+		return;
+	}
+
+	/* Link it in. */
+	p = malloc(sizeof(struct client));
+	if (!p)
+	{
+		close(fd);
+		return;
+	}
+	memset(p, 0, sizeof(struct client));
+	p->fd = fd;
+	p->id = ++stats.connections;
+#ifdef USE_SPLICE
+	p->pipe[0] = p->pipe[1] = -1;
+#endif
+	p->w.fd = fd;
+	p->w.handler = client_event;
+	p->w.data = p;
+	if (ev_add(&p->w) < 0)
+	{
+		close(fd);
+		free(p);
+		return;
+	}
+	client_want(p, 0);
+	p->pprev = &clients;
+	p->next = *(p->pprev);
+	if (p->next)
+		p->next->pprev = &p->next;
+	*(p->pprev) = p;
+}
+
+/* Start the program on a pty. */
+#ifdef USE_HOST
+/* What a warm session's child is sent to run its program: the umask, and
+** the number of arguments and environment variables. It is followed by len
+** bytes of strings: the directory to run the program in, the arguments and
+** the environment. */
+struct warm_request
+{
+	unsigned int umask, argc, envc, len;
+};
+
+/* The child of a warm session. It waits on the session's pty until the
+** session is asked for, and then runs the program it is sent over chan,
+** reporting failure there. */
+static void
+warm_child(int chan)
+{
+	struct warm_request r;
+	char *strings, *pos, **v;
+	unsigned int i;
+
+	setsid();
+	if (ioctl(warm_slave, TIOCSCTTY, NULL) < 0)
+		_exit(1);
+	dup2(warm_slave, 0);
+	dup2(warm_slave, 1);
+	dup2(warm_slave, 2);
+	host_child_reset(chan);
+
+	/* Nothing comes if the daemon goes away first. */
+	if (read_all(chan, &r, sizeof(r)) < 0)
+		_exit(1);
+	strings = malloc(r.len + 1);
+	v = malloc((r.argc + r.envc + 2) * sizeof(char *));
+	if (!strings || !v || read_all(chan, strings, r.len) < 0)
+		_exit(1);
+	strings[r.len] = '\0';
+
+	host_cwd = strings;
+	pos = strings + strlen(strings) + 1;
+	for (i = 0; i < r.argc + r.envc + 2; ++i)
+	{
+		if (i == r.argc || i == r.argc + r.envc + 1 ||
+		    pos >= strings + r.len)
+			v[i] = NULL;
 		else
 		{
-			FD_SET(the_pty.fd, &readfds);
-			if (the_pty.fd > highest_fd)
-				highest_fd = the_pty.fd;
+			v[i] = pos;
+			pos += strlen(pos) + 1;
 		}
+	}
+	if (!v[0])
+		_exit(1);
+	host_env = v + r.argc + 1;
+	host_umask = r.umask;
+	host_child(chan);
+	pty_exec(v, chan);
+}
 
-		for (p = clients; p; p = p->next)
-		{
-			FD_SET(p->fd, &readfds);
-			if (p->fd > highest_fd)
-				highest_fd = p->fd;
+/* Add a string to a warm request. */
+static char *
+warm_add(char *pos, const char *str)
+{
+	size_t len = strlen(str) + 1;
 
-			if (p->attached)
-				new_has_attached_client = 1;
-		}
+	memcpy(pos, str, len);
+	return pos + len;
+}
+
+/* Tell the child of a warm session what to run, and wait until it is
+** running. Anything the child has to say goes to statusfd. */
+static void
+warm_start(char **argv, int statusfd)
+{
+	struct warm_request r;
+	char *buf, *pos, **v, msg[1024];
+	ssize_t len;
+
+	/* The pty takes on the settings of whoever asked for the
+	** session. */
+	the_pty.term = orig_term;
+	if (!dont_have_tty)
+		tcsetattr(warm_slave, TCSANOW, &the_pty.term);
+#ifdef BROKEN_MASTER
+	the_pty.slave = warm_slave;
+#else
+	close(warm_slave);
+#endif
+	warm_slave = -1;
+
+	r.umask = host_umask;
+	r.len = strlen(host_cwd) + 1;
+	for (r.argc = 0; argv[r.argc]; ++r.argc)
+		r.len += strlen(argv[r.argc]) + 1;
+	for (r.envc = 0; host_env[r.envc]; ++r.envc)
+		r.len += strlen(host_env[r.envc]) + 1;
+	buf = malloc(sizeof(r) + r.len);
+	if (!buf)
+		master_fail(statusfd, "%s: Out of memory.\n", progname);
+	memcpy(buf, &r, sizeof(r));
+	pos = warm_add(buf + sizeof(r), host_cwd);
+	for (v = argv; *v; ++v)
+		pos = warm_add(pos, *v);
+	for (v = host_env; *v; ++v)
+		pos = warm_add(pos, *v);
+
+	for (pos = buf; pos < buf + sizeof(r) + r.len; pos += len)
+	{
+		len = write(warm_chan, pos, buf + sizeof(r) + r.len - pos);
+		if (len < 0 && errno == EINTR)
+			len = 0;
+		else if (len < 0)
+			master_fail(statusfd, "%s: The program could not be "
+				    "started: %s\n", progname,
+				    strerror(errno));
+	}
+	free(buf);
+
+	/* The connection is closed once the program is running. */
+	while ((len = read(warm_chan, msg, sizeof(msg))) != 0)
+	{
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 || write(statusfd, msg, len) < 0)
+			break;
+	}
+	close(warm_chan);
+	warm_chan = -1;
+}
+#endif
+
+static void
+session_pty(char **argv, int statusfd)
+{
+#ifdef USE_HOST
+	if (warm)
+	{
+		warm_start(argv, statusfd);
+		return;
+	}
+#endif
+	if (init_pty(argv, statusfd) < 0)
+	{
+		if (errno == ENOENT)
+			master_fail(statusfd, "%s: Could not find a pty.\n",
+				    progname);
+		master_fail(statusfd, "%s: init_pty: %s\n", progname,
+			    strerror(errno));
+	}
+}
+
+/* Set up everything else the session needs before clients come in. */
+static void
+session_setup(int statusfd)
+{
+	int i;
+
+	/* Set up the event loop, unless the session was made ready ahead of
+	** time. */
+#ifdef USE_HOST
+	if (!warm && ev_init() < 0)
+#else
+	if (ev_init() < 0)
+#endif
+		master_fail(statusfd, "%s: ev_init: %s\n", progname,
+			    strerror(errno));
+
+	/* Allocate the replay ring. */
+	if (replay_size > 0)
+	{
+		replay = malloc(replay_size);
+		if (!replay)
+			master_fail(statusfd, "%s: Could not allocate the "
+				    "replay buffer.\n", progname);
+	}
+
+	/* A burst fills at most batch_max chunks. */
+	batch_max = (read_burst + BUFSIZE - 1) / BUFSIZE;
+	if (batch_max < 1)
+		batch_max = 1;
+	else if (batch_max > MAX_BATCH)
+		batch_max = MAX_BATCH;
+
+	/* Keep track of the screen if it may have to be redrawn from it. */
+	if (redraw_method == REDRAW_SNAPSHOT)
+	{
+		the_screen = screen_new(the_pty.ws.ws_row, the_pty.ws.ws_col);
+		if (!the_screen)
+			master_fail(statusfd, "%s: Could not allocate the "
+				    "screen model.\n", progname);
+	}
+
+#ifdef USE_SPLICE
+	/* Output can only stay in the kernel if nothing in the master needs
+	** to look at it. */
+	if (zero_copy && !replay && !the_screen && !log_path[LOG_OUTPUT])
+		splice_init();
+#endif
+
+	/* Open the logs. They are written by a thread of their own. */
+	for (i = 0; i < LOG_STREAMS; ++i)
+	{
+		if (log_path[i] && log_open(i, log_path[i],
+					    log_rotate_size) < 0)
+			master_fail(statusfd, "%s: %s: %s\n", progname,
+				    log_path[i], strerror(errno));
+	}
+	if ((log_path[LOG_OUTPUT] || log_path[LOG_INPUT]) && log_start() < 0)
+		master_fail(statusfd, "%s: Could not start logging: %s\n",
+			    progname, strerror(errno));
+}
+
+/* Serve the clients of the session until the program goes away. */
+static void
+session_loop(int s, int waitattach)
+{
+	unsigned long long start;
+	int has_attached_client = 0;
 
+	/* Watch the control socket and the pty. When waitattach is set, wait
+	** until the client attaches before trying to read from the pty. */
+	control_watch.fd = s;
+	control_watch.handler = control_activity;
+	if (ev_add(&control_watch) < 0)
+		master_exit(1);
+	ev_want(&control_watch, EV_READ);
+
+	the_pty.w.fd = the_pty.fd;
+	the_pty.w.handler = pty_event;
+	if (setnonblocking(the_pty.fd) < 0 || ev_add(&the_pty.w) < 0)
+		master_exit(1);
+	waiting_for_attach = waitattach;
+	pty_update_want();
+	batch_timer.handler = batch_expired;
+	resize_timer.handler = resize_expired;
+	drain_timer.handler = drain_expired;
+	stats.read_size.unit = 16;
+	stats.burst_size.unit = 16;
+	stats.fanout.unit = 1;
+	stats.loop.unit = 1;
+
+	/* Loop forever. */
+	while (1)
+	{
 		/* chmod the socket if necessary. */
-		if (has_attached_client != new_has_attached_client)
+		if (has_attached_client != (nattached > 0))
 		{
-			update_socket_modes(new_has_attached_client);
-			has_attached_client = new_has_attached_client;
+			has_attached_client = (nattached > 0);
+			update_socket_modes(has_attached_client);
 		}
 
-		/* Wait for something to happen. */
-		if (select(highest_fd + 1, &readfds, NULL, NULL, NULL) < 0)
+		/* Wait for something to happen, unless there is still work
+		** left over from the last pass. */
+		if (ev_wait(ev_pending() ? 0 : -1) < 0)
 		{
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
-			exit(1);
+			master_exit(1);
 		}
+		start = ev_now();
+		ev_dispatch();
+		hist_add(&stats.loop, ev_now() - start);
+		registry_update(nattached, stats.pty_read);
+
+		/* Once the program is gone, wait only for its output to be
+		** written out. */
+		if (pty_gone && session_drained())
+			session_end();
+	}
+}
 
-		/* New client? */
-		if (FD_ISSET(s, &readfds))
-			control_activity(s);
-		/* Activity on a client? */
-		for (p = clients; p; p = next)
-		{
-			next = p->next;
-			if (FD_ISSET(p->fd, &readfds))
-				client_activity(p);
-		}
-		/* pty activity? */
-		if (FD_ISSET(the_pty.fd, &readfds))
-			pty_activity(s);
+#ifdef USE_HOST
+/* Let go of everything the session holds. Only a hosted session needs to,
+** since the master of a single session just exits. */
+static void
+session_free(void)
+{
+	unlink_socket();
+	registry_remove();
+	while (clients)
+		client_close(clients);
+	if (control_watch.handler)
+		ev_del(&control_watch);
+	close(control_watch.fd);
+	if (the_pty.w.handler)
+		ev_del(&the_pty.w);
+	if (the_pty.pid > 0)
+		close(the_pty.fd);
+	log_close();
+	ev_timer_cancel(&batch_timer);
+	ev_timer_cancel(&resize_timer);
+	ev_timer_cancel(&drain_timer);
+	while (nbatch > 0)
+		chunk_unref(batch[--nbatch]);
+	ring_free(out_ring);
+	out_ring = NULL;
+	matcher_free(the_matcher);
+	the_matcher = NULL;
+	free(replay);
+	screen_free(the_screen);
+#ifdef USE_SPLICE
+	if (splice_pipe[0] >= 0)
+		splice_shutdown();
+#endif
+	while (spare_chunks)
+	{
+		struct chunk *c = spare_chunks;
+
+		spare_chunks = c->next;
+		free(c);
+	}
+	ev_close();
+}
+#endif
+
+/* The master process - It watches over the pty process and the attached */
+/* clients. */
+static void
+master_process(int s, char **argv, int waitattach, int statusfd)
+{
+	int nullfd;
+
+	/* Okay, disassociate ourselves from the original terminal, as we
+	** don't care what happens to it. */
+	setsid();
+
+	/* Set a trap to unlink the socket when we die. */
+	atexit(unlink_socket);
+
+	/* Create a pty in which the process is running. */
+	signal(SIGCHLD, die);
+	session_pty(argv, statusfd);
+
+	/* Set up some signals. */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGXFSZ, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+	signal(SIGINT, die);
+	signal(SIGTERM, die);
+
+	session_setup(statusfd);
+	atexit(log_close);
+	registry_add(argv, the_pty.pid);
+	atexit(registry_remove);
+
+	/* Close statusfd, since we don't need it anymore. */
+	if (statusfd != -1)
+		close(statusfd);
+
+	/* Make sure stdin/stdout/stderr point to /dev/null. We are now a
+	** daemon. */
+	nullfd = open("/dev/null", O_RDWR);
+	dup2(nullfd, 0);
+	dup2(nullfd, 1);
+	dup2(nullfd, 2);
+	if (nullfd > 2)
+		close(nullfd);
+
+	session_loop(s, waitattach);
+}
+
+#ifdef USE_HOST
+/* Run a session on a thread of the host daemon. The session's options have
+** already been set up on this thread. Its program is started in cwd with
+** the environment env and the umask mask, like it would have been if the
+** master had been started by whoever asked for it. */
+void
+master_hosted(int s, char **argv, int waitattach, int statusfd,
+	      const char *cwd, char **env, mode_t mask)
+{
+	hosted = 1;
+	host_cwd = cwd;
+	host_env = env;
+	host_umask = mask;
+	if (redraw_method == REDRAW_UNSPEC)
+		redraw_method = REDRAW_CTRL_L;
+	control_watch.fd = s;
+
+	session_pty(argv, statusfd);
+	session_setup(statusfd);
+	registry_add(argv, the_pty.pid);
+	close(statusfd);
+	if (warm)
+		host_session_started();
+	session_loop(s, waitattach);
+}
+
+/* Let go of a warm session that is not going to be used after all. Its
+** child goes away once its connection is closed. */
+void
+master_unwarm(void)
+{
+	if (!warm)
+		return;
+	close(warm_chan);
+	close(warm_slave);
+	close(the_pty.fd);
+	warm_chan = warm_slave = -1;
+	warm = 0;
+	ev_close();
+}
+
+/* Get a session of the host daemon ready before anyone asks for it, on the
+** thread that is to run it: its event loop, its pty, and the child that is
+** to run its program, waiting on the pty. When the session is asked for,
+** master_hosted only has to tell the child what to run. Returns -1 if the
+** session could not be made ready, in which case there is nothing to clean
+** up. */
+int
+master_warm(void)
+{
+#ifdef TIOCSCTTY
+	int chan[2];
+
+	if (ev_init() < 0)
+		return -1;
+	if (openpty(&the_pty.fd, &warm_slave, NULL, NULL, NULL) < 0)
+		goto fail_ev;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan) < 0)
+		goto fail_pty;
+
+	/* The child's end closes when it executes the program. */
+	fcntl(chan[0], F_SETFD, FD_CLOEXEC);
+	fcntl(chan[1], F_SETFD, FD_CLOEXEC);
+	the_pty.pid = fork();
+	if (the_pty.pid < 0)
+	{
+		close(chan[0]);
+		close(chan[1]);
+		goto fail_pty;
 	}
+	else if (the_pty.pid == 0)
+		warm_child(chan[1]);
+	close(chan[1]);
+	warm_chan = chan[0];
+	warm = 1;
+	return 0;
+
+fail_pty:
+	close(the_pty.fd);
+	close(warm_slave);
+	warm_slave = -1;
+fail_ev:
+	ev_close();
+	return -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
 }
+#endif
 
 int
 master_main(char **argv, int waitattach, int dontfork)
@@ -579,32 +3159,6 @@ master_main(char **argv, int waitattach, int dontfork)
 
 	/* Create the unix domain socket. */
 	s = create_socket(sockname);
-	if (s < 0 && errno == ENAMETOOLONG)
-	{
-		char *slash = strrchr(sockname, '/');
-
-		/* Try to shorten the socket's path name by using chdir. */
-		if (slash)
-		{
-			int dirfd = open(".", O_RDONLY);
-
-			if (dirfd >= 0)
-			{
-				*slash = '\0';
-				if (chdir(sockname) >= 0)
-				{
-					s = create_socket(slash + 1);
-					if (s >= 0 && fchdir(dirfd) < 0)
-					{
-						close(s);
-						s = -1;
-					}
-				}
-				*slash = '/';
-				close(dirfd);
-			}
-		}
-	}
 	if (s < 0)
 	{
 		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
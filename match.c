@@ -0,0 +1,271 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** Looking for patterns in the output of the program, for the clients that
+** wait for one (dtach -w). The master feeds the matcher everything the
+** program prints, and the matcher notes which patterns turned up.
+**
+** Clients waiting for the same pattern share it, so it is only looked for
+** once. The patterns are kept in groups by their first byte, and the output
+** is scanned for each first byte with memchr, which the C library does a
+** word or a vector register at a time. Only where it stops are the patterns
+** of the group compared, so a session with hundreds of waiters mostly costs
+** one fast scan of its output per distinct first byte. The last bytes of
+** the output are kept, so that a pattern split across two reads is still
+** found, but a pattern only counts if it starts in output that came after
+** it was asked for.
+*/
+
+struct pattern
+{
+	/* The next pattern with the same first byte. */
+	struct pattern *next;
+	/* The number of clients waiting for the pattern. */
+	int refs;
+	/* Set once the pattern has turned up in the output, along with where
+	** it ended in the piece of output it was found in. */
+	int matched;
+	size_t end;
+	/* How much output had been fed when the pattern was asked for. */
+	unsigned long long start;
+	size_t len;
+	unsigned char str[MATCH_MAX];
+};
+
+struct matcher
+{
+	/* The patterns, by their first byte, and the first bytes that have
+	** patterns, in no particular order. */
+	struct pattern *groups[256];
+	unsigned char firsts[256];
+	int nfirsts;
+	/* The length of the longest pattern. */
+	size_t maxlen;
+	/* The end of the output so far, up to MATCH_MAX - 1 bytes, and how
+	** much output has been fed. */
+	unsigned char tail[MATCH_MAX - 1];
+	size_t tail_len;
+	unsigned long long fed;
+};
+
+/* Create a matcher with no patterns. */
+struct matcher *
+matcher_new(void)
+{
+	return calloc(1, sizeof(struct matcher));
+}
+
+/* Free a matcher and all of its patterns. */
+void
+matcher_free(struct matcher *m)
+{
+	int i;
+
+	if (!m)
+		return;
+	for (i = 0; i < m->nfirsts; ++i)
+	{
+		struct pattern *pat = m->groups[m->firsts[i]], *next;
+
+		for (; pat; pat = next)
+		{
+			next = pat->next;
+			free(pat);
+		}
+	}
+	free(m);
+}
+
+/* Get the pattern str for a new waiter, sharing it with the others waiting
+** for the same thing since the same point in the output. Returns NULL if
+** there is no memory for it. */
+struct pattern *
+pattern_get(struct matcher *m, const unsigned char *str, size_t len)
+{
+	struct pattern *pat;
+
+	if (len == 0 || len > MATCH_MAX)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	for (pat = m->groups[str[0]]; pat; pat = pat->next)
+	{
+		if (!pat->matched && pat->len == len &&
+		    pat->start == m->fed && memcmp(pat->str, str, len) == 0)
+		{
+			pat->refs++;
+			return pat;
+		}
+	}
+
+	pat = malloc(sizeof(struct pattern));
+	if (!pat)
+		return NULL;
+	pat->refs = 1;
+	pat->matched = 0;
+	pat->start = m->fed;
+	pat->len = len;
+	memcpy(pat->str, str, len);
+	if (!m->groups[str[0]])
+		m->firsts[m->nfirsts++] = str[0];
+	pat->next = m->groups[str[0]];
+	m->groups[str[0]] = pat;
+	if (len > m->maxlen)
+		m->maxlen = len;
+	return pat;
+}
+
+/* A waiter is done with a pattern. */
+void
+pattern_put(struct matcher *m, struct pattern *pat)
+{
+	struct pattern **pp;
+	int i;
+
+	if (--pat->refs > 0)
+		return;
+	for (pp = &m->groups[pat->str[0]]; *pp != pat; pp = &(*pp)->next)
+		;
+	*pp = pat->next;
+	if (!m->groups[pat->str[0]])
+	{
+		for (i = 0; m->firsts[i] != pat->str[0]; ++i)
+			;
+		m->firsts[i] = m->firsts[--m->nfirsts];
+	}
+	free(pat);
+
+	/* Without patterns, the output is not fed, so the tail would go
+	** stale. */
+	if (m->nfirsts == 0)
+		m->tail_len = 0;
+
+	/* The tail only has to cover the longest pattern left. */
+	m->maxlen = 0;
+	for (i = 0; i < m->nfirsts; ++i)
+	{
+		for (pat = m->groups[m->firsts[i]]; pat; pat = pat->next)
+		{
+			if (pat->len > m->maxlen)
+				m->maxlen = pat->len;
+		}
+	}
+}
+
+/* Whether the pattern has turned up in the output. */
+int
+pattern_matched(struct pattern *pat)
+{
+	return pat->matched;
+}
+
+/* Where the pattern ended in the piece of output it turned up in. */
+size_t
+pattern_end(struct pattern *pat)
+{
+	return pat->end;
+}
+
+/* Look for the patterns in the len bytes of buf, the first old of which
+** were looked at before, so only the patterns that end after them count.
+** base is where buf starts in the output, for telling whether a pattern
+** starts after it was asked for. Returns the number of patterns found. */
+static int
+matcher_scan(struct matcher *m, const unsigned char *buf, size_t len,
+	     size_t old, unsigned long long base)
+{
+	int i, found = 0;
+
+	for (i = 0; i < m->nfirsts; ++i)
+	{
+		const unsigned char *p = buf, *end = buf + len;
+		int left = 0;
+		struct pattern *pat;
+
+		for (pat = m->groups[m->firsts[i]]; pat; pat = pat->next)
+			left += !pat->matched;
+
+		while (left > 0 && p < end &&
+		       (p = memchr(p, m->firsts[i], end - p)) != NULL)
+		{
+			for (pat = m->groups[m->firsts[i]]; pat;
+			     pat = pat->next)
+			{
+				if (pat->matched ||
+				    pat->len > (size_t)(end - p) ||
+				    (size_t)(p - buf) + pat->len <= old ||
+				    base + (p - buf) < pat->start ||
+				    memcmp(p + 1, pat->str + 1, pat->len - 1))
+					continue;
+				pat->matched = 1;
+				pat->end = (p - buf) + pat->len - old;
+				found++;
+				left--;
+			}
+			p++;
+		}
+	}
+	return found;
+}
+
+/* Look for the patterns in the next piece of output. Returns the number of
+** patterns that turned up, which pattern_matched then tells apart. */
+int
+matcher_feed(struct matcher *m, const unsigned char *buf, size_t len)
+{
+	unsigned char joint[2 * (MATCH_MAX - 1)];
+	size_t keep, head, drop;
+	int found = 0;
+
+	/* Output from before anyone was waiting is of no interest. */
+	if (m->nfirsts == 0)
+		m->tail_len = 0;
+	if (m->nfirsts == 0 || len == 0)
+		return 0;
+
+	/* The patterns that start in the tail and end in buf. */
+	if (m->tail_len > 0)
+	{
+		head = m->maxlen - 1 < len ? m->maxlen - 1 : len;
+		memcpy(joint, m->tail, m->tail_len);
+		memcpy(joint + m->tail_len, buf, head);
+		found += matcher_scan(m, joint, m->tail_len + head,
+				      m->tail_len, m->fed - m->tail_len);
+	}
+	found += matcher_scan(m, buf, len, 0, m->fed);
+	m->fed += len;
+
+	/* Keep the end of the output for next time. */
+	keep = m->maxlen - 1;
+	if (len >= keep)
+	{
+		memcpy(m->tail, buf + len - keep, keep);
+		m->tail_len = keep;
+	}
+	else
+	{
+		drop = m->tail_len + len > keep ? m->tail_len + len - keep : 0;
+		memmove(m->tail, m->tail + drop, m->tail_len - drop);
+		memcpy(m->tail + m->tail_len - drop, buf, len);
+		m->tail_len += len - drop;
+	}
+	return found;
+}
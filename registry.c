@@ -0,0 +1,400 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** The session registry. Every master takes a slot in a file that all of a
+** user's masters map, and keeps what it is up to there, so that dtach -l can
+** list the sessions by reading one file instead of probing sockets.
+**
+** A slot is claimed by swapping the pid of its master into it, and given
+** back by storing 0. Only the master that owns a slot writes to it, and it
+** bumps the slot's generation before and after doing so. Readers take a copy
+** of a slot and keep it only if the generation was even, and the same
+** before and after, so that nobody ever has to take a lock. A slot whose
+** master has died is taken over by the next master to need one, or cleaned
+** up by dtach -l.
+*/
+#if defined(HAVE_MMAP)
+#define USE_REGISTRY
+#include <sys/mman.h>
+
+/* The number of slots in the registry. */
+#define REGISTRY_SLOTS	4096
+/* Tells a registry file from anything else. */
+#define REGISTRY_MAGIC	0x64746368
+#define REGISTRY_VERSION 1
+
+struct slot
+{
+	/* The pid of the master that owns the slot, or 0 when it is free. */
+	int owner;
+	/* Odd while the owner is writing to the slot. */
+	unsigned int gen;
+	/* The program's pid, and the number of attached clients. */
+	int pid;
+	int attached;
+	/* The output read from the program so far. */
+	unsigned long long output;
+	/* When the session started, and last saw output or a client come or
+	** go, in seconds since the epoch. */
+	long long started;
+	long long active;
+	char sockname[352];
+	char command[112];
+};
+
+struct registry
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int nslots;
+	/* One past the highest slot that was ever claimed. */
+	unsigned int high;
+	char pad[sizeof(struct slot) - 4 * sizeof(unsigned int)];
+	struct slot slots[REGISTRY_SLOTS];
+};
+
+/* The registry, mapped once for the whole process. */
+static struct registry *registry;
+/* The slot of the session. */
+static SESSION_LOCAL struct slot *my_slot;
+
+/* Work out where the registry of the user lives. */
+static void
+registry_path(char *buf, size_t len)
+{
+	const char *dir = getenv("DTACH_REGISTRY");
+
+	if (dir && *dir)
+	{
+		snprintf(buf, len, "%s", dir);
+		return;
+	}
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (dir && *dir)
+		snprintf(buf, len, "%s/dtach.registry", dir);
+	else
+		snprintf(buf, len, "/tmp/dtach-%u.registry",
+			 (unsigned int)geteuid());
+}
+
+/* Map the registry, creating it if need be. Returns NULL with errno set on
+** failure. */
+static struct registry *
+registry_map(void)
+{
+	struct registry *r = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+	struct registry *expect = NULL;
+	unsigned int zero = 0;
+	char path[4096];
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (r)
+		return r;
+	registry_path(path, sizeof(path));
+#ifdef O_NOFOLLOW
+	fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+#else
+	fd = open(path, O_RDWR|O_CREAT, 0600);
+#endif
+	if (fd < 0)
+		return NULL;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	/* Anyone who could write to it could make a mess of the list. */
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & 022))
+	{
+		close(fd);
+		errno = EACCES;
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(struct registry) &&
+	    ftruncate(fd, sizeof(struct registry)) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, sizeof(struct registry), PROT_READ|PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+	r = p;
+
+	/* Whoever gets there first sets the header up. */
+	if (__atomic_compare_exchange_n(&r->magic, &zero, REGISTRY_MAGIC, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		r->version = REGISTRY_VERSION;
+		r->nslots = REGISTRY_SLOTS;
+	}
+	else if (zero != REGISTRY_MAGIC || r->version != REGISTRY_VERSION ||
+		 r->nslots != REGISTRY_SLOTS)
+	{
+		munmap(p, sizeof(struct registry));
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Another thread may have mapped it in the meantime. */
+	if (!__atomic_compare_exchange_n(&registry, &expect, r, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(p, sizeof(struct registry));
+		r = expect;
+	}
+	return r;
+}
+
+/* Whether the master that owns a slot is gone. */
+static int
+owner_dead(int owner)
+{
+	return kill(owner, 0) < 0 && errno == ESRCH;
+}
+
+/* Start and finish writing to the slot of the session. */
+static void
+slot_begin(struct slot *s)
+{
+	__atomic_add_fetch(&s->gen, 1, __ATOMIC_ACQ_REL);
+}
+
+static void
+slot_end(struct slot *s)
+{
+	__atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+}
+
+/* Copy a slot out of the registry. Returns 0 if it is owned, and the copy is
+** consistent. */
+static int
+slot_read(struct slot *s, struct slot *copy)
+{
+	unsigned int gen;
+	int tries;
+
+	for (tries = 0; tries < 100; ++tries)
+	{
+		gen = __atomic_load_n(&s->gen, __ATOMIC_ACQUIRE);
+		if (gen & 1)
+			continue;
+		memcpy(copy, s, sizeof(struct slot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->gen, __ATOMIC_RELAXED) == gen)
+			return copy->owner ? 0 : -1;
+	}
+	return -1;
+}
+
+/* Take a slot in the registry for the session, which is running argv as
+** pid. A session that can't get one runs all the same, it just isn't
+** listed. */
+void
+registry_add(char **argv, pid_t pid)
+{
+	struct registry *r = registry_map();
+	struct slot *s = NULL;
+	unsigned int i, high;
+	int me = getpid(), owner;
+	size_t len = 0;
+
+	if (!r)
+		return;
+	for (i = 0; i < REGISTRY_SLOTS && !s; ++i)
+	{
+		owner = __atomic_load_n(&r->slots[i].owner, __ATOMIC_ACQUIRE);
+		if (owner != 0 && !owner_dead(owner))
+			continue;
+		if (__atomic_compare_exchange_n(&r->slots[i].owner, &owner,
+						me, 0, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			s = &r->slots[i];
+	}
+	if (!s)
+		return;
+
+	/* Keep the end of the used slots up to date. */
+	high = __atomic_load_n(&r->high, __ATOMIC_ACQUIRE);
+	while (high < i && !__atomic_compare_exchange_n(&r->high, &high, i,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		;
+
+	slot_begin(s);
+	s->pid = pid;
+	s->attached = 0;
+	s->output = 0;
+	s->started = s->active = time(NULL);
+	if (sockname[0] == '/' || SOCKET_ABSTRACT(sockname) ||
+	    !getcwd(s->sockname, sizeof(s->sockname)))
+		snprintf(s->sockname, sizeof(s->sockname), "%s", sockname);
+	else
+	{
+		len = strlen(s->sockname);
+		snprintf(s->sockname + len, sizeof(s->sockname) - len, "/%s",
+			 sockname);
+	}
+	s->command[0] = '\0';
+	for (len = 0; *argv && len < sizeof(s->command) - 1; ++argv)
+		len += snprintf(s->command + len, sizeof(s->command) - len,
+				len ? " %s" : "%s", *argv);
+	slot_end(s);
+	my_slot = s;
+}
+
+/* Note down how many clients are attached and how much output has been
+** read. This is called on every pass of the event loop, so it stays away
+** from the slot unless something changed. */
+void
+registry_update(int attached, unsigned long long output)
+{
+	struct slot *s = my_slot;
+
+	if (!s || (s->attached == attached && s->output == output))
+		return;
+	slot_begin(s);
+	s->attached = attached;
+	s->output = output;
+	s->active = time(NULL);
+	slot_end(s);
+}
+
+/* Give the slot of the session back. */
+void
+registry_remove(void)
+{
+	struct slot *s = my_slot;
+
+	if (!s)
+		return;
+	my_slot = NULL;
+	slot_begin(s);
+	s->sockname[0] = '\0';
+	slot_end(s);
+	__atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+}
+
+/* Print a byte count in a few characters. */
+static void
+print_size(unsigned long long n)
+{
+	static const char units[] = "kmgt";
+	double v = n;
+	int i = -1;
+
+	while (v >= 1024 && i < 3)
+	{
+		v /= 1024;
+		++i;
+	}
+	if (i < 0)
+		printf(" %7llu", n);
+	else
+		printf(" %6.1f%c", v, units[i]);
+}
+
+/* Print a length of time in a few characters. */
+static void
+print_idle(long long secs)
+{
+	if (secs < 0)
+		secs = 0;
+	if (secs < 120)
+		printf(" %4llds", secs);
+	else if (secs < 120 * 60)
+		printf(" %4lldm", secs / 60);
+	else if (secs < 48 * 3600)
+		printf(" %4lldh", secs / 3600);
+	else
+		printf(" %4lldd", secs / 86400);
+}
+
+/* List the sessions of the user, dropping the ones whose master has died
+** without saying so. */
+int
+list_main(void)
+{
+	struct registry *r = registry_map();
+	struct slot copy;
+	unsigned int i, high;
+	long long now = time(NULL);
+
+	if (!r)
+	{
+		char path[4096];
+
+		registry_path(path, sizeof(path));
+		printf("%s: %s: %s\n", progname, path, strerror(errno));
+		return 1;
+	}
+
+	printf("%-7s %7s %8s %5s  %-24s %s\n", "PID", "CLIENTS", "OUTPUT",
+	       "IDLE", "SOCKET", "COMMAND");
+	high = __atomic_load_n(&r->high, __ATOMIC_ACQUIRE);
+	for (i = 0; i < high && i < REGISTRY_SLOTS; ++i)
+	{
+		struct slot *s = &r->slots[i];
+
+		if (slot_read(s, &copy) < 0)
+			continue;
+		if (owner_dead(copy.owner))
+		{
+			__atomic_compare_exchange_n(&s->owner, &copy.owner, 0,
+						    0, __ATOMIC_ACQ_REL,
+						    __ATOMIC_ACQUIRE);
+			continue;
+		}
+		if (!copy.sockname[0])
+			continue;
+		copy.sockname[sizeof(copy.sockname) - 1] = '\0';
+		copy.command[sizeof(copy.command) - 1] = '\0';
+		printf("%-7d %7d", copy.pid, copy.attached);
+		print_size(copy.output);
+		print_idle(now - copy.active);
+		printf("  %-24s %s\n", copy.sockname, copy.command);
+	}
+	return 0;
+}
+#else
+void
+registry_add(ATTRIBUTE_UNUSED char **argv, ATTRIBUTE_UNUSED pid_t pid)
+{
+}
+
+void
+registry_update(ATTRIBUTE_UNUSED int attached,
+		ATTRIBUTE_UNUSED unsigned long long output)
+{
+}
+
+void
+registry_remove(void)
+{
+}
+
+int
+list_main(void)
+{
+	printf("%s: Sessions can't be listed on this system.\n", progname);
+	return 1;
+}
+#endif
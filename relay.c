@@ -0,0 +1,901 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** The network relay. dtach -T listens on a TCP port and connects everyone
+** who comes in to a session, so that clients on other machines can attach
+** with tcp:<host>:<port> in place of the socket.
+**
+** A client starts by sending a hello with the ways it can take the output
+** in, and the relay answers with the one it picked, or with the error it
+** got connecting to the session. After that, the client talks to the
+** session like it would over the socket. Its input is passed along as it
+** is, since it is small. The output, which is where the bandwidth goes, is
+** collected for up to RELAY_FLUSH (or the time given with -L) and sent in
+** one piece, compressed with deflate if the client can take it. The
+** compressor keeps its history from one piece to the next, which is what
+** makes the repetitive output of most programs shrink so well.
+**
+** Anyone who can reach the port could otherwise drive the session, going
+** around the permissions of its socket. So the relay only lets in clients
+** on the same machine that are run by the same user as the relay, which it
+** finds out by looking up the other end of the connection in the kernel's
+** table of TCP sockets. That table is in /proc on Linux, and clients are
+** turned away where it can't be read. Clients on other machines get in
+** through something like ssh port forwarding, where the connection comes
+** from the user's own sshd. The relay also listens on the loopback address
+** unless it is told otherwise.
+*/
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define USE_ZLIB
+#include <zlib.h>
+#endif
+
+/* The start of a relay address. */
+#define RELAY_PREFIX	"tcp:"
+
+/* The hello, both ways: a magic number, the ways of sending output that
+** the client can take (as a bit mask) or that the relay picked, and the
+** relay's errno if it couldn't connect to the session. */
+#define RELAY_MAGIC	"dtR1"
+#define RELAY_HELLO	6
+
+/* The ways output can be sent. */
+enum
+{
+	RELAY_PLAIN	= 0,
+	RELAY_DEFLATE	= 1,
+	RELAY_ERROR	= 0xff,
+};
+
+/* How long output is collected before it is sent, in microseconds. */
+#define RELAY_FLUSH	2000
+/* The most output that is collected before it is sent anyway. */
+#define RELAY_BATCH	(64 * 1024)
+/* How many reads and writes a connection gets before the others have a
+** turn. */
+#define RELAY_BURST	16
+
+/* A client of the relay. */
+struct conn
+{
+	/* The connection to the client, and to the session. */
+	struct watch net, local;
+	/* The client's address. */
+	char peer[64];
+	/* The hello, while it is still coming in. */
+	unsigned char hello[RELAY_HELLO];
+	size_t hello_len;
+	/* How output is sent, or -1 until the hello is done. */
+	int method;
+	/* Set once the session is gone, to close when the output is out. */
+	int closing;
+	/* Input from the client on its way to the session. */
+	unsigned char in[BUFSIZE];
+	size_t in_start, in_len;
+	/* Output that is being collected, and when the oldest of it came. */
+	unsigned char raw[RELAY_BATCH];
+	size_t raw_len;
+	unsigned long long raw_since;
+	struct timer flush;
+	/* Set if the output should be sent once the last piece is out. */
+	int flush_due;
+	/* Output on its way to the client, and when the oldest of it came. */
+	unsigned char *out;
+	size_t out_size, out_start, out_len;
+	unsigned long long out_since;
+	/* Output from the session, what it came to on the wire, the number
+	** of pieces, and how long they waited in the relay. */
+	unsigned long long raw_bytes, sent_bytes, pieces;
+	unsigned long long wait_sum, wait_max;
+#ifdef USE_ZLIB
+	z_stream z;
+#endif
+	struct conn *next, **pprev;
+};
+
+static struct conn *conns;
+static struct watch listen_watch;
+
+#ifdef USE_ZLIB
+/* On the client's side, the decompressor for compressed output. */
+static z_stream zin;
+static int zin_active, zin_full;
+static unsigned char zin_buf[BUFSIZE];
+#endif
+
+/* Returns non-zero if name is the address of a relay rather than a
+** socket. */
+int
+relay_address(const char *name)
+{
+	return strncmp(name, RELAY_PREFIX, strlen(RELAY_PREFIX)) == 0;
+}
+
+/* Look up an address of the form [<host>:]<port>, using defhost (or the
+** loopback addresses, if NULL) when there is no host. */
+static int
+resolve(const char *address, const char *defhost, struct addrinfo **res)
+{
+	struct addrinfo hints;
+	char *host, *port;
+	int ret;
+
+	host = strdup(address);
+	if (!host)
+		return -1;
+	port = strrchr(host, ':');
+	if (port)
+	{
+		*port++ = '\0';
+		/* Allow [::1]:port. */
+		if (host[0] == '[' && host[strlen(host) - 1] == ']')
+		{
+			host[strlen(host) - 1] = '\0';
+			memmove(host, host + 1, strlen(host));
+		}
+	}
+	else
+		port = host;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(port != host && *host ? host : defhost, port, &hints,
+			  res);
+	free(host);
+	if (ret != 0)
+	{
+		errno = ret == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		return -1;
+	}
+	return 0;
+}
+
+/* Turn off Nagle's algorithm, since the relay does its own batching and
+** keystrokes should go out right away. */
+static void
+set_nodelay(int s)
+{
+#ifdef TCP_NODELAY
+	int on = 1;
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#endif
+}
+
+/* Read or write exactly count bytes, on a blocking descriptor. */
+static int
+transfer(int fd, void *buf, size_t count, int out)
+{
+	while (count > 0)
+	{
+		ssize_t n = out ? write(fd, buf, count) : read(fd, buf, count);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			if (n == 0)
+				errno = EPIPE;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* Connect to a session through the relay at name. The output is sent
+** compressed if compress is set and both ends can do it, in which case it
+** has to be read with relay_read. Returns -1 with errno set on failure. */
+int
+relay_connect(const char *name, int compress)
+{
+	unsigned char hello[RELAY_HELLO];
+	struct addrinfo *res, *ai;
+	int s = -1;
+
+	if (resolve(name + strlen(RELAY_PREFIX), NULL, &res) < 0)
+		return -1;
+	for (ai = res; ai; ai = ai->ai_next)
+	{
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0)
+			continue;
+		if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+	if (s < 0)
+		return -1;
+	set_nodelay(s);
+
+	memcpy(hello, RELAY_MAGIC, 4);
+	hello[4] = 1 << RELAY_PLAIN;
+#ifdef USE_ZLIB
+	if (compress)
+		hello[4] |= 1 << RELAY_DEFLATE;
+#else
+	(void)compress;
+#endif
+	hello[5] = 0;
+	if (transfer(s, hello, sizeof(hello), 1) < 0 ||
+	    transfer(s, hello, sizeof(hello), 0) < 0)
+	{
+		close(s);
+		return -1;
+	}
+	if (memcmp(hello, RELAY_MAGIC, 4) != 0)
+	{
+		close(s);
+		errno = EPROTO;
+		return -1;
+	}
+	if (hello[4] == RELAY_ERROR)
+	{
+		close(s);
+		errno = hello[5] ? hello[5] : ECONNREFUSED;
+		return -1;
+	}
+#ifdef USE_ZLIB
+	if (hello[4] == RELAY_DEFLATE)
+	{
+		if (inflateInit(&zin) != Z_OK)
+		{
+			close(s);
+			errno = ENOMEM;
+			return -1;
+		}
+		zin_active = 1;
+	}
+#endif
+	return s;
+}
+
+/* Read output from the session into buf, decompressing it if it comes
+** compressed from a relay. Like read, except that it fails with EAGAIN when
+** what came in did not make any output yet. */
+ssize_t
+relay_read(int s, void *buf, size_t len)
+{
+#ifdef USE_ZLIB
+	if (zin_active)
+	{
+		int ret;
+
+		if (zin.avail_in == 0 && !zin_full)
+		{
+			ssize_t n = read(s, zin_buf, sizeof(zin_buf));
+
+			if (n <= 0)
+				return n;
+			zin.next_in = zin_buf;
+			zin.avail_in = n;
+		}
+		zin.next_out = buf;
+		zin.avail_out = len;
+		ret = inflate(&zin, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			errno = EPROTO;
+			return -1;
+		}
+		/* A full buffer means inflate may have more to give. */
+		zin_full = (zin.avail_out == 0);
+		if (zin.avail_out == len)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+		return len - zin.avail_out;
+	}
+#endif
+	return read(s, buf, len);
+}
+
+/* Returns non-zero if relay_read has output to give without reading. */
+int
+relay_pending(void)
+{
+#ifdef USE_ZLIB
+	return zin_active && (zin.avail_in > 0 || zin_full);
+#else
+	return 0;
+#endif
+}
+
+/* Say goodbye to a client, with a report on how its output went. */
+static void
+conn_close(struct conn *c)
+{
+	if (c->method >= 0)
+	{
+		printf("%s: %s: %llu bytes of output, %llu sent", progname,
+		       c->peer, c->raw_bytes, c->sent_bytes);
+		if (c->sent_bytes > 0)
+			printf(" (%.2f:1)",
+			       (double)c->raw_bytes / c->sent_bytes);
+		if (c->pieces > 0)
+			printf(", held %.2fms on average and %.2fms at most",
+			       (double)c->wait_sum / c->pieces / 1000,
+			       (double)c->wait_max / 1000);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	ev_timer_cancel(&c->flush);
+	ev_del(&c->net);
+	close(c->net.fd);
+	if (c->local.handler)
+	{
+		ev_del(&c->local);
+		close(c->local.fd);
+	}
+#ifdef USE_ZLIB
+	if (c->method == RELAY_DEFLATE)
+		deflateEnd(&c->z);
+#endif
+	if (c->next)
+		c->next->pprev = c->pprev;
+	*(c->pprev) = c->next;
+	free(c->out);
+	free(c);
+}
+
+/* Make sure the output buffer can take size bytes. */
+static int
+conn_reserve(struct conn *c, size_t size)
+{
+	unsigned char *out;
+
+	if (size <= c->out_size)
+		return 0;
+	out = realloc(c->out, size);
+	if (!out)
+		return -1;
+	c->out = out;
+	c->out_size = size;
+	return 0;
+}
+
+/* Send the output collected so far, compressing it if the client asked
+** for that. If the last piece is still on its way, this waits until it is
+** out. */
+static int
+conn_flush(struct conn *c)
+{
+	ev_timer_cancel(&c->flush);
+	if (c->out_len > 0)
+	{
+		c->flush_due = 1;
+		return 0;
+	}
+	c->flush_due = 0;
+	if (c->raw_len == 0)
+		return 0;
+
+	c->out_start = 0;
+	c->out_since = c->raw_since;
+#ifdef USE_ZLIB
+	if (c->method == RELAY_DEFLATE)
+	{
+		c->z.next_in = c->raw;
+		c->z.avail_in = c->raw_len;
+		do
+		{
+			if (c->out_len == c->out_size &&
+			    conn_reserve(c, c->out_size * 2) < 0)
+				return -1;
+			c->z.next_out = c->out + c->out_len;
+			c->z.avail_out = c->out_size - c->out_len;
+			if (deflate(&c->z, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+				return -1;
+			c->out_len = c->out_size - c->z.avail_out;
+		} while (c->z.avail_in > 0 || c->z.avail_out == 0);
+	}
+	else
+#endif
+	{
+		memcpy(c->out, c->raw, c->raw_len);
+		c->out_len = c->raw_len;
+	}
+	c->raw_len = 0;
+	c->pieces++;
+	return 0;
+}
+
+/* Move data along in both directions until there is nothing left to do or
+** the connection has had its turn. */
+static void
+conn_pump(struct conn *c)
+{
+	int burst;
+
+	for (burst = 0; burst < RELAY_BURST; ++burst)
+	{
+		ssize_t len;
+
+		/* Input from the client goes to the session as it is. */
+		if (c->in_len == 0 && (c->net.ready & EV_READ))
+		{
+			len = read(c->net.fd, c->in, sizeof(c->in));
+			if (len < 0 && (errno == EAGAIN || errno == EINTR))
+				ev_clear(&c->net, EV_READ);
+			else if (len <= 0)
+				goto close;
+			else
+			{
+				c->in_start = 0;
+				c->in_len = len;
+			}
+		}
+		if (c->in_len > 0 && (c->local.ready & EV_WRITE))
+		{
+			len = write(c->local.fd, c->in + c->in_start,
+				    c->in_len);
+			if (len < 0 && (errno == EAGAIN || errno == EINTR))
+				ev_clear(&c->local, EV_WRITE);
+			else if (len < 0)
+				goto close;
+			else
+			{
+				c->in_start += len;
+				c->in_len -= len;
+			}
+		}
+
+		/* Output goes to the client a piece at a time. */
+		if (c->out_len > 0 && (c->net.ready & EV_WRITE))
+		{
+			len = write(c->net.fd, c->out + c->out_start,
+				    c->out_len);
+			if (len < 0 && (errno == EAGAIN || errno == EINTR))
+				ev_clear(&c->net, EV_WRITE);
+			else if (len < 0)
+				goto close;
+			else
+			{
+				c->out_start += len;
+				c->out_len -= len;
+				c->sent_bytes += len;
+				if (c->out_len == 0)
+				{
+					unsigned long long wait;
+
+					wait = ev_now() - c->out_since;
+					c->wait_sum += wait;
+					if (wait > c->wait_max)
+						c->wait_max = wait;
+					if (c->flush_due && conn_flush(c) < 0)
+						goto close;
+				}
+			}
+		}
+		if (!c->closing && c->raw_len < RELAY_BATCH &&
+		    (c->local.ready & EV_READ))
+		{
+			len = read(c->local.fd, c->raw + c->raw_len,
+				   RELAY_BATCH - c->raw_len);
+			if (len < 0 && (errno == EAGAIN || errno == EINTR))
+				ev_clear(&c->local, EV_READ);
+			else if (len <= 0)
+			{
+				/* The session is gone. Send what is left. */
+				c->closing = 1;
+				if (conn_flush(c) < 0)
+					goto close;
+			}
+			else
+			{
+				if (c->raw_len == 0)
+				{
+					c->raw_since = ev_now();
+					ev_timer_set(&c->flush,
+						     latency_budget ?
+						     latency_budget :
+						     RELAY_FLUSH);
+				}
+				c->raw_len += len;
+				c->raw_bytes += len;
+				if (c->raw_len == RELAY_BATCH &&
+				    conn_flush(c) < 0)
+					goto close;
+			}
+		}
+
+		if (!((c->in_len == 0 && (c->net.ready & EV_READ)) ||
+		      (c->in_len > 0 && (c->local.ready & EV_WRITE)) ||
+		      (c->out_len > 0 && (c->net.ready & EV_WRITE)) ||
+		      (!c->closing && c->raw_len < RELAY_BATCH &&
+		       (c->local.ready & EV_READ))))
+			break;
+	}
+
+	if (c->closing && c->out_len == 0 && c->raw_len == 0)
+		goto close;
+	ev_want(&c->net, (c->in_len == 0 ? EV_READ : 0) |
+		(c->out_len > 0 ? EV_WRITE : 0));
+	ev_want(&c->local, (!c->closing && c->raw_len < RELAY_BATCH ?
+			    EV_READ : 0) | (c->in_len > 0 ? EV_WRITE : 0));
+	return;
+
+close:
+	conn_close(c);
+}
+
+/* The output has waited long enough. */
+static void
+conn_expired(struct timer *t)
+{
+	struct conn *c = t->data;
+
+	if (conn_flush(c) < 0)
+		conn_close(c);
+	else
+		conn_pump(c);
+}
+
+/* Activity on the session's socket. */
+static void
+local_activity(struct watch *w)
+{
+	conn_pump(w->data);
+}
+
+/* Turn an address from /proc/net/tcp, where it is written as a number of
+** 32 bit words in hex, back into its bytes. */
+static int
+proc_address(const char *hex, unsigned char *addr, size_t len)
+{
+	size_t i;
+
+	if (strlen(hex) != len * 2)
+		return -1;
+	for (i = 0; i < len; i += 4)
+	{
+		char word[9];
+		unsigned int n;
+
+		memcpy(word, hex + i * 2, 8);
+		word[8] = '\0';
+		n = strtoul(word, NULL, 16);
+		memcpy(addr + i, &n, 4);
+	}
+	return 0;
+}
+
+/* Look in the socket table at path for a connected socket with the given
+** address and port on its end and on the other end, which are len bytes
+** long. Returns the user that owns it, or -1 if there is none. */
+static long
+proc_owner(const char *path, const unsigned char *local, int local_port,
+	   const unsigned char *remote, int remote_port, size_t len)
+{
+	char line[256], lhex[40], rhex[40];
+	unsigned char laddr[16], raddr[16];
+	unsigned int lport, rport, state;
+	unsigned long uid;
+	long owner = -1;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	while (owner < 0 && fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "%*d: %39[0-9A-Fa-f]:%x %39[0-9A-Fa-f]:%x %x "
+			   "%*x:%*x %*x:%*x %*x %lu", lhex, &lport, rhex,
+			   &rport, &state, &uid) != 6)
+			continue;
+		/* 1 is TCP_ESTABLISHED. */
+		if (state != 1 || (int)lport != local_port ||
+		    (int)rport != remote_port ||
+		    proc_address(lhex, laddr, len) < 0 ||
+		    proc_address(rhex, raddr, len) < 0)
+			continue;
+		if (memcmp(laddr, local, len) == 0 &&
+		    memcmp(raddr, remote, len) == 0)
+			owner = uid;
+	}
+	fclose(fp);
+	return owner;
+}
+
+/* Find out which user the client is, if it is on this machine. Returns -1
+** if it can't be told. */
+static long
+conn_owner(struct conn *c)
+{
+	struct sockaddr_storage peer, self;
+	socklen_t peerlen = sizeof(peer), selflen = sizeof(self);
+
+	if (getpeername(c->net.fd, (struct sockaddr *)&peer, &peerlen) < 0 ||
+	    getsockname(c->net.fd, (struct sockaddr *)&self, &selflen) < 0 ||
+	    peer.ss_family != self.ss_family)
+		return -1;
+	if (peer.ss_family == AF_INET)
+	{
+		struct sockaddr_in *p = (struct sockaddr_in *)&peer;
+		struct sockaddr_in *s = (struct sockaddr_in *)&self;
+
+		/* The client's end of the connection is our other end. */
+		return proc_owner("/proc/net/tcp",
+				  (unsigned char *)&p->sin_addr,
+				  ntohs(p->sin_port),
+				  (unsigned char *)&s->sin_addr,
+				  ntohs(s->sin_port), 4);
+	}
+	if (peer.ss_family == AF_INET6)
+	{
+		struct sockaddr_in6 *p = (struct sockaddr_in6 *)&peer;
+		struct sockaddr_in6 *s = (struct sockaddr_in6 *)&self;
+		long owner;
+
+		owner = proc_owner("/proc/net/tcp6",
+				   (unsigned char *)&p->sin6_addr,
+				   ntohs(p->sin6_port),
+				   (unsigned char *)&s->sin6_addr,
+				   ntohs(s->sin6_port), 16);
+		/* A client using IPv4 shows up with a mapped address. */
+		if (owner < 0 && IN6_IS_ADDR_V4MAPPED(&p->sin6_addr) &&
+		    IN6_IS_ADDR_V4MAPPED(&s->sin6_addr))
+			owner = proc_owner("/proc/net/tcp",
+					   (unsigned char *)&p->sin6_addr + 12,
+					   ntohs(p->sin6_port),
+					   (unsigned char *)&s->sin6_addr + 12,
+					   ntohs(s->sin6_port), 4);
+		return owner;
+	}
+	return -1;
+}
+
+/* Finish the hello, and connect the client to the session. */
+static void
+conn_hello(struct conn *c)
+{
+	unsigned char reply[RELAY_HELLO];
+	int methods, s;
+
+	while (c->hello_len < RELAY_HELLO)
+	{
+		ssize_t len = read(c->net.fd, c->hello + c->hello_len,
+				   RELAY_HELLO - c->hello_len);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		else if (len < 0 && errno == EAGAIN)
+		{
+			ev_clear(&c->net, EV_READ);
+			return;
+		}
+		else if (len <= 0)
+		{
+			conn_close(c);
+			return;
+		}
+		c->hello_len += len;
+	}
+	if (memcmp(c->hello, RELAY_MAGIC, 4) != 0)
+	{
+		conn_close(c);
+		return;
+	}
+	methods = c->hello[4];
+
+	memcpy(reply, RELAY_MAGIC, 4);
+	reply[5] = 0;
+	/* Only the user running the relay may use it, like the socket. */
+	if (conn_owner(c) != (long)geteuid())
+	{
+		printf("%s: %s: refused, not run by the same user\n",
+		       progname, c->peer);
+		fflush(stdout);
+		s = -1;
+		errno = EACCES;
+	}
+	else
+		s = connect_socket(sockname);
+	if (s < 0 || setnonblocking(s) < 0)
+	{
+		reply[4] = RELAY_ERROR;
+		reply[5] = errno < 256 ? errno : 0;
+		if (write(c->net.fd, reply, sizeof(reply)) < 0)
+			reply[5] = 0;
+		if (s >= 0)
+			close(s);
+		conn_close(c);
+		return;
+	}
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+	c->local.fd = s;
+	c->local.handler = local_activity;
+	c->local.data = c;
+	if (ev_add(&c->local) < 0)
+	{
+		c->local.handler = NULL;
+		close(s);
+		conn_close(c);
+		return;
+	}
+
+	c->method = RELAY_PLAIN;
+#ifdef USE_ZLIB
+	if ((methods & (1 << RELAY_DEFLATE)) &&
+	    deflateInit(&c->z, Z_BEST_SPEED) == Z_OK)
+		c->method = RELAY_DEFLATE;
+#else
+	(void)methods;
+#endif
+	reply[4] = c->method;
+	/* The hello is the first thing sent, so there is room for it. */
+	if (write(c->net.fd, reply, sizeof(reply)) != sizeof(reply))
+	{
+		conn_close(c);
+		return;
+	}
+	conn_pump(c);
+}
+
+/* Activity on a client's connection. */
+static void
+net_activity(struct watch *w)
+{
+	struct conn *c = w->data;
+
+	if (c->method < 0)
+		conn_hello(c);
+	else
+		conn_pump(c);
+}
+
+/* New clients. */
+static void
+listen_activity(struct watch *w)
+{
+	for (;;)
+	{
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		char host[48], port[16];
+		struct conn *c;
+		int fd;
+
+		fd = accept(w->fd, (struct sockaddr *)&addr, &addrlen);
+		if (fd < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				ev_clear(w, EV_READ);
+			return;
+		}
+		c = calloc(1, sizeof(struct conn));
+		if (!c || conn_reserve(c, RELAY_BATCH) < 0 ||
+		    setnonblocking(fd) < 0)
+		{
+			if (c)
+				free(c->out);
+			free(c);
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		set_nodelay(fd);
+		if (getnameinfo((struct sockaddr *)&addr, addrlen, host,
+				sizeof(host), port, sizeof(port),
+				NI_NUMERICHOST|NI_NUMERICSERV) == 0)
+			snprintf(c->peer, sizeof(c->peer), "%s:%s", host,
+				 port);
+		else
+			strcpy(c->peer, "?");
+
+		c->method = -1;
+		c->net.fd = fd;
+		c->net.handler = net_activity;
+		c->net.data = c;
+		c->flush.handler = conn_expired;
+		c->flush.data = c;
+		if (ev_add(&c->net) < 0)
+		{
+			free(c->out);
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->pprev = &conns;
+		c->next = conns;
+		if (c->next)
+			c->next->pprev = &c->next;
+		conns = c;
+		ev_want(&c->net, EV_READ);
+	}
+}
+
+/* The relay - It passes clients on the network on to the session at
+** sockname, until it is killed. */
+int
+relay_main(char *address)
+{
+	struct addrinfo *res, *ai;
+	int s = -1, on = 1;
+
+	/* Only listen on the network if asked to. */
+	if (resolve(address, "127.0.0.1", &res) < 0)
+	{
+		printf("%s: %s: %s\n", progname, address, strerror(errno));
+		return 1;
+	}
+	for (ai = res; ai; ai = ai->ai_next)
+	{
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(s, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(s, 128) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(res);
+	if (s < 0 || setnonblocking(s) < 0)
+	{
+		printf("%s: %s: %s\n", progname, address, strerror(errno));
+		return 1;
+	}
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (ev_init() < 0)
+	{
+		printf("%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	listen_watch.fd = s;
+	listen_watch.handler = listen_activity;
+	if (ev_add(&listen_watch) < 0)
+	{
+		printf("%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	ev_want(&listen_watch, EV_READ);
+
+	while (1)
+	{
+		if (ev_wait(ev_pending() ? 0 : -1) < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			printf("%s: %s\n", progname, strerror(errno));
+			return 1;
+		}
+		ev_dispatch();
+	}
+	return 0;
+}
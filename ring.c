@@ -0,0 +1,547 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** The output ring. Instead of writing output to the socket of every local
+** client, the master can put it once into a ring in shared memory, which the
+** clients that asked for it (dtach -a -M) read for themselves.
+**
+** The ring holds records: a header giving the length of the record and who
+** it is for, followed by the output. Most records are for every reader, but
+** what only one client should see, such as the replay or a snapshot of the
+** screen, goes into the ring addressed to it, so that it stays in order with
+** the rest of the output. A reader ignores everything before the first
+** record addressed to it, which the master puts in the ring when the client
+** attaches.
+**
+** The master never waits for the readers. Before it overwrites a record, it
+** moves the tail of the ring past it, and a reader checks the tail again
+** after copying a record out: if the tail has passed the record by then, the
+** copy can't be trusted, and the reader has fallen too far behind. It picks
+** up again at the tail, and asks for a redraw.
+**
+** A reader that runs out of output says so in its slot of the ring before it
+** goes to sleep, and the master only wakes the readers that did, through an
+** eventfd of their own. Readers that are busy catching up cost the master
+** nothing at all.
+*/
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_EVENTFD) && \
+    defined(HAVE_MMAP) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+/* The size of the ring's output area. */
+#define RING_SIZE	(4 * 1024 * 1024)
+/* The most output in a single record. Larger output is split up. */
+#define RING_RECORD	(RING_SIZE / 8)
+/* The shared header is followed by the output area at this offset. */
+#define RING_DATA	4096
+#define RING_MAGIC	0x72696e67
+
+/* The header of a record, which is kept 8 byte aligned. */
+struct ring_record
+{
+	unsigned int len;
+	/* The reader it is for plus one, or 0 for every reader. */
+	unsigned int to;
+};
+
+#define RECORD_SIZE(len) \
+	((sizeof(struct ring_record) + (len) + 7) & ~(unsigned long long)7)
+
+struct ring_shared
+{
+	unsigned int magic;
+	unsigned int size;
+	/* The number of bytes ever put into the ring, and the position of the
+	** oldest record that is still intact. */
+	unsigned long long head;
+	unsigned long long tail;
+	/* The number of times readers fell behind. */
+	unsigned long long overruns;
+	struct
+	{
+		/* Set by the reader when it is about to sleep, and taken
+		** back by whoever notices there is more to read. */
+		unsigned int sleeping;
+		unsigned int pad;
+	} readers[RING_READERS];
+};
+
+struct ring
+{
+	struct ring_shared *sh;
+	unsigned char *data;
+	int fd;
+	/* The reader's number, position, progress through the current record
+	** and whether it has seen its first record yet. */
+	unsigned int me;
+	unsigned long long pos;
+	size_t rec_off;
+	int started;
+};
+
+/* Copy len bytes out of the ring, starting at position pos. */
+static void
+ring_copy_out(struct ring *r, unsigned long long pos, void *buf, size_t len)
+{
+	size_t off = pos % RING_SIZE, n = RING_SIZE - off;
+
+	if (n > len)
+		n = len;
+	memcpy(buf, r->data + off, n);
+	memcpy((unsigned char *)buf + n, r->data, len - n);
+}
+
+/* Copy len bytes into the ring at position pos. */
+static void
+ring_copy_in(struct ring *r, unsigned long long pos, const void *buf,
+	     size_t len)
+{
+	size_t off = pos % RING_SIZE, n = RING_SIZE - off;
+
+	if (n > len)
+		n = len;
+	memcpy(r->data + off, buf, n);
+	memcpy(r->data, (const unsigned char *)buf + n, len - n);
+}
+
+/* Map a ring from fd. */
+static struct ring *
+ring_map(int fd)
+{
+	struct ring *r = calloc(1, sizeof(struct ring));
+	void *p;
+
+	if (!r)
+		return NULL;
+	p = mmap(NULL, RING_DATA + RING_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+	if (p == MAP_FAILED)
+	{
+		free(r);
+		return NULL;
+	}
+	r->sh = p;
+	r->data = (unsigned char *)p + RING_DATA;
+	r->fd = fd;
+	return r;
+}
+
+/* Create a new ring, for the master. */
+struct ring *
+ring_new(void)
+{
+	struct ring *r;
+	int fd;
+
+	fd = memfd_create("dtach-ring", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, RING_DATA + RING_SIZE) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	r = ring_map(fd);
+	if (!r)
+	{
+		close(fd);
+		return NULL;
+	}
+	r->sh->magic = RING_MAGIC;
+	r->sh->size = RING_SIZE;
+	return r;
+}
+
+/* The descriptor to hand to readers. */
+int
+ring_memfd(struct ring *r)
+{
+	return r->fd;
+}
+
+void
+ring_free(struct ring *r)
+{
+	if (!r)
+		return;
+	munmap(r->sh, RING_DATA + RING_SIZE);
+	close(r->fd);
+	free(r);
+}
+
+/* Create an eventfd for waking up a reader. */
+int
+ring_eventfd(void)
+{
+	return eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+}
+
+/* Wake up the reader waiting on the eventfd fd. */
+void
+ring_signal(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/* Take the wakeups that came in on fd, so that it stops being readable. */
+void
+ring_clear(int fd)
+{
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) < 0)
+		return;
+}
+
+/* Get reader slot n ready for a new reader. */
+void
+ring_reader_reset(struct ring *r, int n)
+{
+	__atomic_store_n(&r->sh->readers[n].sleeping, 0, __ATOMIC_RELEASE);
+}
+
+/* Make room for size bytes at head, by moving the tail past the records that
+** are about to be overwritten. A record header that makes no sense means a
+** reader wrote where it shouldn't have, and everything is thrown away. */
+static void
+ring_reserve(struct ring *r, unsigned long long head, unsigned long long size)
+{
+	unsigned long long tail = r->sh->tail;
+	struct ring_record rec;
+
+	while (head + size - tail > RING_SIZE)
+	{
+		ring_copy_out(r, tail, &rec, sizeof(rec));
+		if (rec.len > RING_RECORD || tail + RECORD_SIZE(rec.len) > head)
+		{
+			tail = head;
+			break;
+		}
+		tail += RECORD_SIZE(rec.len);
+	}
+	if (tail != r->sh->tail)
+	{
+		__atomic_store_n(&r->sh->tail, tail, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+/* Put output into the ring, for reader to - 1, or for every reader if to is
+** 0. The output is gathered from iov, and split into several records if it
+** is large. An empty record is put in if there is no output at all. */
+void
+ring_put(struct ring *r, unsigned int to, const struct iovec *iov, int n)
+{
+	unsigned long long head = r->sh->head;
+	size_t off = 0;
+	int i = 0, first = 1;
+
+	while (1)
+	{
+		struct ring_record rec;
+		unsigned long long pos;
+		size_t left = 0, o;
+		int j;
+
+		while (i < n && iov[i].iov_len == off)
+		{
+			++i;
+			off = 0;
+		}
+		if (i == n && !first)
+			break;
+		first = 0;
+
+		/* Work out how much goes into this record. */
+		for (j = i, o = off; j < n && left < RING_RECORD; ++j, o = 0)
+			left += iov[j].iov_len - o;
+		rec.len = left < RING_RECORD ? left : RING_RECORD;
+		rec.to = to;
+
+		ring_reserve(r, head, RECORD_SIZE(rec.len));
+		ring_copy_in(r, head, &rec, sizeof(rec));
+		pos = head + sizeof(rec);
+		for (left = rec.len; left > 0; )
+		{
+			size_t part = iov[i].iov_len - off;
+
+			if (part > left)
+				part = left;
+			ring_copy_in(r, pos, (const char *)iov[i].iov_base + off,
+				     part);
+			pos += part;
+			left -= part;
+			off += part;
+			if (off == iov[i].iov_len)
+			{
+				++i;
+				off = 0;
+			}
+		}
+		head += RECORD_SIZE(rec.len);
+		__atomic_store_n(&r->sh->head, head, __ATOMIC_RELEASE);
+	}
+
+	/* The readers that are about to sleep look at the head after saying
+	** so, and the master looks at whether they are asleep after moving
+	** it, so that one of them always notices the other. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Whether reader n went to sleep waiting for output, and has to be woken
+** up. The reader is taken to be awake from then on. */
+int
+ring_wake_wanted(struct ring *r, int n)
+{
+	if (!__atomic_load_n(&r->sh->readers[n].sleeping, __ATOMIC_RELAXED))
+		return 0;
+	return __atomic_exchange_n(&r->sh->readers[n].sleeping, 0,
+				   __ATOMIC_ACQ_REL);
+}
+
+/* The number of times readers fell behind. */
+unsigned long long
+ring_overruns(struct ring *r)
+{
+	return __atomic_load_n(&r->sh->overruns, __ATOMIC_RELAXED);
+}
+
+/* Map the ring a master handed over, as reader n. Reading starts with the
+** next record. */
+struct ring *
+ring_open(int fd, int n)
+{
+	struct ring *r;
+	struct stat st;
+
+	if (n < 0 || n >= RING_READERS)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	/* A short file would fault when it is read past its end. */
+	if (fstat(fd, &st) < 0)
+		return NULL;
+	if (!S_ISREG(st.st_mode) || st.st_size < RING_DATA + RING_SIZE)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	r = ring_map(fd);
+	if (!r)
+		return NULL;
+	if (r->sh->magic != RING_MAGIC || r->sh->size != RING_SIZE)
+	{
+		munmap(r->sh, RING_DATA + RING_SIZE);
+		free(r);
+		errno = EINVAL;
+		return NULL;
+	}
+	r->me = n + 1;
+	r->pos = __atomic_load_n(&r->sh->head, __ATOMIC_ACQUIRE);
+	return r;
+}
+
+/* Ignore the output for every reader until the next record for this one,
+** such as after attaching again. */
+void
+ring_restart(struct ring *r)
+{
+	r->started = 0;
+}
+
+/* Whether there is anything in the ring the reader hasn't looked at. */
+int
+ring_pending(struct ring *r)
+{
+	return __atomic_load_n(&r->sh->head, __ATOMIC_ACQUIRE) != r->pos;
+}
+
+/* Tell the master that the reader is about to sleep until it is woken up.
+** Returns 0 if there turns out to be more to read after all, in which case
+** the reader shouldn't sleep. */
+int
+ring_sleep(struct ring *r)
+{
+	unsigned int *sleeping = &r->sh->readers[r->me - 1].sleeping;
+
+	__atomic_store_n(sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!ring_pending(r))
+		return 1;
+	__atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Copy the output for the reader out of the ring into buf, up to len bytes,
+** and return how much was copied. If the reader fell behind, *lost is set
+** and reading goes on from the oldest record left. */
+size_t
+ring_get(struct ring *r, unsigned char *buf, size_t len, int *lost)
+{
+	unsigned long long head, tail;
+	size_t got = 0;
+
+	*lost = 0;
+	head = __atomic_load_n(&r->sh->head, __ATOMIC_ACQUIRE);
+	while (r->pos < head && got < len)
+	{
+		struct ring_record rec;
+		size_t n = 0;
+		int valid, mine;
+
+		ring_copy_out(r, r->pos, &rec, sizeof(rec));
+		valid = (rec.len <= RING_RECORD &&
+			 r->pos + RECORD_SIZE(rec.len) <= head &&
+			 r->rec_off <= rec.len);
+		mine = valid && (rec.to == r->me || (rec.to == 0 && r->started));
+		if (mine)
+		{
+			n = rec.len - r->rec_off;
+			if (n > len - got)
+				n = len - got;
+			ring_copy_out(r, r->pos + sizeof(rec) + r->rec_off,
+				      buf + got, n);
+		}
+
+		/* Make sure none of it was overwritten while it was being
+		** copied. */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&r->sh->tail, __ATOMIC_RELAXED);
+		if (tail > r->pos || !valid)
+		{
+			__atomic_add_fetch(&r->sh->overruns, 1,
+					   __ATOMIC_RELAXED);
+			r->pos = tail > r->pos ? tail : head;
+			r->rec_off = 0;
+			/* Whatever was lost, the output for everyone from
+			** here on is the reader's to show. */
+			r->started = 1;
+			*lost = 1;
+			continue;
+		}
+
+		if (rec.to == r->me)
+			r->started = 1;
+		got += n;
+		r->rec_off += n;
+		if (r->rec_off == rec.len || !mine)
+		{
+			r->pos += RECORD_SIZE(rec.len);
+			r->rec_off = 0;
+		}
+	}
+	return got;
+}
+#else
+struct ring *
+ring_new(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+int
+ring_memfd(ATTRIBUTE_UNUSED struct ring *r)
+{
+	return -1;
+}
+
+void
+ring_free(ATTRIBUTE_UNUSED struct ring *r)
+{
+}
+
+int
+ring_eventfd(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+ring_signal(ATTRIBUTE_UNUSED int fd)
+{
+}
+
+void
+ring_clear(ATTRIBUTE_UNUSED int fd)
+{
+}
+
+void
+ring_reader_reset(ATTRIBUTE_UNUSED struct ring *r, ATTRIBUTE_UNUSED int n)
+{
+}
+
+void
+ring_put(ATTRIBUTE_UNUSED struct ring *r, ATTRIBUTE_UNUSED unsigned int to,
+	 ATTRIBUTE_UNUSED const struct iovec *iov, ATTRIBUTE_UNUSED int n)
+{
+}
+
+int
+ring_wake_wanted(ATTRIBUTE_UNUSED struct ring *r, ATTRIBUTE_UNUSED int n)
+{
+	return 0;
+}
+
+unsigned long long
+ring_overruns(ATTRIBUTE_UNUSED struct ring *r)
+{
+	return 0;
+}
+
+struct ring *
+ring_open(ATTRIBUTE_UNUSED int fd, ATTRIBUTE_UNUSED int n)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+ring_restart(ATTRIBUTE_UNUSED struct ring *r)
+{
+}
+
+int
+ring_pending(ATTRIBUTE_UNUSED struct ring *r)
+{
+	return 0;
+}
+
+int
+ring_sleep(ATTRIBUTE_UNUSED struct ring *r)
+{
+	return 1;
+}
+
+size_t
+ring_get(ATTRIBUTE_UNUSED struct ring *r, ATTRIBUTE_UNUSED unsigned char *buf,
+	 ATTRIBUTE_UNUSED size_t len, int *lost)
+{
+	*lost = 0;
+	return 0;
+}
+#endif
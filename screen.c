@@ -0,0 +1,1421 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+
+/*
+** A model of the screen of a VT100/xterm style terminal, used by the
+** snapshot redraw method. The master feeds it everything the program
+** prints, and when a client attaches, it is turned back into a stream of
+** escape sequences that paints the same screen from scratch.
+**
+** Only the parts of the terminal that affect what ends up on the screen are
+** modelled: cells with their attributes and colors, the cursor, the
+** scrolling region, the alternate screen, the line drawing character set,
+** and the modes that a full-screen program expects the terminal to keep.
+** Anything else (such as title changes and device status reports) is
+** parsed and ignored.
+*/
+
+/* Cell attributes. */
+#define A_BOLD		0x0001
+#define A_DIM		0x0002
+#define A_ITALIC	0x0004
+#define A_UNDERLINE	0x0008
+#define A_BLINK		0x0010
+#define A_REVERSE	0x0020
+#define A_INVISIBLE	0x0040
+#define A_STRIKE	0x0080
+/* The character comes from the DEC line drawing set. */
+#define A_ACS		0x0100
+/* The right half of a double width character. */
+#define A_WIDE_CONT	0x0200
+
+/* Colors are 0 for the default, 1-256 for the palette and COLOR_RGB|rgb. */
+#define COLOR_RGB	0x1000000
+
+/* Modes that are passed on to the client in a snapshot. */
+#define M_APP_CURSOR	0x0001
+#define M_APP_KEYPAD	0x0002
+#define M_HIDE_CURSOR	0x0004
+#define M_NO_WRAP	0x0008
+#define M_INSERT	0x0010
+#define M_ORIGIN	0x0020
+#define M_PASTE		0x0040
+#define M_MOUSE_X10	0x0080
+#define M_MOUSE_NORMAL	0x0100
+#define M_MOUSE_BUTTON	0x0200
+#define M_MOUSE_ANY	0x0400
+#define M_MOUSE_SGR	0x0800
+#define M_FOCUS		0x1000
+
+/* Parser states. */
+enum
+{
+	S_GROUND,
+	S_ESC,
+	S_CHARSET,
+	S_CSI,
+	S_STRING,
+	S_STRING_ESC,
+};
+
+#define MAX_PARAMS 16
+
+struct cell
+{
+	unsigned int ch;
+	unsigned int fg, bg;
+	unsigned short attr;
+};
+
+/* The cursor and the state that DECSC saves along with it. */
+struct cursor
+{
+	int row, col;
+	unsigned int fg, bg;
+	unsigned short attr;
+	/* Whether G0 and G1 hold the line drawing set, and which is shifted
+	** in. */
+	int acs[2];
+	int shift;
+	/* The cursor is past the last column, and the next character wraps. */
+	int wrapnext;
+};
+
+struct screen
+{
+	int rows, cols;
+	/* The screen being displayed, and the two screens themselves. */
+	struct cell **lines;
+	struct cell **main_lines, **alt_lines;
+	int alt;
+	struct cursor cur, saved, alt_saved;
+	/* The scrolling region, inclusive. */
+	int top, bottom;
+	int modes;
+
+	/* Parser state. */
+	int state;
+	int params[MAX_PARAMS];
+	int nparams;
+	/* The private marker (such as '?') and intermediate byte of a CSI
+	** sequence, and the designator of an ESC ( sequence. */
+	int private, inter;
+	/* A partial UTF-8 sequence. */
+	unsigned int utf8;
+	int utf8_left;
+};
+
+/* A growable buffer for building snapshots. */
+struct sbuf
+{
+	unsigned char *data;
+	size_t len, size;
+	int failed;
+};
+
+/* The display width of a character. Double width characters are the CJK and
+** emoji ranges that terminals draw with two cells. */
+static int
+char_width(unsigned int ch)
+{
+	if (ch < 0x1100)
+		return 1;
+	if ((ch <= 0x115f) ||
+	    (ch >= 0x2e80 && ch <= 0xa4cf && ch != 0x303f) ||
+	    (ch >= 0xac00 && ch <= 0xd7a3) ||
+	    (ch >= 0xf900 && ch <= 0xfaff) ||
+	    (ch >= 0xfe30 && ch <= 0xfe4f) ||
+	    (ch >= 0xff00 && ch <= 0xff60) ||
+	    (ch >= 0xffe0 && ch <= 0xffe6) ||
+	    (ch >= 0x1f300 && ch <= 0x1f64f) ||
+	    (ch >= 0x1f900 && ch <= 0x1f9ff) ||
+	    (ch >= 0x20000 && ch <= 0x3fffd))
+		return 2;
+	return 1;
+}
+
+/* Erase cells, using the current background color like xterm does. */
+static void
+erase_cells(struct screen *scr, struct cell *line, int from, int to)
+{
+	int i;
+
+	for (i = from; i < to; ++i)
+	{
+		line[i].ch = ' ';
+		line[i].fg = 0;
+		line[i].bg = scr->cur.bg;
+		line[i].attr = 0;
+	}
+}
+
+static struct cell **
+alloc_lines(struct screen *scr, int rows, int cols)
+{
+	struct cell **lines;
+	int i;
+
+	lines = calloc(rows, sizeof(struct cell *));
+	if (!lines)
+		return NULL;
+	for (i = 0; i < rows; ++i)
+	{
+		lines[i] = malloc(cols * sizeof(struct cell));
+		if (!lines[i])
+		{
+			while (--i >= 0)
+				free(lines[i]);
+			free(lines);
+			return NULL;
+		}
+		erase_cells(scr, lines[i], 0, cols);
+	}
+	return lines;
+}
+
+static void
+free_lines(struct cell **lines, int rows)
+{
+	int i;
+
+	if (!lines)
+		return;
+	for (i = 0; i < rows; ++i)
+		free(lines[i]);
+	free(lines);
+}
+
+/* Scroll lines top..bottom up by n, bringing in blank lines at the bottom. */
+static void
+scroll_up(struct screen *scr, int top, int bottom, int n)
+{
+	struct cell *tmp[256], **saved = tmp;
+	int i, height = bottom - top + 1;
+
+	if (n > height)
+		n = height;
+	if (n <= 0)
+		return;
+	if (n > 256)
+	{
+		saved = malloc(n * sizeof(struct cell *));
+		if (!saved)
+			return;
+	}
+	for (i = 0; i < n; ++i)
+		saved[i] = scr->lines[top + i];
+	for (i = top; i <= bottom - n; ++i)
+		scr->lines[i] = scr->lines[i + n];
+	for (i = 0; i < n; ++i)
+	{
+		scr->lines[bottom - n + 1 + i] = saved[i];
+		erase_cells(scr, saved[i], 0, scr->cols);
+	}
+	if (saved != tmp)
+		free(saved);
+}
+
+/* Scroll lines top..bottom down by n, bringing in blank lines at the top. */
+static void
+scroll_down(struct screen *scr, int top, int bottom, int n)
+{
+	struct cell *tmp[256], **saved = tmp;
+	int i, height = bottom - top + 1;
+
+	if (n > height)
+		n = height;
+	if (n <= 0)
+		return;
+	if (n > 256)
+	{
+		saved = malloc(n * sizeof(struct cell *));
+		if (!saved)
+			return;
+	}
+	for (i = 0; i < n; ++i)
+		saved[i] = scr->lines[bottom - i];
+	for (i = bottom; i >= top + n; --i)
+		scr->lines[i] = scr->lines[i - n];
+	for (i = 0; i < n; ++i)
+	{
+		scr->lines[top + i] = saved[i];
+		erase_cells(scr, saved[i], 0, scr->cols);
+	}
+	if (saved != tmp)
+		free(saved);
+}
+
+/* Move down a line, scrolling at the bottom of the scrolling region. */
+static void
+line_feed(struct screen *scr)
+{
+	scr->cur.wrapnext = 0;
+	if (scr->cur.row == scr->bottom)
+		scroll_up(scr, scr->top, scr->bottom, 1);
+	else if (scr->cur.row < scr->rows - 1)
+		scr->cur.row++;
+}
+
+/* Move up a line, scrolling at the top of the scrolling region. */
+static void
+reverse_line_feed(struct screen *scr)
+{
+	scr->cur.wrapnext = 0;
+	if (scr->cur.row == scr->top)
+		scroll_down(scr, scr->top, scr->bottom, 1);
+	else if (scr->cur.row > 0)
+		scr->cur.row--;
+}
+
+/* Put a character at the cursor. */
+static void
+put_char(struct screen *scr, unsigned int ch)
+{
+	struct cursor *cur = &scr->cur;
+	struct cell *line, *cell;
+	int width = 1;
+	unsigned short attr = cur->attr;
+
+	if (ch >= 0x80)
+		width = char_width(ch);
+	else if (cur->acs[cur->shift] && ch >= 0x60 && ch < 0x7f)
+		attr |= A_ACS;
+	if (width > scr->cols)
+		return;
+
+	if (cur->wrapnext)
+	{
+		cur->col = 0;
+		line_feed(scr);
+	}
+	if (cur->col + width > scr->cols)
+	{
+		if (scr->modes & M_NO_WRAP)
+			cur->col = scr->cols - width;
+		else
+		{
+			cur->col = 0;
+			line_feed(scr);
+		}
+	}
+
+	line = scr->lines[cur->row];
+	if (scr->modes & M_INSERT)
+		memmove(line + cur->col + width, line + cur->col,
+			(scr->cols - cur->col - width) * sizeof(struct cell));
+
+	/* Overwriting half of a double width character erases the other
+	** half. */
+	if (line[cur->col].attr & A_WIDE_CONT && cur->col > 0)
+		erase_cells(scr, line, cur->col - 1, cur->col);
+	if (cur->col + width < scr->cols &&
+	    line[cur->col + width].attr & A_WIDE_CONT)
+		erase_cells(scr, line, cur->col + width, cur->col + width + 1);
+
+	cell = line + cur->col;
+	cell->ch = ch;
+	cell->fg = cur->fg;
+	cell->bg = cur->bg;
+	cell->attr = attr;
+	if (width == 2)
+	{
+		cell[1] = cell[0];
+		cell[1].ch = 0;
+		cell[1].attr |= A_WIDE_CONT;
+	}
+
+	cur->col += width;
+	if (cur->col >= scr->cols)
+	{
+		cur->col = scr->cols - 1;
+		if (!(scr->modes & M_NO_WRAP))
+			cur->wrapnext = 1;
+	}
+}
+
+/* Put a run of printable ASCII characters at the cursor. This is where
+** nearly all of the time goes, so whole stretches of a line are filled in
+** at once, leaving the special cases to put_char. */
+static void
+put_ascii(struct screen *scr, const unsigned char *buf, size_t len)
+{
+	struct cursor *cur = &scr->cur;
+
+	while (len > 0)
+	{
+		struct cell *line, *cell;
+		size_t i, n;
+
+		if (cur->wrapnext || cur->acs[cur->shift] ||
+		    (scr->modes & M_INSERT))
+		{
+			put_char(scr, *buf++);
+			len--;
+			continue;
+		}
+
+		line = scr->lines[cur->row];
+		n = scr->cols - cur->col;
+		if (n > len)
+			n = len;
+		if (line[cur->col].attr & A_WIDE_CONT && cur->col > 0)
+			erase_cells(scr, line, cur->col - 1, cur->col);
+		if (cur->col + n < (size_t)scr->cols &&
+		    line[cur->col + n].attr & A_WIDE_CONT)
+			erase_cells(scr, line, cur->col + n, cur->col + n + 1);
+
+		cell = line + cur->col;
+		for (i = 0; i < n; ++i)
+		{
+			cell[i].ch = buf[i];
+			cell[i].fg = cur->fg;
+			cell[i].bg = cur->bg;
+			cell[i].attr = cur->attr;
+		}
+		buf += n;
+		len -= n;
+		cur->col += n;
+		if (cur->col >= scr->cols)
+		{
+			cur->col = scr->cols - 1;
+			if (!(scr->modes & M_NO_WRAP))
+				cur->wrapnext = 1;
+		}
+	}
+}
+
+/* Move the cursor, taking origin mode into account. */
+static void
+move_to(struct screen *scr, int row, int col)
+{
+	int top = 0, bottom = scr->rows - 1;
+
+	if (scr->modes & M_ORIGIN)
+	{
+		top = scr->top;
+		bottom = scr->bottom;
+		row += top;
+	}
+	if (row < top)
+		row = top;
+	if (row > bottom)
+		row = bottom;
+	if (col < 0)
+		col = 0;
+	if (col >= scr->cols)
+		col = scr->cols - 1;
+	scr->cur.row = row;
+	scr->cur.col = col;
+	scr->cur.wrapnext = 0;
+}
+
+/* Switch between the main and alternate screens. */
+static void
+switch_screen(struct screen *scr, int alt, int clear)
+{
+	if (alt == scr->alt)
+		return;
+	scr->alt = alt;
+	scr->lines = alt ? scr->alt_lines : scr->main_lines;
+	if (alt && clear)
+	{
+		int i;
+
+		for (i = 0; i < scr->rows; ++i)
+			erase_cells(scr, scr->lines[i], 0, scr->cols);
+	}
+}
+
+/* Reset the terminal to its initial state. */
+static void
+reset(struct screen *scr)
+{
+	int i;
+
+	memset(&scr->cur, 0, sizeof(struct cursor));
+	scr->saved = scr->cur;
+	scr->alt_saved = scr->cur;
+	switch_screen(scr, 0, 0);
+	scr->top = 0;
+	scr->bottom = scr->rows - 1;
+	scr->modes = 0;
+	for (i = 0; i < scr->rows; ++i)
+	{
+		erase_cells(scr, scr->main_lines[i], 0, scr->cols);
+		erase_cells(scr, scr->alt_lines[i], 0, scr->cols);
+	}
+}
+
+/* The n'th CSI parameter, or def if it is missing or zero. */
+static int
+param(struct screen *scr, int n, int def)
+{
+	if (n >= scr->nparams || scr->params[n] <= 0)
+		return def;
+	return scr->params[n];
+}
+
+/* Handle SGR - select graphic rendition. */
+static void
+set_attributes(struct screen *scr)
+{
+	struct cursor *cur = &scr->cur;
+	int i;
+
+	if (scr->nparams == 0)
+		scr->params[scr->nparams++] = 0;
+	for (i = 0; i < scr->nparams; ++i)
+	{
+		int p = scr->params[i];
+
+		if (p == 0)
+		{
+			cur->attr = 0;
+			cur->fg = cur->bg = 0;
+		}
+		else if (p == 1)
+			cur->attr |= A_BOLD;
+		else if (p == 2)
+			cur->attr |= A_DIM;
+		else if (p == 3)
+			cur->attr |= A_ITALIC;
+		else if (p == 4 || p == 21)
+			cur->attr |= A_UNDERLINE;
+		else if (p == 5 || p == 6)
+			cur->attr |= A_BLINK;
+		else if (p == 7)
+			cur->attr |= A_REVERSE;
+		else if (p == 8)
+			cur->attr |= A_INVISIBLE;
+		else if (p == 9)
+			cur->attr |= A_STRIKE;
+		else if (p == 22)
+			cur->attr &= ~(A_BOLD|A_DIM);
+		else if (p == 23)
+			cur->attr &= ~A_ITALIC;
+		else if (p == 24)
+			cur->attr &= ~A_UNDERLINE;
+		else if (p == 25)
+			cur->attr &= ~A_BLINK;
+		else if (p == 27)
+			cur->attr &= ~A_REVERSE;
+		else if (p == 28)
+			cur->attr &= ~A_INVISIBLE;
+		else if (p == 29)
+			cur->attr &= ~A_STRIKE;
+		else if (p >= 30 && p <= 37)
+			cur->fg = p - 30 + 1;
+		else if (p == 39)
+			cur->fg = 0;
+		else if (p >= 40 && p <= 47)
+			cur->bg = p - 40 + 1;
+		else if (p == 49)
+			cur->bg = 0;
+		else if (p >= 90 && p <= 97)
+			cur->fg = p - 90 + 8 + 1;
+		else if (p >= 100 && p <= 107)
+			cur->bg = p - 100 + 8 + 1;
+		else if ((p == 38 || p == 48) && i + 1 < scr->nparams)
+		{
+			unsigned int color = 0;
+
+			if (scr->params[i + 1] == 5 && i + 2 < scr->nparams)
+			{
+				color = (scr->params[i + 2] & 0xff) + 1;
+				i += 2;
+			}
+			else if (scr->params[i + 1] == 2 &&
+				 i + 4 < scr->nparams)
+			{
+				color = COLOR_RGB |
+					((scr->params[i + 2] & 0xff) << 16) |
+					((scr->params[i + 3] & 0xff) << 8) |
+					(scr->params[i + 4] & 0xff);
+				i += 4;
+			}
+			else
+				break;
+			if (p == 38)
+				cur->fg = color;
+			else
+				cur->bg = color;
+		}
+	}
+}
+
+/* Handle SM and RM - set and reset modes. */
+static void
+set_modes(struct screen *scr, int on)
+{
+	int i;
+
+	for (i = 0; i < scr->nparams; ++i)
+	{
+		int p = scr->params[i], mode = 0, set = on;
+
+		if (scr->private != '?')
+		{
+			if (p == 4)
+				mode = M_INSERT;
+		}
+		else if (p == 1)
+			mode = M_APP_CURSOR;
+		else if (p == 6)
+		{
+			scr->modes = on ? scr->modes | M_ORIGIN :
+				scr->modes & ~M_ORIGIN;
+			move_to(scr, 0, 0);
+		}
+		/* These two are stored inverted. */
+		else if (p == 7)
+		{
+			mode = M_NO_WRAP;
+			set = !on;
+		}
+		else if (p == 25)
+		{
+			mode = M_HIDE_CURSOR;
+			set = !on;
+		}
+		else if (p == 9)
+			mode = M_MOUSE_X10;
+		else if (p == 1000)
+			mode = M_MOUSE_NORMAL;
+		else if (p == 1002)
+			mode = M_MOUSE_BUTTON;
+		else if (p == 1003)
+			mode = M_MOUSE_ANY;
+		else if (p == 1004)
+			mode = M_FOCUS;
+		else if (p == 1006)
+			mode = M_MOUSE_SGR;
+		else if (p == 2004)
+			mode = M_PASTE;
+		else if (p == 47 || p == 1047)
+			switch_screen(scr, on, p == 1047);
+		else if (p == 1048)
+		{
+			if (on)
+				scr->saved = scr->cur;
+			else
+				scr->cur = scr->saved;
+		}
+		else if (p == 1049)
+		{
+			if (on && !scr->alt)
+			{
+				scr->alt_saved = scr->cur;
+				switch_screen(scr, 1, 1);
+			}
+			else if (!on && scr->alt)
+			{
+				switch_screen(scr, 0, 0);
+				scr->cur = scr->alt_saved;
+			}
+		}
+
+		if (mode)
+			scr->modes = set ? scr->modes | mode : scr->modes & ~mode;
+	}
+}
+
+/* Handle the final byte of a CSI sequence. */
+static void
+csi_dispatch(struct screen *scr, int c)
+{
+	struct cursor *cur = &scr->cur;
+	struct cell *line = scr->lines[cur->row];
+	int n, i;
+
+	/* Sequences with intermediate bytes (such as DECSTR or DECSCUSR) don't
+	** change what is on the screen, except for the soft reset. */
+	if (scr->inter)
+	{
+		if (scr->inter == '!' && c == 'p')
+		{
+			scr->modes &= ~(M_INSERT|M_ORIGIN|M_NO_WRAP|M_APP_CURSOR|
+					M_APP_KEYPAD|M_HIDE_CURSOR);
+			scr->top = 0;
+			scr->bottom = scr->rows - 1;
+			cur->attr = 0;
+			cur->fg = cur->bg = 0;
+			cur->acs[0] = cur->acs[1] = cur->shift = 0;
+		}
+		return;
+	}
+	if (scr->private && scr->private != '?')
+		return;
+	if (scr->private == '?' && c != 'h' && c != 'l')
+		return;
+
+	switch (c)
+	{
+	case 'A':
+		move_to(scr, cur->row - param(scr, 0, 1) -
+			((scr->modes & M_ORIGIN) ? scr->top : 0), cur->col);
+		break;
+	case 'B':
+	case 'e':
+		move_to(scr, cur->row + param(scr, 0, 1) -
+			((scr->modes & M_ORIGIN) ? scr->top : 0), cur->col);
+		break;
+	case 'C':
+	case 'a':
+		move_to(scr, cur->row - ((scr->modes & M_ORIGIN) ? scr->top : 0),
+			cur->col + param(scr, 0, 1));
+		break;
+	case 'D':
+		move_to(scr, cur->row - ((scr->modes & M_ORIGIN) ? scr->top : 0),
+			cur->col - param(scr, 0, 1));
+		break;
+	case 'E':
+		move_to(scr, cur->row + param(scr, 0, 1) -
+			((scr->modes & M_ORIGIN) ? scr->top : 0), 0);
+		break;
+	case 'F':
+		move_to(scr, cur->row - param(scr, 0, 1) -
+			((scr->modes & M_ORIGIN) ? scr->top : 0), 0);
+		break;
+	case 'G':
+	case '`':
+		move_to(scr, cur->row - ((scr->modes & M_ORIGIN) ? scr->top : 0),
+			param(scr, 0, 1) - 1);
+		break;
+	case 'H':
+	case 'f':
+		move_to(scr, param(scr, 0, 1) - 1, param(scr, 1, 1) - 1);
+		break;
+	case 'd':
+		move_to(scr, param(scr, 0, 1) - 1, cur->col);
+		break;
+	case 'I':
+		for (n = param(scr, 0, 1); n > 0; --n)
+			cur->col = (cur->col / 8 + 1) * 8;
+		if (cur->col >= scr->cols)
+			cur->col = scr->cols - 1;
+		cur->wrapnext = 0;
+		break;
+	case 'Z':
+		for (n = param(scr, 0, 1); n > 0 && cur->col > 0; --n)
+			cur->col = (cur->col - 1) / 8 * 8;
+		cur->wrapnext = 0;
+		break;
+	case 'J':
+		n = scr->nparams ? scr->params[0] : 0;
+		if (n == 0)
+		{
+			erase_cells(scr, line, cur->col, scr->cols);
+			for (i = cur->row + 1; i < scr->rows; ++i)
+				erase_cells(scr, scr->lines[i], 0, scr->cols);
+		}
+		else if (n == 1)
+		{
+			erase_cells(scr, line, 0, cur->col + 1);
+			for (i = 0; i < cur->row; ++i)
+				erase_cells(scr, scr->lines[i], 0, scr->cols);
+		}
+		else if (n == 2 || n == 3)
+		{
+			for (i = 0; i < scr->rows; ++i)
+				erase_cells(scr, scr->lines[i], 0, scr->cols);
+		}
+		break;
+	case 'K':
+		n = scr->nparams ? scr->params[0] : 0;
+		if (n == 0)
+			erase_cells(scr, line, cur->col, scr->cols);
+		else if (n == 1)
+			erase_cells(scr, line, 0, cur->col + 1);
+		else if (n == 2)
+			erase_cells(scr, line, 0, scr->cols);
+		break;
+	case 'X':
+		n = param(scr, 0, 1);
+		if (n > scr->cols - cur->col)
+			n = scr->cols - cur->col;
+		erase_cells(scr, line, cur->col, cur->col + n);
+		break;
+	case '@':
+		n = param(scr, 0, 1);
+		if (n > scr->cols - cur->col)
+			n = scr->cols - cur->col;
+		memmove(line + cur->col + n, line + cur->col,
+			(scr->cols - cur->col - n) * sizeof(struct cell));
+		erase_cells(scr, line, cur->col, cur->col + n);
+		break;
+	case 'P':
+		n = param(scr, 0, 1);
+		if (n > scr->cols - cur->col)
+			n = scr->cols - cur->col;
+		memmove(line + cur->col, line + cur->col + n,
+			(scr->cols - cur->col - n) * sizeof(struct cell));
+		erase_cells(scr, line, scr->cols - n, scr->cols);
+		break;
+	case 'L':
+		if (cur->row >= scr->top && cur->row <= scr->bottom)
+			scroll_down(scr, cur->row, scr->bottom,
+				    param(scr, 0, 1));
+		cur->col = 0;
+		cur->wrapnext = 0;
+		break;
+	case 'M':
+		if (cur->row >= scr->top && cur->row <= scr->bottom)
+			scroll_up(scr, cur->row, scr->bottom, param(scr, 0, 1));
+		cur->col = 0;
+		cur->wrapnext = 0;
+		break;
+	case 'S':
+		scroll_up(scr, scr->top, scr->bottom, param(scr, 0, 1));
+		break;
+	case 'T':
+		scroll_down(scr, scr->top, scr->bottom, param(scr, 0, 1));
+		break;
+	case 'b':
+		/* Repeat the preceding character. */
+		if (cur->col > 0 || cur->wrapnext)
+		{
+			unsigned int ch = line[cur->wrapnext ? cur->col :
+					       cur->col - 1].ch;
+
+			for (n = param(scr, 0, 1); n > 0 && ch; --n)
+				put_char(scr, ch);
+		}
+		break;
+	case 'm':
+		set_attributes(scr);
+		break;
+	case 'h':
+	case 'l':
+		set_modes(scr, c == 'h');
+		break;
+	case 'r':
+	{
+		int top = param(scr, 0, 1) - 1;
+		int bottom = param(scr, 1, scr->rows) - 1;
+
+		if (bottom >= scr->rows)
+			bottom = scr->rows - 1;
+		if (top < bottom)
+		{
+			scr->top = top;
+			scr->bottom = bottom;
+			move_to(scr, 0, 0);
+		}
+		break;
+	}
+	case 's':
+		scr->saved = *cur;
+		break;
+	case 'u':
+		*cur = scr->saved;
+		break;
+	}
+}
+
+/* Handle the final byte of an ESC sequence. */
+static void
+esc_dispatch(struct screen *scr, int c)
+{
+	switch (c)
+	{
+	case '7':
+		scr->saved = scr->cur;
+		break;
+	case '8':
+		scr->cur = scr->saved;
+		break;
+	case 'D':
+		line_feed(scr);
+		break;
+	case 'E':
+		scr->cur.col = 0;
+		line_feed(scr);
+		break;
+	case 'M':
+		reverse_line_feed(scr);
+		break;
+	case 'c':
+		reset(scr);
+		break;
+	case '=':
+		scr->modes |= M_APP_KEYPAD;
+		break;
+	case '>':
+		scr->modes &= ~M_APP_KEYPAD;
+		break;
+	}
+}
+
+/* Handle a control character. */
+static void
+control(struct screen *scr, int c)
+{
+	struct cursor *cur = &scr->cur;
+
+	switch (c)
+	{
+	case '\b':
+		if (cur->wrapnext)
+			cur->wrapnext = 0;
+		else if (cur->col > 0)
+			cur->col--;
+		break;
+	case '\t':
+		cur->col = (cur->col / 8 + 1) * 8;
+		if (cur->col >= scr->cols)
+			cur->col = scr->cols - 1;
+		cur->wrapnext = 0;
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		line_feed(scr);
+		break;
+	case '\r':
+		cur->col = 0;
+		cur->wrapnext = 0;
+		break;
+	case 016:
+		cur->shift = 1;
+		break;
+	case 017:
+		cur->shift = 0;
+		break;
+	}
+}
+
+/* Feed output from the program to the screen model. */
+void
+screen_feed(struct screen *scr, const unsigned char *buf, size_t len)
+{
+	const unsigned char *end = buf + len;
+
+	while (buf < end)
+	{
+		int c = *buf++;
+
+		if (scr->state == S_GROUND)
+		{
+			/* The common case - plain text. */
+			if (c >= 0x20 && c < 0x7f && !scr->utf8_left)
+			{
+				const unsigned char *run = buf - 1;
+
+				while (buf < end && *buf >= 0x20 && *buf < 0x7f)
+					buf++;
+				put_ascii(scr, run, buf - run);
+				continue;
+			}
+			if (c >= 0x80)
+			{
+				if (scr->utf8_left && (c & 0xc0) == 0x80)
+				{
+					scr->utf8 = (scr->utf8 << 6) |
+						(c & 0x3f);
+					if (--scr->utf8_left == 0)
+						put_char(scr, scr->utf8);
+					continue;
+				}
+				scr->utf8_left = 0;
+				if ((c & 0xe0) == 0xc0)
+				{
+					scr->utf8 = c & 0x1f;
+					scr->utf8_left = 1;
+				}
+				else if ((c & 0xf0) == 0xe0)
+				{
+					scr->utf8 = c & 0x0f;
+					scr->utf8_left = 2;
+				}
+				else if ((c & 0xf8) == 0xf0)
+				{
+					scr->utf8 = c & 0x07;
+					scr->utf8_left = 3;
+				}
+				else
+					put_char(scr, 0xfffd);
+				continue;
+			}
+			if (scr->utf8_left)
+			{
+				/* A truncated sequence. */
+				scr->utf8_left = 0;
+				put_char(scr, 0xfffd);
+				if (c >= 0x20 && c < 0x7f)
+				{
+					put_char(scr, c);
+					continue;
+				}
+			}
+			if (c == 033)
+			{
+				scr->state = S_ESC;
+				scr->inter = 0;
+			}
+			else
+				control(scr, c);
+			continue;
+		}
+
+		/* Control characters are executed in the middle of escape
+		** sequences, and CAN/SUB abort them. */
+		if (c < 0x20 && c != 033 && scr->state != S_STRING &&
+		    scr->state != S_STRING_ESC)
+		{
+			if (c == 030 || c == 032)
+				scr->state = S_GROUND;
+			else
+				control(scr, c);
+			continue;
+		}
+
+		switch (scr->state)
+		{
+		case S_ESC:
+			if (c == '[')
+			{
+				scr->state = S_CSI;
+				scr->nparams = 0;
+				scr->private = 0;
+				scr->inter = 0;
+			}
+			else if (c == ']' || c == 'P' || c == '_' ||
+				 c == '^' || c == 'X')
+				scr->state = S_STRING;
+			else if (c == '(' || c == ')')
+			{
+				scr->inter = c;
+				scr->state = S_CHARSET;
+			}
+			else if (c >= 0x20 && c < 0x30)
+				scr->inter = c;
+			else if (c == 033)
+				scr->inter = 0;
+			else
+			{
+				if (!scr->inter)
+					esc_dispatch(scr, c);
+				scr->state = S_GROUND;
+			}
+			break;
+		case S_CHARSET:
+			scr->cur.acs[scr->inter == ')'] = (c == '0');
+			scr->state = S_GROUND;
+			break;
+		case S_CSI:
+			if (c >= '0' && c <= '9')
+			{
+				if (scr->nparams == 0)
+					scr->params[scr->nparams++] = 0;
+				if (scr->params[scr->nparams - 1] < 100000)
+					scr->params[scr->nparams - 1] =
+						scr->params[scr->nparams - 1] *
+						10 + (c - '0');
+			}
+			else if (c == ';' || c == ':')
+			{
+				if (scr->nparams == 0)
+					scr->params[scr->nparams++] = 0;
+				if (scr->nparams < MAX_PARAMS)
+					scr->params[scr->nparams++] = 0;
+			}
+			else if (c >= '<' && c <= '?')
+				scr->private = c;
+			else if (c >= 0x20 && c < 0x30)
+				scr->inter = c;
+			else if (c >= 0x40 && c < 0x7f)
+			{
+				csi_dispatch(scr, c);
+				scr->state = S_GROUND;
+			}
+			else if (c == 033)
+			{
+				scr->state = S_ESC;
+				scr->inter = 0;
+			}
+			break;
+		case S_STRING:
+			/* OSC, DCS and friends end with BEL or ST. */
+			if (c == 007)
+				scr->state = S_GROUND;
+			else if (c == 033)
+				scr->state = S_STRING_ESC;
+			break;
+		case S_STRING_ESC:
+			scr->state = (c == '\\') ? S_GROUND : S_STRING;
+			break;
+		}
+	}
+}
+
+/* Create a screen model of the given size. */
+struct screen *
+screen_new(int rows, int cols)
+{
+	struct screen *scr;
+
+	if (rows <= 0 || cols <= 0)
+	{
+		rows = 24;
+		cols = 80;
+	}
+	scr = calloc(1, sizeof(struct screen));
+	if (!scr)
+		return NULL;
+	scr->rows = rows;
+	scr->cols = cols;
+	scr->main_lines = alloc_lines(scr, rows, cols);
+	scr->alt_lines = alloc_lines(scr, rows, cols);
+	if (!scr->main_lines || !scr->alt_lines)
+	{
+		free_lines(scr->main_lines, rows);
+		free_lines(scr->alt_lines, rows);
+		free(scr);
+		return NULL;
+	}
+	scr->lines = scr->main_lines;
+	scr->bottom = rows - 1;
+	return scr;
+}
+
+/* Free a screen model. */
+void
+screen_free(struct screen *scr)
+{
+	if (!scr)
+		return;
+	free_lines(scr->main_lines, scr->rows);
+	free_lines(scr->alt_lines, scr->rows);
+	free(scr);
+}
+
+/* Copy the contents of a screen into a new one of a different size, keeping
+** the lines at the bottom like a terminal does. */
+static struct cell **
+resize_lines(struct screen *scr, struct cell **old, int rows, int cols,
+	     int shift)
+{
+	struct cell **lines;
+	int i, n = cols < scr->cols ? cols : scr->cols;
+
+	lines = alloc_lines(scr, rows, cols);
+	if (!lines)
+		return NULL;
+	for (i = 0; i < rows; ++i)
+	{
+		int from = i + shift;
+
+		if (from >= 0 && from < scr->rows)
+			memcpy(lines[i], old[from], n * sizeof(struct cell));
+	}
+	return lines;
+}
+
+/* Change the size of the screen, as the program will be told with
+** TIOCSWINSZ. */
+void
+screen_resize(struct screen *scr, int rows, int cols)
+{
+	struct cell **main_lines, **alt_lines;
+	int shift = 0;
+
+	if (rows <= 0 || cols <= 0 || (rows == scr->rows && cols == scr->cols))
+		return;
+
+	/* Keep the cursor on the screen by dropping lines from the top. */
+	if (scr->cur.row >= rows)
+		shift = scr->cur.row - rows + 1;
+
+	main_lines = resize_lines(scr, scr->main_lines, rows, cols,
+				  scr->alt ? 0 : shift);
+	alt_lines = resize_lines(scr, scr->alt_lines, rows, cols,
+				 scr->alt ? shift : 0);
+	if (!main_lines || !alt_lines)
+	{
+		free_lines(main_lines, rows);
+		free_lines(alt_lines, rows);
+		return;
+	}
+	free_lines(scr->main_lines, scr->rows);
+	free_lines(scr->alt_lines, scr->rows);
+	scr->main_lines = main_lines;
+	scr->alt_lines = alt_lines;
+	scr->lines = scr->alt ? alt_lines : main_lines;
+	scr->rows = rows;
+	scr->cols = cols;
+	scr->top = 0;
+	scr->bottom = rows - 1;
+
+	scr->cur.row -= shift;
+	if (scr->cur.col >= cols)
+		scr->cur.col = cols - 1;
+	scr->cur.wrapnext = 0;
+	if (scr->saved.row >= rows)
+		scr->saved.row = rows - 1;
+	if (scr->saved.col >= cols)
+		scr->saved.col = cols - 1;
+	if (scr->alt_saved.row >= rows)
+		scr->alt_saved.row = rows - 1;
+	if (scr->alt_saved.col >= cols)
+		scr->alt_saved.col = cols - 1;
+}
+
+static void
+sbuf_add(struct sbuf *sb, const void *data, size_t len)
+{
+	if (sb->failed)
+		return;
+	if (sb->len + len > sb->size)
+	{
+		size_t size = sb->size ? sb->size : 16384;
+		unsigned char *ndata;
+
+		while (size < sb->len + len)
+			size *= 2;
+		ndata = realloc(sb->data, size);
+		if (!ndata)
+		{
+			sb->failed = 1;
+			return;
+		}
+		sb->data = ndata;
+		sb->size = size;
+	}
+	memcpy(sb->data + sb->len, data, len);
+	sb->len += len;
+}
+
+static void
+sbuf_printf(struct sbuf *sb, const char *fmt, int a, int b)
+{
+	char tmp[64];
+	int n;
+
+	n = snprintf(tmp, sizeof(tmp), fmt, a, b);
+	if (n > 0)
+		sbuf_add(sb, tmp, n);
+}
+
+/* Add the SGR parameters for a color. */
+static void
+sbuf_color(struct sbuf *sb, unsigned int color, int base)
+{
+	char tmp[32];
+	int n;
+
+	if (color & COLOR_RGB)
+		n = snprintf(tmp, sizeof(tmp), ";%d;2;%u;%u;%u", base + 8,
+			     (color >> 16) & 0xff, (color >> 8) & 0xff,
+			     color & 0xff);
+	else if (color <= 8)
+		n = snprintf(tmp, sizeof(tmp), ";%u", base + color - 1);
+	else
+		n = snprintf(tmp, sizeof(tmp), ";%d;5;%u", base + 8,
+			     color - 1);
+	if (n > 0)
+		sbuf_add(sb, tmp, n);
+}
+
+/* Add an SGR sequence that selects the given rendition from scratch. */
+static void
+sbuf_rendition(struct sbuf *sb, unsigned short attr, unsigned int fg,
+	       unsigned int bg)
+{
+	static const struct
+	{
+		unsigned short attr;
+		const char *code;
+	} codes[] = {
+		{ A_BOLD, ";1" }, { A_DIM, ";2" }, { A_ITALIC, ";3" },
+		{ A_UNDERLINE, ";4" }, { A_BLINK, ";5" }, { A_REVERSE, ";7" },
+		{ A_INVISIBLE, ";8" }, { A_STRIKE, ";9" },
+	};
+	unsigned int i;
+
+	sbuf_add(sb, "\033[0", 3);
+	for (i = 0; i < sizeof(codes) / sizeof(codes[0]); ++i)
+	{
+		if (attr & codes[i].attr)
+			sbuf_add(sb, codes[i].code, 2);
+	}
+	if (fg)
+		sbuf_color(sb, fg, 30);
+	if (bg)
+		sbuf_color(sb, bg, 40);
+	sbuf_add(sb, "m", 1);
+}
+
+/* Add a character, encoded as UTF-8. */
+static void
+sbuf_char(struct sbuf *sb, unsigned int ch)
+{
+	unsigned char tmp[4];
+	size_t n;
+
+	if (ch < 0x80)
+	{
+		tmp[0] = ch;
+		n = 1;
+	}
+	else if (ch < 0x800)
+	{
+		tmp[0] = 0xc0 | (ch >> 6);
+		tmp[1] = 0x80 | (ch & 0x3f);
+		n = 2;
+	}
+	else if (ch < 0x10000)
+	{
+		tmp[0] = 0xe0 | (ch >> 12);
+		tmp[1] = 0x80 | ((ch >> 6) & 0x3f);
+		tmp[2] = 0x80 | (ch & 0x3f);
+		n = 3;
+	}
+	else
+	{
+		tmp[0] = 0xf0 | (ch >> 18);
+		tmp[1] = 0x80 | ((ch >> 12) & 0x3f);
+		tmp[2] = 0x80 | ((ch >> 6) & 0x3f);
+		tmp[3] = 0x80 | (ch & 0x3f);
+		n = 4;
+	}
+	sbuf_add(sb, tmp, n);
+}
+
+/* Paint one of the screens. Cells that are blank with the default
+** rendition at the end of a line are left to the preceding clear. */
+static void
+paint_lines(struct screen *scr, struct sbuf *sb, struct cell **lines)
+{
+	int row, col, acs = 0;
+	unsigned short attr = 0;
+	unsigned int fg = 0, bg = 0;
+
+	sbuf_add(sb, "\033[0m\033[H\033[2J", 11);
+	for (row = 0; row < scr->rows; ++row)
+	{
+		struct cell *line = lines[row];
+		int last = scr->cols - 1;
+
+		while (last >= 0 && line[last].ch == ' ' &&
+		       line[last].attr == 0 && line[last].bg == 0)
+			last--;
+		if (last < 0)
+			continue;
+
+		sbuf_printf(sb, "\033[%d;%dH", row + 1, 1);
+		for (col = 0; col <= last; ++col)
+		{
+			struct cell *cell = line + col;
+			unsigned short cattr = cell->attr & ~(A_ACS|A_WIDE_CONT);
+
+			if (cell->attr & A_WIDE_CONT)
+				continue;
+			if (cattr != attr || cell->fg != fg || cell->bg != bg)
+			{
+				sbuf_rendition(sb, cattr, cell->fg, cell->bg);
+				attr = cattr;
+				fg = cell->fg;
+				bg = cell->bg;
+			}
+			if (!!(cell->attr & A_ACS) != acs)
+			{
+				acs = !acs;
+				sbuf_add(sb, acs ? "\033(0" : "\033(B", 3);
+			}
+			sbuf_char(sb, cell->ch ? cell->ch : ' ');
+		}
+	}
+	if (acs)
+		sbuf_add(sb, "\033(B", 3);
+	sbuf_add(sb, "\033[0m", 4);
+}
+
+/* Turn the screen into a stream of escape sequences that reproduces it on a
+** terminal that was just cleared. Returns the length of the stream, which is
+** stored in *out and must be freed by the caller, or 0 on failure. */
+size_t
+screen_snapshot(struct screen *scr, unsigned char **out)
+{
+	static const struct
+	{
+		int mode;
+		const char *on;
+	} modes[] = {
+		{ M_APP_CURSOR,		"\033[?1h" },
+		{ M_APP_KEYPAD,		"\033=" },
+		{ M_HIDE_CURSOR,	"\033[?25l" },
+		{ M_NO_WRAP,		"\033[?7l" },
+		{ M_INSERT,		"\033[4h" },
+		{ M_PASTE,		"\033[?2004h" },
+		{ M_MOUSE_X10,		"\033[?9h" },
+		{ M_MOUSE_NORMAL,	"\033[?1000h" },
+		{ M_MOUSE_BUTTON,	"\033[?1002h" },
+		{ M_MOUSE_ANY,		"\033[?1003h" },
+		{ M_MOUSE_SGR,		"\033[?1006h" },
+		{ M_FOCUS,		"\033[?1004h" },
+	};
+	struct sbuf sb;
+	struct cursor *cur = &scr->cur;
+	unsigned int i;
+
+	memset(&sb, 0, sizeof(sb));
+
+	/* Paint the main screen, and the alternate one on top of it if it is
+	** being displayed, so that the client has both. */
+	sbuf_add(&sb, "\033[?1049l\033[r", 11);
+	paint_lines(scr, &sb, scr->main_lines);
+	if (scr->alt)
+	{
+		sbuf_add(&sb, "\033[?1049h", 8);
+		paint_lines(scr, &sb, scr->alt_lines);
+	}
+
+	/* Restore the modes, the scrolling region, the character sets and the
+	** rendition, and finally the cursor. */
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+	{
+		if (scr->modes & modes[i].mode)
+			sbuf_add(&sb, modes[i].on, strlen(modes[i].on));
+	}
+	if (scr->top != 0 || scr->bottom != scr->rows - 1)
+		sbuf_printf(&sb, "\033[%d;%dr", scr->top + 1, scr->bottom + 1);
+	if (cur->acs[0])
+		sbuf_add(&sb, "\033(0", 3);
+	if (cur->acs[1])
+		sbuf_add(&sb, "\033)0", 3);
+	if (cur->shift)
+		sbuf_add(&sb, "\016", 1);
+	sbuf_rendition(&sb, cur->attr, cur->fg, cur->bg);
+	if (scr->modes & M_ORIGIN)
+	{
+		sbuf_add(&sb, "\033[?6h", 5);
+		sbuf_printf(&sb, "\033[%d;%dH", cur->row - scr->top + 1,
+			    cur->col + 1);
+	}
+	else
+		sbuf_printf(&sb, "\033[%d;%dH", cur->row + 1, cur->col + 1);
+
+	if (sb.failed)
+	{
+		free(sb.data);
+		return 0;
+	}
+	*out = sb.data;
+	return sb.len;
+}
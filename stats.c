@@ -0,0 +1,123 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dtach.h"
+#include <stdarg.h>
+
+/*
+** Helpers for the stats the master reports, in the Prometheus text format.
+** Keeping the numbers is meant to be cheap enough to always do, so the
+** histograms have fixed power of two buckets and the work of turning them
+** into text is only done when somebody asks.
+*/
+
+/* Count a value in a histogram. */
+void
+hist_add(struct histogram *h, unsigned long long value)
+{
+	int i = 0;
+
+	while (i < HIST_BUCKETS && value > ((unsigned long long)h->unit << i))
+		++i;
+	h->bucket[i]++;
+	h->count++;
+	h->sum += value;
+}
+
+/* Append to a growing text buffer. Running out of memory leaves it as it
+** was. */
+void
+text_printf(struct text *t, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;)
+	{
+		va_start(ap, fmt);
+		n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (t->len + n < t->size)
+		{
+			t->len += n;
+			return;
+		}
+		else
+		{
+			size_t size = t->size ? t->size * 2 : 4096;
+			char *buf;
+
+			while (size <= t->len + n)
+				size *= 2;
+			buf = realloc(t->buf, size);
+			if (!buf)
+				return;
+			t->buf = buf;
+			t->size = size;
+		}
+	}
+}
+
+/* Describe a metric. */
+void
+stats_header(struct text *t, const char *name, const char *type,
+	     const char *help)
+{
+	text_printf(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Write a counter or a gauge without labels. */
+void
+stats_value(struct text *t, const char *name, const char *type,
+	    const char *help, unsigned long long value)
+{
+	stats_header(t, name, type, help);
+	text_printf(t, "%s %llu\n", name, value);
+}
+
+/* Write a counter of microseconds, in seconds. */
+void
+stats_seconds(struct text *t, const char *name, const char *help,
+	      unsigned long long usec)
+{
+	stats_header(t, name, "counter", help);
+	text_printf(t, "%s %.15g\n", name, (double)usec / 1e6);
+}
+
+/* Write a histogram. Its values are divided by scale, so that durations
+** kept in microseconds come out in seconds. */
+void
+stats_histogram(struct text *t, const char *name, const char *help,
+		const struct histogram *h, double scale)
+{
+	unsigned long long total = 0;
+	int i;
+
+	stats_header(t, name, "histogram", help);
+	for (i = 0; i < HIST_BUCKETS; ++i)
+	{
+		total += h->bucket[i];
+		text_printf(t, "%s_bucket{le=\"%.15g\"} %llu\n", name,
+			    (double)((unsigned long long)h->unit << i) / scale,
+			    total);
+	}
+	text_printf(t, "%s_bucket{le=\"+Inf\"} %llu\n", name, h->count);
+	text_printf(t, "%s_sum %.15g\n", name, (double)h->sum / scale);
+	text_printf(t, "%s_count %llu\n", name, h->count);
+}
@@ -0,0 +1,134 @@
+/*
+    dtach - A simple program that emulates the detach feature of screen.
+    Copyright (C) 2004-2016 Ned T. Crigler
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "../dtach.h"
+
+/*
+** Tests for the matcher behind dtach -w and dtach -x, run by `make check'.
+** The master feeds the matcher only while someone is waiting, which the
+** tests do the same way.
+*/
+
+char *progname;
+
+static int failed;
+
+/* Feed a string to the matcher, the way the master does: not at all when
+** nobody is waiting. */
+static void
+feed(struct matcher *m, int nwaiting, const char *str)
+{
+	if (nwaiting)
+		matcher_feed(m, (const unsigned char *)str, strlen(str));
+}
+
+static struct pattern *
+get(struct matcher *m, const char *str)
+{
+	struct pattern *pat;
+
+	pat = pattern_get(m, (const unsigned char *)str, strlen(str));
+	if (!pat)
+	{
+		printf("%s: pattern_get: %s\n", progname, strerror(errno));
+		exit(1);
+	}
+	return pat;
+}
+
+static void
+check(const char *name, int ok)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", name);
+	if (!ok)
+		failed = 1;
+}
+
+/* A pattern split across two pieces of output is found. */
+static void
+test_split(void)
+{
+	struct matcher *m = matcher_new();
+	struct pattern *a = get(m, "READY");
+
+	feed(m, 1, "xxREA");
+	check("split: not yet", !pattern_matched(a));
+	feed(m, 1, "DYxx");
+	check("split: found", pattern_matched(a) && pattern_end(a) == 2);
+	pattern_put(m, a);
+	matcher_free(m);
+}
+
+/* The output seen by a waiter that has gone must not be joined to the
+** output seen by the next one. */
+static void
+test_stale_tail(void)
+{
+	struct matcher *m = matcher_new();
+	struct pattern *a, *b;
+
+	a = get(m, "ZZZZZZZZ");
+	feed(m, 1, "READ");
+	pattern_put(m, a);
+	feed(m, 0, "xyz unrelated");
+	b = get(m, "READY");
+	feed(m, 1, "Y");
+	check("stale tail: no match", !pattern_matched(b));
+	feed(m, 1, " READY");
+	check("stale tail: later match", pattern_matched(b));
+	pattern_put(m, b);
+	matcher_free(m);
+}
+
+/* A new waiter must not match output from before it asked, even while
+** another waiter keeps the tail alive. */
+static void
+test_before_start(void)
+{
+	struct matcher *m = matcher_new();
+	struct pattern *a, *b, *c;
+
+	a = get(m, "QQQQQQQQ");
+	feed(m, 1, "READ");
+	b = get(m, "READY");
+	feed(m, 1, "Y");
+	check("before start: no match", !pattern_matched(b));
+
+	/* A waiter for the same text asking later gets a pattern of its
+	** own, which only counts what comes after. */
+	feed(m, 1, "RE");
+	c = get(m, "READY");
+	check("before start: not shared", b != c);
+	feed(m, 1, "ADY");
+	check("before start: earlier waiter", pattern_matched(b));
+	check("before start: later waiter", !pattern_matched(c));
+	pattern_put(m, c);
+	pattern_put(m, b);
+	pattern_put(m, a);
+	matcher_free(m);
+}
+
+int
+main(int argc, char **argv)
+{
+	(void)argc;
+	progname = argv[0];
+	test_split();
+	test_stale_tail();
+	test_before_start();
+	return failed;
+}